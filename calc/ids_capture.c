@@ -5,6 +5,9 @@ packed 10 and 12 bit IDS camera images to regular 16-bit images.
 Here is the raw formats description:
 https://www.1stvision.com/cameras/IDS/IDS-manuals/en/basics-monochrome-pixel-formats.html
 
+The last packed frame is also saved as is (RAW_FILENAME)
+to be used by the unpacking throughput benchmark in ids_unpack.c.
+
 */
 
 #include <stdio.h>
@@ -37,6 +40,7 @@ https://www.1stvision.com/cameras/IDS/IDS-manuals/en/basics-monochrome-pixel-for
 #elif defined(BITS_10)
     #define BITS 10
     #define FILENAME "ids_capture_10b.pgm"
+    #define RAW_FILENAME "ids_capture_10b.raw"
     #define PIXEL_FORMAT PEAK_PIXEL_FORMAT_MONO10G40_IDS
     typedef uint16_t pixel;
     typedef struct { uint8_t b0, b1, b2, b3, b4; } PixelGroupSrc;
@@ -49,6 +53,7 @@ https://www.1stvision.com/cameras/IDS/IDS-manuals/en/basics-monochrome-pixel-for
 #elif defined(BITS_12)
     #define BITS 12
     #define FILENAME "ids_capture_12b.pgm"
+    #define RAW_FILENAME "ids_capture_12b.raw"
     #define PIXEL_FORMAT PEAK_PIXEL_FORMAT_MONO12G24_IDS
     typedef uint16_t pixel;
     typedef struct { uint8_t b0, b1, b2; } PixelGroupSrc;
@@ -303,6 +308,14 @@ int main() {
         }
     #endif
         elapsed += (clock() - tm)/(double)CLOCKS_PER_SEC;
+    #ifdef RAW_FILENAME
+        if (i == FRAMES-1) {
+            FILE *f = fopen(RAW_FILENAME, "wb");
+            if (!f || fwrite(b, 1, buf.memorySize, f) != buf.memorySize)
+                printf("ERR: Unable to write %s\n", RAW_FILENAME);
+            if (f) fclose(f);
+        }
+    #endif
         res = peak_Frame_Release(hCam, frame);
         CHECK_ERR("Release frame")
     }
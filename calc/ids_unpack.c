@@ -0,0 +1,154 @@
+/*
+
+Throughput benchmark for unpacking of IDS Mono10g40 and Mono12g24 images into 16-bit ones.
+Formats and the first scalar experiments are in ids_capture.c.
+
+Unpackers of beam_calc library are run on every SIMD level supported by CPU
+and their results are checked against the reference scalar loop.
+Frames saved by ids_capture.c (RAW_10 and RAW_12) are used when they exist,
+otherwise frames of random bytes are generated.
+Then sizes which are not a multiple of vector width are checked for correct tails.
+
+GCC vectorizes the scalar 12g24 loop by itself, so explicit shuffles give less there.
+Both formats are limited by memory bandwidth at avx2 level already,
+the 16-bit target frame is 10.6MB, far beyond caches.
+
+--------------------------------------
+GCC 12.2x64 Intel Xeon (AVX-512) 2.10GHz
+
+Frames: 100
+Mono10g40 (random): 6635520 bytes, 5308416 pixels
+  scalar       Elapsed: 0.554s, 5.54ms/frame, 1198 MB/s
+  sse4.2       Elapsed: 0.223s, 2.23ms/frame, 2972 MB/s
+  avx2         Elapsed: 0.154s, 1.54ms/frame, 4310 MB/s
+  avx512       Elapsed: 0.141s, 1.41ms/frame, 4692 MB/s
+Mono12g24 (random): 7962624 bytes, 5308416 pixels
+  scalar       Elapsed: 0.237s, 2.37ms/frame, 3355 MB/s
+  sse4.2       Elapsed: 0.225s, 2.25ms/frame, 3544 MB/s
+  avx2         Elapsed: 0.165s, 1.65ms/frame, 4834 MB/s
+  avx512       Elapsed: 0.156s, 1.56ms/frame, 5102 MB/s
+Tails: OK
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "beam_calc.h"
+#include "beam_calc_int.h"
+
+#define FRAMES 100
+#define W 2592
+#define H 2048
+#define RAW_10 "ids_capture_10b.raw"
+#define RAW_12 "ids_capture_12b.raw"
+
+static void ref_10g40(const uint8_t *b, int sz, uint16_t *p) {
+    for (int i = 0, j = 0; i + 5 <= sz; i += 5) {
+        p[j++] = ((b[i+4] & 0b00000011) >> 0) | (b[i+0] << 2);
+        p[j++] = ((b[i+4] & 0b00001100) >> 2) | (b[i+1] << 2);
+        p[j++] = ((b[i+4] & 0b00110000) >> 4) | (b[i+2] << 2);
+        p[j++] = ((b[i+4] & 0b11000000) >> 6) | (b[i+3] << 2);
+    }
+}
+
+static void ref_12g24(const uint8_t *b, int sz, uint16_t *p) {
+    for (int i = 0, j = 0; i + 3 <= sz; i += 3) {
+        p[j++] = (b[i+2] & 0x0F) | (b[i+0] << 4);
+        p[j++] = (b[i+2] >> 4) | (b[i+1] << 4);
+    }
+}
+
+typedef void (*Ref)(const uint8_t *src, int sz, uint16_t *dst);
+typedef void (*Convert)(uint8_t *dst, uint8_t *src, int sz);
+
+static uint8_t* load_raw(const char *filename, int *sz) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *sz = ftell(f);
+    rewind(f);
+    uint8_t *buf = (uint8_t*)malloc(*sz);
+    if (buf && fread(buf, 1, *sz, f) != *sz) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+static int bench(const char *name, const char *filename, int group_bytes, Ref ref, Convert convert) {
+    int sz;
+    const char *origin = "captured";
+    uint8_t *src = load_raw(filename, &sz);
+    if (!src) {
+        origin = "random";
+        sz = W*H/(group_bytes == 5 ? 4 : 2)*group_bytes;
+        src = (uint8_t*)malloc(sz);
+        if (!src) {
+            perror("Unable to allocate source");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < sz; i++) src[i] = rand();
+    }
+    const int px = sz/group_bytes*(group_bytes == 5 ? 4 : 2);
+    uint16_t *expected = (uint16_t*)malloc(px*2);
+    uint16_t *actual = (uint16_t*)malloc(px*2);
+    if (!expected || !actual) {
+        perror("Unable to allocate target");
+        exit(EXIT_FAILURE);
+    }
+    ref(src, sz, expected);
+    printf("%s (%s): %d bytes, %d pixels\n", name, origin, sz, px);
+
+    int ok = 1;
+    for (int level = 0; level < CGN_SIMD_COUNT; level++) {
+        if (cgn_select_kernels(level) != level)
+            continue;
+        memset(actual, 0, px*2);
+        clock_t tm = clock();
+        for (int i = 0; i < FRAMES; i++)
+            convert((uint8_t*)actual, src, sz);
+        double elapsed = (clock() - tm)/(double)CLOCKS_PER_SEC;
+        printf("  %-12s Elapsed: %.3fs, %.2fms/frame, %.0f MB/s\n", cgn_simd_name(level),
+            elapsed, elapsed/(double)FRAMES*1000, sz/(elapsed/FRAMES)/1e6);
+        if (memcmp(actual, expected, px*2) != 0) {
+            printf("  %s: MISMATCH\n", cgn_simd_name(level));
+            ok = 0;
+        }
+    }
+
+    // Every whole number of groups up to a few vectors, sentinels must stay untouched
+    for (int level = 0; level < CGN_SIMD_COUNT; level++) {
+        if (cgn_select_kernels(level) != level)
+            continue;
+        for (int n = 0; n <= 40*group_bytes && n <= sz; n++) {
+            const int np = n/group_bytes*(group_bytes == 5 ? 4 : 2);
+            for (int i = 0; i < np + 8; i++) actual[i] = 0xFFFF;
+            convert((uint8_t*)actual, src, n);
+            int bad = memcmp(actual, expected, np*2) != 0;
+            for (int i = np; i < np + 8; i++) bad |= actual[i] != 0xFFFF;
+            if (bad) {
+                printf("  %s: TAIL MISMATCH at %d bytes\n", cgn_simd_name(level), n);
+                ok = 0;
+                break;
+            }
+        }
+    }
+    cgn_select_kernels(CGN_SIMD_COUNT);
+
+    free(src);
+    free(expected);
+    free(actual);
+    return ok;
+}
+
+int main() {
+    printf("Frames: %d\n", FRAMES);
+    int ok = bench("Mono10g40", RAW_10, 5, ref_10g40, cgn_convert_10g40_to_u16);
+    ok &= bench("Mono12g24", RAW_12, 3, ref_12g24, cgn_convert_12g24_to_u16);
+    printf("Tails: %s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
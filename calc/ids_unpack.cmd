@@ -0,0 +1,2 @@
+set SRC=..\libs\beam_calc
+gcc -O3 -ffast-math -funsafe-math-optimizations -msse4.2 -Wa,-muse-unaligned-vector-move -o ids_unpack ids_unpack.c %SRC%\beam_calc.c %SRC%\beam_calc_simd.c %SRC%\beam_calc_pool.c -I%SRC% -pthread && ids_unpack
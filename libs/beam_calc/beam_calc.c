@@ -1,6 +1,8 @@
 #include "beam_calc.h"
+#include "beam_calc_int.h"
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef USE_BLAS
@@ -12,55 +14,449 @@
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
-#define cgn_calc_beam                                              \
-    double p = 0;                                                  \
-    double xc = 0;                                                 \
-    double yc = 0;                                                 \
-    for (int i = r->y1; i < r->y2; i++) {                          \
-        const int offset = i * c->w;                               \
-        for (int j = r->x1; j < r->x2; j++) {                      \
-            p += buf[offset + j];                                  \
-            xc += buf[offset + j] * j;                             \
-            yc += buf[offset + j] * i;                             \
-        }                                                          \
-    }                                                              \
-    xc /= p;                                                       \
-    yc /= p;                                                       \
-    double xx = 0;                                                 \
-    double yy = 0;                                                 \
-    double xy = 0;                                                 \
-    for (int i = r->y1; i < r->y2; i++) {                          \
-        const int offset = i * c->w;                               \
-        for (int j = r->x1; j < r->x2; j++) {                      \
-            xx += buf[offset + j] * sqr(j - xc);                   \
-            xy += buf[offset + j] * (j - xc)*(i - yc);             \
-            yy += buf[offset + j] * sqr(i - yc);                   \
-        }                                                          \
-    }                                                              \
-    xx /= p;                                                       \
-    xy /= p;                                                       \
-    yy /= p;                                                       \
-    double ss = sign(xx - yy) * sqrt(sqr(xx - yy) + 4*sqr(xy));    \
-    r->dx = 2.8284271247461903 * sqrt(xx + yy + ss);               \
-    r->dy = 2.8284271247461903 * sqrt(xx + yy - ss);               \
-    r->phi = 0.5 * atan(2 * xy / (xx - yy)) * 57.29577951308232;   \
-    r->xc = xc;                                                    \
-    r->yc = yc;                                                    \
-    r->xx = xx;                                                    \
-    r->yy = yy;                                                    \
-    r->xy = xy;                                                    \
+// Raw moments of a pixel rectangle accumulated in a single pass.
+// Coordinates are taken relative to the rectangle center (or the aperture center
+// for summed-area tables, see cgn_calc_beam_finish), so that sums stay small
+// and the centering afterwards does not lose precision.
+typedef struct {
+    double p;
+    double x;
+    double y;
+    double xx;
+    double yy;
+    double xy;
+
+    // Number of pixels above the background threshold,
+    // it is only counted when the background is subtracted on the fly.
+    double n;
+} CgnBeamMoments;
+
+// Adds sums s0 = sum(p), s1 = sum(p*x), s2 = sum(p*x^2) of row `y`.
+static inline void cgn_moments_add_row(CgnBeamMoments *m, double s0, double s1, double s2, double y) {
+    m->p += s0;
+    m->x += s1;
+    m->y += s0 * y;
+    m->xx += s2;
+    m->yy += s0 * y * y;
+    m->xy += s1 * y;
+}
+
+static inline void cgn_moments_add(CgnBeamMoments *m, const CgnBeamMoments *a, double k) {
+    m->p += k * a->p;
+    m->x += k * a->x;
+    m->y += k * a->y;
+    m->xx += k * a->xx;
+    m->yy += k * a->yy;
+    m->xy += k * a->xy;
+    m->n += k * a->n;
+}
+
+// Exact sums of integer pixels for the deterministic mode. Sums over pixels above the threshold
+// of their count and coordinates are kept apart from pixel sums, and the background is only
+// subtracted when they are converted into doubles by cgn_exact_moments().
+typedef struct {
+    __int128 p, x, y, xx, yy, xy;
+    __int128 n, nx, ny, nxx, nyy, nxy;
+} CgnExactMoments;
+
+// Adds row sums as given by masked kernels, s[3..5] are zeros for kernels of all pixels.
+static inline void cgn_exact_add_row(CgnExactMoments *e, const int64_t *s, int64_t y) {
+    e->p += s[0];
+    e->x += s[1];
+    e->y += (__int128)s[0] * y;
+    e->xx += s[2];
+    e->yy += (__int128)s[0] * (y * y);
+    e->xy += (__int128)s[1] * y;
+    e->n += s[3];
+    e->nx += s[4];
+    e->ny += (__int128)s[3] * y;
+    e->nxx += s[5];
+    e->nyy += (__int128)s[3] * (y * y);
+    e->nxy += (__int128)s[4] * y;
+}
+
+static inline void cgn_exact_add(CgnExactMoments *e, const CgnExactMoments *a) {
+    e->p += a->p;
+    e->x += a->x;
+    e->y += a->y;
+    e->xx += a->xx;
+    e->yy += a->yy;
+    e->xy += a->xy;
+    e->n += a->n;
+    e->nx += a->nx;
+    e->ny += a->ny;
+    e->nxx += a->nxx;
+    e->nyy += a->nyy;
+    e->nxy += a->nxy;
+}
+
+// Moments of pixels with background `mean` subtracted. Its integer part is subtracted exactly,
+// so only the fraction is applied to rounded sums and cancellation between close sums is avoided.
+static void cgn_exact_moments(const CgnExactMoments *e, double mean, CgnBeamMoments *m) {
+    const int64_t q = (int64_t)floor(mean);
+    const double f = mean - q;
+    m->p = (double)(e->p - q*e->n) - f*(double)e->n;
+    m->x = (double)(e->x - q*e->nx) - f*(double)e->nx;
+    m->y = (double)(e->y - q*e->ny) - f*(double)e->ny;
+    m->xx = (double)(e->xx - q*e->nxx) - f*(double)e->nxx;
+    m->yy = (double)(e->yy - q*e->nyy) - f*(double)e->nyy;
+    m->xy = (double)(e->xy - q*e->nxy) - f*(double)e->nxy;
+    m->n = (double)e->n;
+}
+
+// Converts raw moments taken relative to [ox, oy] into central ones and then into beam parameters.
+// The rectangle is centered on the beam during mask iterations,
+// so the raw moments are almost central already and `E[x^2] - E[x]^2`
+// does not suffer from catastrophic cancellation.
+static void cgn_calc_beam_finish(const CgnBeamMoments *m, int ox, int oy, CgnBeamResult *r) {
+    const double p = m->p;
+    const double xc = m->x / p;
+    const double yc = m->y / p;
+    const double xx = m->xx / p - sqr(xc);
+    const double yy = m->yy / p - sqr(yc);
+    const double xy = m->xy / p - xc * yc;
+    const double ss = sign(xx - yy) * sqrt(sqr(xx - yy) + 4*sqr(xy));
+    r->dx = 2.8284271247461903 * sqrt(xx + yy + ss);
+    r->dy = 2.8284271247461903 * sqrt(xx + yy - ss);
+    r->phi = 0.5 * atan(2 * xy / (xx - yy)) * 57.29577951308232;
+    r->xc = xc + ox;
+    r->yc = yc + oy;
+    r->xx = xx;
+    r->yy = yy;
+    r->xy = xy;
     r->p = p;
+}
+
+// Frames are processed in bands of rows small enough to stay in L2 cache.
+// Band boundaries depend only on the frame size but not on the number of threads,
+// and partial sums of bands are always merged in band order,
+// so results are bit-identical with or without a worker pool.
+#define CGN_BAND_BYTES (256*1024)
+#define CGN_MAX_BANDS 512
+
+typedef struct {
+    int rows;  // rows per band
+    int first; // index of the first band
+    int count; // number of bands
+    int y1, y2;
+} CgnBands;
+
+static void cgn_make_bands(const CgnBeamCalc *c, int y1, int y2, CgnBands *b) {
+    int rows = CGN_BAND_BYTES / (c->w * (int)sizeof(double));
+    rows = max(rows, 4);
+    rows = max(rows, (c->h + CGN_MAX_BANDS - 1) / CGN_MAX_BANDS);
+    b->rows = rows;
+    b->first = y1 / rows;
+    b->count = y2 > y1 ? (y2 - 1) / rows - b->first + 1 : 0;
+    b->y1 = y1;
+    b->y2 = y2;
+}
+
+// Rows [i1, i2) of the band, clamped to the bands range.
+static inline void cgn_band_rows(const CgnBands *b, int band, int *i1, int *i2) {
+    const int i = (b->first + band) * b->rows;
+    *i1 = max(i, b->y1);
+    *i2 = min(i + b->rows, b->y2);
+}
+
+// Decodes pixels [x1, x2) of row `i` of a packed frame into `tmp` of `w` pixels.
+// Decoding starts from the pixel group containing `x1`, the returned pointer is to `x1` in `tmp`.
+static const uint16_t* cgn_unpack_row(const CgnBeamCalc *c, const uint8_t *buf, int i, int x1, int x2, uint16_t *tmp) {
+    const int packed10 = c->packing == CGN_PACKED_10G40;
+    const int gp = packed10 ? 4 : 2; // pixels per group
+    const int gb = packed10 ? 5 : 3; // bytes per group
+    const int g1 = x1 / gp;
+    const int g2 = (x2 + gp - 1) / gp;
+    uint8_t *src = (uint8_t*)buf + (i*(c->w/gp) + g1) * gb;
+    if (packed10) {
+        cgn_convert_10g40_to_u16((uint8_t*)tmp, src, (g2 - g1) * gb);
+    } else {
+        cgn_convert_12g24_to_u16((uint8_t*)tmp, src, (g2 - g1) * gb);
+    }
+    return tmp + x1 - g1*gp;
+}
+
+// Raw pixels [x1, x2) of row `i`, packed frames are decoded into `tmp`.
+static inline const uint16_t* cgn_raw_row_u16(const CgnBeamCalc *c, const uint16_t *buf, int i, int x1, int x2, uint16_t *tmp) {
+    if (c->packing)
+        return cgn_unpack_row(c, (const uint8_t*)buf, i, x1, x2, tmp);
+    return buf + i*c->w + x1;
+}
+
+static inline const uint8_t* cgn_raw_row_u8(const CgnBeamCalc *c, const uint8_t *buf, int i, int x1, int x2, uint16_t *tmp) {
+    return buf + i*c->w + x1;
+}
+
+// Correction of pixels of row `i` starting from `x1` for kernels.
+static inline CgnRowDark cgn_row_dark(const CgnBeamCalc *c, int i, int x1) {
+    const int k = i*c->w + x1;
+    const CgnRowDark d = {c->dark + k, c->gain ? c->gain + k : NULL, c->dark_level, (1 << c->bpp) - 1};
+    return d;
+}
+
+// Pixels [x1, x2) of row `i`, band passes get them by these functions
+// so that packed frames are decoded and the dark frame is subtracted row by row while being processed.
+// The `tmp` buffer should have cgn_row_tmp() pixels.
+static inline const uint16_t* cgn_row_u16(const CgnBeamCalc *c, const uint16_t *buf, int i, int x1, int x2, uint16_t *tmp) {
+    const uint16_t *row = cgn_raw_row_u16(c, buf, i, x1, x2, tmp);
+    if (!c->dark)
+        return row;
+    // Decoded rows are corrected in place
+    uint16_t *dst = c->packing ? (uint16_t*)row : tmp;
+    const CgnRowDark k = cgn_row_dark(c, i, x1);
+    cgn_kernels.correct_u16(row, &k, x2 - x1, dst);
+    return dst;
+}
+
+static inline const uint8_t* cgn_row_u8(const CgnBeamCalc *c, const uint8_t *buf, int i, int x1, int x2, uint16_t *tmp) {
+    const uint8_t *row = cgn_raw_row_u8(c, buf, i, x1, x2, tmp);
+    if (!c->dark)
+        return row;
+    const CgnRowDark k = cgn_row_dark(c, i, x1);
+    cgn_kernels.correct_u8(row, &k, x2 - x1, (uint8_t*)tmp);
+    return (const uint8_t*)tmp;
+}
+
+// Subtracted images are never corrected, `tmp` is not used for them.
+#define cgn_row(type, pix_t)                                            \
+static inline const pix_t* cgn_row_##type(const CgnBeamCalc *c, const pix_t *buf, int i, int x1, int x2, uint16_t *tmp) { \
+    return buf + i*c->w + x1;                                           \
+}
+
+cgn_row(i32, int32_t)
+cgn_row(f32, float)
+cgn_row(f64, double)
+
+// Size of the `tmp` row buffer in 16-bit pixels.
+#define cgn_row_tmp(c) ((c)->packing || (c)->dark ? (c)->w : 1)
+
+// Moments of pixels [x1, x2) of row `i` not less than `th`, see moments_masked_* kernels.
+// Raw pixels are corrected by the dark frame right in the thresholding kernel, not by cgn_row_*(),
+// as mask iterations read them again and again.
+static inline void cgn_masked_row_u16(const CgnBeamCalc *c, const uint16_t *buf, int i, int x1, int x2, int x0, int th, uint16_t *tmp, int64_t *s) {
+    const uint16_t *row = cgn_raw_row_u16(c, buf, i, x1, x2, tmp);
+    if (c->dark) {
+        const CgnRowDark k = cgn_row_dark(c, i, x1);
+        cgn_kernels.moments_masked_dark_u16(row, &k, x2 - x1, x0, th, s);
+    } else {
+        cgn_kernels.moments_masked_u16(row, x2 - x1, x0, th, s);
+    }
+}
+
+static inline void cgn_masked_row_u8(const CgnBeamCalc *c, const uint8_t *buf, int i, int x1, int x2, int x0, int th, uint16_t *tmp, int64_t *s) {
+    const uint8_t *row = buf + i*c->w + x1;
+    if (c->dark) {
+        const CgnRowDark k = cgn_row_dark(c, i, x1);
+        cgn_kernels.moments_masked_dark_u8(row, &k, x2 - x1, x0, th, s);
+    } else {
+        cgn_kernels.moments_masked_u8(row, x2 - x1, x0, th, s);
+    }
+}
+
+static inline void cgn_masked_row_i32(const CgnBeamCalc *c, const int32_t *buf, int i, int x1, int x2, int x0, int th, uint16_t *tmp, int64_t *s) {
+    cgn_kernels.moments_masked_i32(cgn_row_i32(c, buf, i, x1, x2, tmp), x2 - x1, x0, th, s);
+}
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamResult *r;
+    const void *buf;
+    // Threshold and background for subtracting on the fly
+    int th;
+    double mean;
+    // Bands give exact sums in the deterministic mode
+    int exact;
+    CgnBands bands;
+    union {
+        CgnBeamMoments m[CGN_MAX_BANDS];
+        CgnExactMoments e[CGN_MAX_BANDS];
+    };
+} CgnMomentsTask;
+
+// Accumulates raw moments of a band row by row. Row sums of integer pixels
+// are exact int64 values, only row totals are converted into doubles.
+#define cgn_moments_band(type, pix_t, acc_t)                            \
+static void cgn_moments_band_##type(void *ctx, int band) {              \
+    CgnMomentsTask *t = ctx;                                            \
+    const CgnBeamResult *r = t->r;                                      \
+    const pix_t *buf = t->buf;                                          \
+    const int cx = (r->x1 + r->x2) / 2;                                 \
+    const int cy = (r->y1 + r->y2) / 2;                                 \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    CgnBeamMoments m = {0};                                             \
+    for (int i = i1; i < i2; i++) {                                     \
+        acc_t s[3] = {0, 0, 0};                                         \
+        cgn_kernels.moments_##type(                                     \
+            cgn_row_##type(t->c, buf, i, r->x1, r->x2, tmp),            \
+            r->x2 - r->x1, r->x1 - cx, s);                              \
+        cgn_moments_add_row(&m, s[0], s[1], s[2], i - cy);              \
+    }                                                                   \
+    t->m[band] = m;                                                     \
+}
+
+// The same for raw pixels with the background subtracted on the fly.
+// Pixels not above the threshold are zero, and others are `p - m`,
+// so their sums are taken from exact integer sums of `p`, `x` and `x^2`.
+#define cgn_moments_masked_band(type, pix_t)                            \
+static void cgn_moments_masked_band_##type(void *ctx, int band) {       \
+    CgnMomentsTask *t = ctx;                                            \
+    const CgnBeamResult *r = t->r;                                      \
+    const pix_t *buf = t->buf;                                          \
+    const int cx = (r->x1 + r->x2) / 2;                                 \
+    const int cy = (r->y1 + r->y2) / 2;                                 \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    CgnBeamMoments m = {0};                                             \
+    for (int i = i1; i < i2; i++) {                                     \
+        int64_t s[6] = {0, 0, 0, 0, 0, 0};                              \
+        cgn_masked_row_##type(t->c, buf, i, r->x1, r->x2,               \
+            r->x1 - cx, t->th, tmp, s);                                 \
+        cgn_moments_add_row(&m, s[0] - t->mean*s[3],                    \
+            s[1] - t->mean*s[4], s[2] - t->mean*s[5], i - cy);          \
+        m.n += s[3];                                                    \
+    }                                                                   \
+    t->m[band] = m;                                                     \
+}
+
+// Exact sums of a band for the deterministic mode, rows are the same as in cgn_moments_band().
+#define cgn_exact_band(type, pix_t)                                     \
+static void cgn_exact_band_##type(void *ctx, int band) {                \
+    CgnMomentsTask *t = ctx;                                            \
+    const CgnBeamResult *r = t->r;                                      \
+    const pix_t *buf = t->buf;                                          \
+    const int cx = (r->x1 + r->x2) / 2;                                 \
+    const int cy = (r->y1 + r->y2) / 2;                                 \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    CgnExactMoments e = {0};                                            \
+    for (int i = i1; i < i2; i++) {                                     \
+        int64_t s[6] = {0, 0, 0, 0, 0, 0};                              \
+        cgn_kernels.moments_##type(                                     \
+            cgn_row_##type(t->c, buf, i, r->x1, r->x2, tmp),            \
+            r->x2 - r->x1, r->x1 - cx, s);                              \
+        cgn_exact_add_row(&e, s, i - cy);                               \
+    }                                                                   \
+    t->e[band] = e;                                                     \
+}
+
+// The same for pixels above the threshold, as in cgn_moments_masked_band().
+#define cgn_exact_masked_band(type, pix_t)                              \
+static void cgn_exact_masked_band_##type(void *ctx, int band) {         \
+    CgnMomentsTask *t = ctx;                                            \
+    const CgnBeamResult *r = t->r;                                      \
+    const pix_t *buf = t->buf;                                          \
+    const int cx = (r->x1 + r->x2) / 2;                                 \
+    const int cy = (r->y1 + r->y2) / 2;                                 \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    CgnExactMoments e = {0};                                            \
+    for (int i = i1; i < i2; i++) {                                     \
+        int64_t s[6] = {0, 0, 0, 0, 0, 0};                              \
+        cgn_masked_row_##type(t->c, buf, i, r->x1, r->x2,               \
+            r->x1 - cx, t->th, tmp, s);                                 \
+        cgn_exact_add_row(&e, s, i - cy);                               \
+    }                                                                   \
+    t->e[band] = e;                                                     \
+}
+
+cgn_moments_band(u8, uint8_t, int64_t)
+cgn_moments_band(u16, uint16_t, int64_t)
+cgn_moments_band(f64, double, double)
+cgn_moments_band(f32, float, double)
+cgn_moments_masked_band(u8, uint8_t)
+cgn_moments_masked_band(u16, uint16_t)
+cgn_moments_masked_band(i32, int32_t)
+cgn_exact_band(u8, uint8_t)
+cgn_exact_band(u16, uint16_t)
+cgn_exact_masked_band(u8, uint8_t)
+cgn_exact_masked_band(u16, uint16_t)
+cgn_exact_masked_band(i32, int32_t)
+
+// Runs band tasks over rows of the result rectangle and merges their sums in band order.
+static CgnBeamMoments cgn_calc_moments(CgnMomentsTask *t, CgnPoolTask task, CgnBeamResult *r) {
+    t->r = r;
+    cgn_make_bands(t->c, r->y1, r->y2, &t->bands);
+    cgn_pool_run(t->c->pool, task, t, t->bands.count);
+    CgnBeamMoments m = {0};
+    if (t->exact) {
+        CgnExactMoments e = {0};
+        for (int i = 0; i < t->bands.count; i++)
+            cgn_exact_add(&e, t->e + i);
+        cgn_exact_moments(&e, t->mean, &m);
+    } else {
+        for (int i = 0; i < t->bands.count; i++)
+            cgn_moments_add(&m, t->m + i, 1);
+    }
+    cgn_calc_beam_finish(&m, (r->x1 + r->x2) / 2, (r->y1 + r->y2) / 2, r);
+    return m;
+}
 
 void cgn_calc_beam_u8(const uint8_t *buf, const CgnBeamCalc *c, CgnBeamResult *r) {
-    cgn_calc_beam
+    CgnMomentsTask t;
+    t.c = c;
+    t.buf = buf;
+    t.mean = 0;
+    t.exact = c->deterministic;
+    cgn_calc_moments(&t, t.exact ? cgn_exact_band_u8 : cgn_moments_band_u8, r);
 }
 
 void cgn_calc_beam_u16(const uint16_t *buf, const CgnBeamCalc *c, CgnBeamResult *r) {
-    cgn_calc_beam
+    CgnMomentsTask t;
+    t.c = c;
+    t.buf = buf;
+    t.mean = 0;
+    t.exact = c->deterministic;
+    cgn_calc_moments(&t, t.exact ? cgn_exact_band_u16 : cgn_moments_band_u16, r);
 }
 
 void cgn_calc_beam_f64(const double *buf, const CgnBeamCalc *c, CgnBeamResult *r) {
-    cgn_calc_beam
+    CgnMomentsTask t;
+    t.c = c;
+    t.buf = buf;
+    t.exact = 0;
+    cgn_calc_moments(&t, cgn_moments_band_f64, r);
+}
+
+void cgn_calc_beam_f32(const float *buf, const CgnBeamCalc *c, CgnBeamResult *r) {
+    CgnMomentsTask t;
+    t.c = c;
+    t.buf = buf;
+    t.exact = 0;
+    cgn_calc_moments(&t, cgn_moments_band_f32, r);
+}
+
+// Pixels are integers, so `p > mean + nT*sdev` is the same as `p >= th` for the returned `th`.
+static inline int cgn_raw_threshold(const CgnBeamBkgnd *b) {
+    return (int)floor(b->mean + b->nT * b->sdev) + 1;
+}
+
+// Calculates moments straight from raw pixels, subtracting the background on the fly.
+// Integer subtracted image is processed the same way, its pixels below the threshold are zeros.
+// Returns the number of pixels above the threshold.
+static int cgn_calc_beam_masked(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r) {
+    CgnMomentsTask t;
+    t.c = c;
+    t.th = cgn_raw_threshold(b);
+    t.mean = b->mean;
+    t.exact = c->deterministic;
+    CgnPoolTask task;
+    if (b->subtracted && b->subtracted_type == CGN_SUBTRACTED_I32) {
+        t.buf = b->subtracted;
+        task = t.exact ? cgn_exact_masked_band_i32 : cgn_moments_masked_band_i32;
+    } else if (c->bpp > 8) {
+        t.buf = c->buf;
+        task = t.exact ? cgn_exact_masked_band_u16 : cgn_moments_masked_band_u16;
+    } else {
+        t.buf = c->buf;
+        task = t.exact ? cgn_exact_masked_band_u8 : cgn_moments_masked_band_u8;
+    }
+    const CgnBeamMoments m = cgn_calc_moments(&t, task, r);
+    return m.n;
 }
 
 void cgn_calc_beam_naive(const CgnBeamCalc *c, CgnBeamResult *r) {
@@ -71,116 +467,587 @@ void cgn_calc_beam_naive(const CgnBeamCalc *c, CgnBeamResult *r) {
     }
 }
 
-#define cgn_subtract_bkgnd                             \
-    const int w = c->w;                                 \
-    const int h = c->h;                                 \
-    const int x1 = b->ax1, x2 = b->ax2;                 \
-    const int y1 = b->ay1, y2 = b->ay2;                 \
-    const int dw = (x2 - x1) * b->corner_fraction;      \
-    const int dh = (y2 - y1) * b->corner_fraction;      \
-    const int bx1 = x1 + dw, bx2 = x2 - dw;             \
-    const int by1 = y1 + dh, by2 = y2 - dh;             \
-    double *t = b->subtracted;                          \
-                                                        \
-    int k = 0;                                          \
-    double m = 0;                                       \
-    for (int i = y1; i < y2; i++) {                     \
-        if (i < by1 || i >= by2) {                      \
-            const int offset = i*w;                     \
-            for (int j = x1; j < x2; j++) {             \
-                if (j < bx1 || j >= bx2) {              \
-                    t[k] = buf[offset + j];             \
-                    m += t[k];                          \
-                    k++;                                \
-                }                                       \
-            }                                           \
-        }                                               \
-    }                                                   \
-    m /= (double)k;                                     \
-                                                        \
-    double s = 0;                                       \
-    for (int i = 0; i < k; i++) {                       \
-        s += sqr(t[i] - m);                             \
-        t[i] = 0;                                       \
-    }                                                   \
-    s = sqrt(s / (double)k);                            \
-                                                        \
-    b->mean = m;                                        \
-    b->sdev = s;                                        \
-                                                        \
-    const double th = m + b->nT * s;                    \
-    b->min = 1e10;                                      \
-    b->max = -1e10;                                     \
-    b->count = 0;                                       \
-    for (int i = 0; i < y1; i++) {                      \
-        const int offset = i*w;                         \
-        for (int j = 0; j < w; j++) {                   \
-            t[offset + j] = buf[offset + j];            \
-        }                                               \
-    }                                                   \
-    for (int i = y1; i < y2; i++) {                     \
-        const int offset = i*w;                         \
-        for (int j = 0; j < x1; j++) {                  \
-            t[offset + j] = buf[offset + j];            \
-        }                                               \
-        for (int j = x2; j < w; j++) {                  \
-            t[offset + j] = buf[offset + j];            \
-        }                                               \
-    }                                                   \
-    for (int i = y2; i < h; i++) {                      \
-        const int offset = i*w;                         \
-        for (int j = 0; j < w; j++) {                   \
-            t[offset + j] = buf[offset + j];            \
-        }                                               \
-    }                                                   \
-    for (int i = y1; i < y2; i++) {                     \
-        const int offset = i*w;                         \
-        for (int j = x1; j < x2; j++) {                 \
-            const int k = offset + j;                   \
-            if (buf[k] > th) {                          \
-                b->count++;                             \
-                t[k] = buf[k] - m;                      \
-            } else t[k] = 0;                            \
-            if (t[k] > b->max) b->max = t[k];           \
-            else if (t[k] < b->min) b->min = t[k];      \
-        }                                               \
-    }                                                   \
-
-void cgn_subtract_bkgnd_u8(const uint8_t *buf, const CgnBeamCalc *c, CgnBeamBkgnd *b) {
-    cgn_subtract_bkgnd
-}
-
-void cgn_subtract_bkgnd_u16(const uint16_t *buf, const CgnBeamCalc *c, CgnBeamBkgnd *b) {
-    cgn_subtract_bkgnd
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamBkgnd *b;
+    const void *buf;
+    void *dst;
+    // Corners are everything outside of [bx1, bx2) x [by1, by2) inside aperture
+    int bx1, bx2, by1, by2;
+    double m, th;
+    CgnBands bands;
+    int64_t s1[CGN_MAX_BANDS];
+    int64_t s2[CGN_MAX_BANDS];
+    double min[CGN_MAX_BANDS];
+    double max[CGN_MAX_BANDS];
+    int count[CGN_MAX_BANDS];
+    // Arena slices of `runs_cap` runs for each band, NULL when runs are not listed
+    CgnBeamRun *runs;
+    int runs_cap;
+    int nruns[CGN_MAX_BANDS];
+} CgnSubtractTask;
+
+// Returns the number of corner pixels in aperture rows above row `i`.
+static inline int cgn_corner_count(const CgnSubtractTask *t, int i) {
+    const int y1 = t->b->ay1;
+    int rows = min(i, t->by1) - y1;
+    rows += max(0, i - max(t->by1, t->by2));
+    return rows * ((t->bx1 - t->b->ax1) + (t->b->ax2 - t->bx2));
+}
+
+static void cgn_init_corners(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnSubtractTask *t) {
+    const int dw = (b->ax2 - b->ax1) * b->corner_fraction;
+    const int dh = (b->ay2 - b->ay1) * b->corner_fraction;
+    t->c = c;
+    t->b = b;
+    t->buf = c->buf;
+    t->dst = b->subtracted;
+    t->bx1 = b->ax1 + dw, t->bx2 = b->ax2 - dw;
+    t->by1 = b->ay1 + dh, t->by2 = b->ay2 - dh;
+    t->runs = NULL;
+    cgn_make_bands(c, b->ay1, b->ay2, &t->bands);
 }
 
-void cgn_calc_beam_bkgnd(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnBeamResult *r) {
-    if (c->bpp > 8) {
-        cgn_subtract_bkgnd_u16((const uint16_t*)(c->buf), c, b);
-    } else {
-        cgn_subtract_bkgnd_u8((const uint8_t*)(c->buf), c, b);
+// Runs are only listed for the `subtracted` buffer. The arena is split evenly between bands,
+// so each band lists runs of its rows without waiting for the previous ones.
+static void cgn_init_runs(const CgnBeamBkgnd *b, CgnSubtractTask *t) {
+    t->runs = b->runs && b->subtracted && t->dst == b->subtracted ? b->runs : NULL;
+    t->runs_cap = t->bands.count ? b->runs_size / t->bands.count : 0;
+}
+
+// Moves runs of band slices together in band order, so they get sorted by rows.
+// Returns the number of runs or -1 when some slice has been overflown.
+static int cgn_collect_runs(const CgnSubtractTask *t) {
+    int count = 0;
+    for (int i = 0; i < t->bands.count; i++) {
+        if (t->nruns[i] < 0)
+            return -1;
+        memmove(t->runs + count, t->runs + i*t->runs_cap, t->nruns[i] * sizeof(CgnBeamRun));
+        count += t->nruns[i];
     }
+    return count;
+}
 
-    r->x1 = b->ax1, r->x2 = b->ax2;
-    r->y1 = b->ay1, r->y2 = b->ay2;
-    if (b->count < 10) {
-        memset(r, 0, sizeof(CgnBeamResult));
-        r->nan = 1;
+// Runs separated by fewer zeros are merged. Zeros add nothing to moments,
+// while noise makes lots of short runs, and each run costs a kernel call with a scalar tail.
+#define CGN_RUN_GAP 16
+
+// Appends runs of non-zero subtracted values of row `y` to the band slice, `v` is at `x1`.
+// Returns the new number of runs in the slice or -1 when it is full.
+#define cgn_runs_row(dst_t)                                             \
+static int cgn_runs_row_##dst_t(const dst_t *v, int n, int x1, int y,   \
+    CgnBeamRun *runs, int count, int cap) {                             \
+    int j = 0;                                                          \
+    for (;;) {                                                          \
+        while (j + 4 <= n && !v[j] && !v[j+1] && !v[j+2] && !v[j+3])    \
+            j += 4;                                                     \
+        while (j < n && !v[j])                                          \
+            j++;                                                        \
+        if (j == n)                                                     \
+            return count;                                               \
+        CgnBeamRun *run = count ? runs + count - 1 : NULL;              \
+        if (!run || run->y != y || x1 + j - run->x2 >= CGN_RUN_GAP) {   \
+            if (count == cap)                                           \
+                return -1;                                              \
+            run = runs + count++;                                       \
+            run->y = y;                                                 \
+            run->x1 = x1 + j;                                           \
+        }                                                               \
+        while (j < n && v[j])                                           \
+            j++;                                                        \
+        run->x2 = x1 + j;                                               \
+    }                                                                   \
+}
+
+cgn_runs_row(double)
+cgn_runs_row(float)
+cgn_runs_row(int32_t)
+
+// `suffix` selects kernels for the type of subtracted values, doubles or floats.
+#define cgn_subtract_band(type, pix_t, suffix, dst_t)                   \
+static void cgn_subtract_band_##type##suffix(void *ctx, int band) {     \
+    CgnSubtractTask *t = ctx;                                           \
+    const pix_t *buf = t->buf;                                          \
+    const int w = t->c->w;                                              \
+    const int x1 = t->b->ax1, x2 = t->b->ax2;                           \
+    const int y1 = t->b->ay1, y2 = t->b->ay2;                           \
+    dst_t *d = t->dst;                                                  \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    double min = 1e10, max = -1e10;                                     \
+    int count = 0, nruns = 0;                                           \
+    CgnBeamRun *runs = t->runs ? t->runs + band*t->runs_cap : NULL;     \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        const int offset = i*w;                                         \
+        const pix_t *row = cgn_row_##type(t->c, buf, i, 0, w, tmp);     \
+        if (i < y1 || i >= y2) {                                        \
+            cgn_kernels.copy_##type##suffix(row, w, d + offset);        \
+            continue;                                                   \
+        }                                                               \
+        cgn_kernels.copy_##type##suffix(row, x1, d + offset);           \
+        cgn_kernels.copy_##type##suffix(                                \
+            row + x2, w - x2, d + offset + x2);                         \
+        const int n = cgn_kernels.subtract_##type##suffix(              \
+            row + x1, x2 - x1, t->th, t->m, d + offset + x1,            \
+            &min, &max);                                                \
+        count += n;                                                     \
+        if (runs && n && nruns >= 0)                                    \
+            nruns = cgn_runs_row_##dst_t(d + offset + x1, x2 - x1, x1, i, \
+                runs, nruns, t->runs_cap);                              \
+    }                                                                   \
+    t->min[band] = min;                                                 \
+    t->max[band] = max;                                                 \
+    t->count[band] = count;                                             \
+    t->nruns[band] = nruns;                                             \
+}
+
+// Non-zero values of integer subtracted image are above the background
+static inline double cgn_subtracted_i32(int32_t v, double m) {
+    return v ? v - m : 0;
+}
+
+// Integer subtracted image keeps raw pixels above the threshold,
+// min and max are then converted into values with background subtracted.
+#define cgn_threshold_band(type, pix_t)                                 \
+static void cgn_threshold_band_##type(void *ctx, int band) {            \
+    CgnSubtractTask *t = ctx;                                           \
+    const pix_t *buf = t->buf;                                          \
+    const int w = t->c->w;                                              \
+    const int x1 = t->b->ax1, x2 = t->b->ax2;                           \
+    const int y1 = t->b->ay1, y2 = t->b->ay2;                           \
+    const int th = cgn_raw_threshold(t->b);                             \
+    int32_t *d = t->dst;                                                \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int32_t min = INT32_MAX, max = -1;                                  \
+    int count = 0, nruns = 0;                                           \
+    CgnBeamRun *runs = t->runs ? t->runs + band*t->runs_cap : NULL;     \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        const int offset = i*w;                                         \
+        const pix_t *row = cgn_row_##type(t->c, buf, i, 0, w, tmp);     \
+        if (i < y1 || i >= y2) {                                        \
+            cgn_kernels.copy_##type##_i32(row, w, d + offset);          \
+            continue;                                                   \
+        }                                                               \
+        cgn_kernels.copy_##type##_i32(row, x1, d + offset);             \
+        cgn_kernels.copy_##type##_i32(                                  \
+            row + x2, w - x2, d + offset + x2);                         \
+        const int n = cgn_kernels.threshold_##type##_i32(               \
+            row + x1, x2 - x1, th, d + offset + x1,                     \
+            &min, &max);                                                \
+        count += n;                                                     \
+        if (runs && n && nruns >= 0)                                    \
+            nruns = cgn_runs_row_int32_t(d + offset + x1, x2 - x1, x1, i, \
+                runs, nruns, t->runs_cap);                              \
+    }                                                                   \
+    t->min[band] = min == INT32_MAX ? 1e10 : cgn_subtracted_i32(min, t->m); \
+    t->max[band] = max < 0 ? -1e10 : cgn_subtracted_i32(max, t->m);     \
+    t->count[band] = count;                                             \
+    t->nruns[band] = nruns;                                             \
+}
+
+// Sums of corner pixels and their squares, they are exact integers,
+// so the mean and variance are got in a single pass without copying corners anywhere.
+#define cgn_stats_band(type, pix_t)                                     \
+static void cgn_stats_band_##type(void *ctx, int band) {                \
+    CgnSubtractTask *t = ctx;                                           \
+    const pix_t *buf = t->buf;                                          \
+    const int x1 = t->b->ax1, x2 = t->b->ax2;                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int64_t s[2] = {0, 0};                                              \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        if (i < t->by1 || i >= t->by2) {                                \
+            cgn_kernels.stats_##type(                                   \
+                cgn_row_##type(t->c, buf, i, x1, t->bx1, tmp),          \
+                t->bx1 - x1, s);                                        \
+            cgn_kernels.stats_##type(                                   \
+                cgn_row_##type(t->c, buf, i, t->bx2, x2, tmp),          \
+                x2 - t->bx2, s);                                        \
+        }                                                               \
+    }                                                                   \
+    t->s1[band] = s[0];                                                 \
+    t->s2[band] = s[1];                                                 \
+}
+
+cgn_stats_band(u8, uint8_t)
+cgn_stats_band(u16, uint16_t)
+cgn_subtract_band(u8, uint8_t, , double)
+cgn_subtract_band(u16, uint16_t, , double)
+cgn_subtract_band(u8, uint8_t, _f32, float)
+cgn_subtract_band(u16, uint16_t, _f32, float)
+cgn_threshold_band(u8, uint8_t)
+cgn_threshold_band(u16, uint16_t)
+
+// Background statistics for any type of the subtracted image or subtracting it on the fly.
+// The variance is taken around the integer part `q` of the mean,
+// so `sum((p-q)^2)` is an exact integer and only a small fraction is lost to rounding.
+// Returns the number of corner pixels.
+static int cgn_bkgnd_stats(const CgnBeamCalc *c, CgnBeamBkgnd *b) {
+    CgnSubtractTask t;
+    cgn_init_corners(c, b, &t);
+    const int64_t k = cgn_corner_count(&t, b->ay2);
+    if (k == 0)
+        return 0;
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_stats_band_u16 : cgn_stats_band_u8, &t, t.bands.count);
+    int64_t s1 = 0, s2 = 0;
+    for (int i = 0; i < t.bands.count; i++) {
+        s1 += t.s1[i];
+        s2 += t.s2[i];
+    }
+    const int64_t q = s1 / k;
+    const int64_t d = s2 - 2*q*s1 + q*q*k;
+    const double e = (double)(s1 - q*k);
+    b->mean = s1 / (double)k;
+    b->sdev = sqrt((d - e*e/k) / k);
+    return k;
+}
+
+// Subtracts the background of already known `mean` and `sdev` from the whole frame.
+// Updates `min` and `max` and returns the number of pixels above the threshold.
+static int cgn_subtract_frame(const CgnBeamCalc *c, CgnBeamBkgnd *b, void *tgt, CgnPoolTask task) {
+    CgnSubtractTask t;
+    cgn_init_corners(c, b, &t);
+    t.dst = tgt;
+    t.m = b->mean;
+    t.th = b->mean + b->nT * b->sdev;
+    cgn_make_bands(c, 0, c->h, &t.bands);
+    cgn_init_runs(b, &t);
+    cgn_pool_run(c->pool, task, &t, t.bands.count);
+    int count = 0;
+    b->min = 1e10;
+    b->max = -1e10;
+    for (int i = 0; i < t.bands.count; i++) {
+        b->min = min(b->min, t.min[i]);
+        b->max = max(b->max, t.max[i]);
+        count += t.count[i];
+    }
+    if (t.runs)
+        b->runs_count = cgn_collect_runs(&t);
+    return count;
+}
+
+void cgn_copy_subtracted_f64(const CgnBeamCalc *c, CgnBeamBkgnd *b, double *tgt) {
+    cgn_subtract_frame(c, b, tgt, c->bpp > 8 ? cgn_subtract_band_u16 : cgn_subtract_band_u8);
+}
+
+// Writes the subtracted image, corners statistics must be already known.
+static void cgn_subtract_image(const CgnBeamCalc *c, CgnBeamBkgnd *b) {
+    CgnPoolTask task;
+    if (b->subtracted_type == CGN_SUBTRACTED_I32)
+        task = c->bpp > 8 ? cgn_threshold_band_u16 : cgn_threshold_band_u8;
+    else if (b->subtracted_type == CGN_SUBTRACTED_F32)
+        task = c->bpp > 8 ? cgn_subtract_band_u16_f32 : cgn_subtract_band_u8_f32;
+    else
+        task = c->bpp > 8 ? cgn_subtract_band_u16 : cgn_subtract_band_u8;
+    b->count = cgn_subtract_frame(c, b, b->subtracted, task);
+}
+
+// Summed-area tables of moments over square blocks of the aperture.
+// A table cell [j, i] holds moments of all blocks above and to the left of it,
+// so moments of any block-aligned rectangle are taken by four lookups,
+// and only the unaligned strips along the mask edges are summed pixel by pixel.
+// Full-resolution tables would take 6 doubles per pixel (250MB for 5MP frame)
+// and building them would cost more than the iterations they save.
+//
+// Cells are doubles, so moments of the mask taken as the difference of four corner cells
+// have the absolute error of about eps times the corner values, that are up to moments
+// of the whole aperture, and the relative error is about eps * aperture sum / mask sum.
+// Moments are relative to the aperture center to keep the corner values small. The spread
+// about the beam center is then taken from them, which loses about (offset / width)^2 more
+// when the beam is far from the aperture center. For the test frames results differ
+// from the direct passes in the 14-15th digit, see main.c, a small beam in a large
+// aperture with many pixels above the threshold loses more digits.
+#define CGN_SAT_BLOCK 16
+
+int cgn_sat_size(int w, int h) {
+    const int bw = (w + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    const int bh = (h + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    return (bw + 1) * (bh + 1) * sizeof(CgnBeamMoments) / sizeof(double);
+}
+
+// Kinds of pixels that summed-area tables are built of
+enum {
+    CGN_SAT_F64,
+    CGN_SAT_F32,
+    // Raw pixels or integer subtracted image with background subtracted on the fly
+    CGN_SAT_U8,
+    CGN_SAT_U16,
+    CGN_SAT_I32,
+};
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const void *buf;
+    int kind;
+    int th;
+    double m;
+    int ax1, ax2, ay1, ay2;
+    int ox, oy;
+    int bw, bh;
+    CgnBeamMoments *t;
+} CgnSatTask;
+
+// Adds moments of rectangle [x1, x2) x [y1, y2) relative to the task origin.
+static void cgn_sat_add_rect(const CgnSatTask *t, int x1, int x2, int y1, int y2, CgnBeamMoments *m) {
+    if (x2 <= x1)
         return;
+    const CgnBeamCalc *c = t->c;
+    uint16_t tmp[cgn_row_tmp(c)];
+    for (int i = y1; i < y2; i++) {
+        if (t->kind == CGN_SAT_F64 || t->kind == CGN_SAT_F32) {
+            double s[3] = {0, 0, 0};
+            if (t->kind == CGN_SAT_F64) {
+                cgn_kernels.moments_f64(cgn_row_f64(c, t->buf, i, x1, x2, tmp), x2 - x1, x1 - t->ox, s);
+            } else {
+                cgn_kernels.moments_f32(cgn_row_f32(c, t->buf, i, x1, x2, tmp), x2 - x1, x1 - t->ox, s);
+            }
+            cgn_moments_add_row(m, s[0], s[1], s[2], i - t->oy);
+            continue;
+        }
+        int64_t s[6] = {0, 0, 0, 0, 0, 0};
+        if (t->kind == CGN_SAT_U16) {
+            cgn_masked_row_u16(c, t->buf, i, x1, x2, x1 - t->ox, t->th, tmp, s);
+        } else if (t->kind == CGN_SAT_U8) {
+            cgn_masked_row_u8(c, t->buf, i, x1, x2, x1 - t->ox, t->th, tmp, s);
+        } else {
+            cgn_masked_row_i32(c, t->buf, i, x1, x2, x1 - t->ox, t->th, tmp, s);
+        }
+        cgn_moments_add_row(m, s[0] - t->m*s[3], s[1] - t->m*s[4], s[2] - t->m*s[5], i - t->oy);
+        m->n += s[3];
     }
-    r->nan = 0;
+}
+
+// Sums blocks of a row of blocks and accumulates them along the row.
+static void cgn_sat_row(void *ctx, int j) {
+    CgnSatTask *t = ctx;
+    CgnBeamMoments *row = t->t + (j + 1) * (t->bw + 1);
+    const int y1 = t->ay1 + j * CGN_SAT_BLOCK;
+    const int y2 = min(y1 + CGN_SAT_BLOCK, t->ay2);
+    CgnBeamMoments acc = {0};
+    row[0] = acc;
+    for (int i = 0; i < t->bw; i++) {
+        const int x1 = t->ax1 + i * CGN_SAT_BLOCK;
+        const int x2 = min(x1 + CGN_SAT_BLOCK, t->ax2);
+        cgn_sat_add_rect(t, x1, x2, y1, y2, &acc);
+        row[i + 1] = acc;
+    }
+}
+
+// Rows of blocks are summed in parallel, then accumulated down the columns in order,
+// so the tables don't depend on the number of threads.
+static void cgn_sat_build(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnSatTask *t) {
+    if (!b->subtracted) {
+        t->buf = c->buf;
+        t->kind = c->bpp > 8 ? CGN_SAT_U16 : CGN_SAT_U8;
+    } else {
+        t->buf = b->subtracted;
+        t->kind = b->subtracted_type == CGN_SUBTRACTED_I32 ? CGN_SAT_I32
+            : b->subtracted_type == CGN_SUBTRACTED_F32 ? CGN_SAT_F32 : CGN_SAT_F64;
+    }
+    t->c = c;
+    t->th = cgn_raw_threshold(b);
+    t->m = b->mean;
+    t->ax1 = b->ax1, t->ax2 = b->ax2;
+    t->ay1 = b->ay1, t->ay2 = b->ay2;
+    t->ox = (b->ax1 + b->ax2) / 2;
+    t->oy = (b->ay1 + b->ay2) / 2;
+    t->bw = (b->ax2 - b->ax1 + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    t->bh = (b->ay2 - b->ay1 + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    t->t = (CgnBeamMoments*)b->sat;
+
+    memset(t->t, 0, (t->bw + 1) * sizeof(CgnBeamMoments));
+    cgn_pool_run(c->pool, cgn_sat_row, t, t->bh);
+
+    const int stride = t->bw + 1;
+    for (int j = 1; j < t->bh; j++) {
+        CgnBeamMoments *row = t->t + (j + 1) * stride;
+        for (int i = 1; i <= t->bw; i++)
+            cgn_moments_add(row + i, row + i - stride, 1);
+    }
+}
 
-    cgn_calc_beam_f64(b->subtracted, c, r);
+// Block boundary `i` in pixels, the last block can be incomplete.
+static inline int cgn_sat_edge(int a1, int a2, int i) {
+    return min(a1 + i * CGN_SAT_BLOCK, a2);
+}
+
+// Returns the number of pixels above the threshold when the background is subtracted on the fly.
+static int cgn_calc_beam_sat(const CgnSatTask *t, CgnBeamResult *r) {
+    // Blocks lying completely inside the mask
+    const int i1 = (r->x1 - t->ax1 + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    const int i2 = r->x2 == t->ax2 ? t->bw : (r->x2 - t->ax1) / CGN_SAT_BLOCK;
+    const int j1 = (r->y1 - t->ay1 + CGN_SAT_BLOCK - 1) / CGN_SAT_BLOCK;
+    const int j2 = r->y2 == t->ay2 ? t->bh : (r->y2 - t->ay1) / CGN_SAT_BLOCK;
+
+    CgnBeamMoments m = {0};
+    if (i1 >= i2 || j1 >= j2) {
+        cgn_sat_add_rect(t, r->x1, r->x2, r->y1, r->y2, &m);
+    } else {
+        const int stride = t->bw + 1;
+        cgn_moments_add(&m, t->t + j2*stride + i2, 1);
+        cgn_moments_add(&m, t->t + j1*stride + i2, -1);
+        cgn_moments_add(&m, t->t + j2*stride + i1, -1);
+        cgn_moments_add(&m, t->t + j1*stride + i1, 1);
+
+        const int x1 = cgn_sat_edge(t->ax1, t->ax2, i1);
+        const int x2 = cgn_sat_edge(t->ax1, t->ax2, i2);
+        const int y1 = cgn_sat_edge(t->ay1, t->ay2, j1);
+        const int y2 = cgn_sat_edge(t->ay1, t->ay2, j2);
+        cgn_sat_add_rect(t, r->x1, r->x2, r->y1, y1, &m);
+        cgn_sat_add_rect(t, r->x1, r->x2, y2, r->y2, &m);
+        cgn_sat_add_rect(t, r->x1, x1, y1, y2, &m);
+        cgn_sat_add_rect(t, x2, r->x2, y1, y2, &m);
+    }
+    cgn_calc_beam_finish(&m, t->ox, t->oy, r);
+    return m.n;
+}
+
+// Index of the first run at or below row `y`.
+static int cgn_first_run(const CgnBeamBkgnd *b, int y) {
+    int lo = 0, hi = b->runs_count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (b->runs[mid].y < y) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Moments over parts of runs inside the current mask. The same row kernels
+// as for dense passes are applied to runs, their sums are added row by row
+// into sums of bands, and these are merged in band order the same as in cgn_calc_moments().
+#define cgn_runs_moments(type, pix_t)                                   \
+static void cgn_calc_beam_runs_##type(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r) { \
+    const pix_t *buf = b->subtracted;                                   \
+    const CgnBeamRun *runs = b->runs;                                   \
+    const int cx = (r->x1 + r->x2) / 2;                                 \
+    const int cy = (r->y1 + r->y2) / 2;                                 \
+    CgnBands bands;                                                     \
+    cgn_make_bands(c, r->y1, r->y2, &bands);                            \
+    CgnBeamMoments m = {0}, mb = {0};                                   \
+    int band = -1;                                                      \
+    int k = cgn_first_run(b, r->y1);                                    \
+    while (k < b->runs_count && runs[k].y < r->y2) {                    \
+        const int y = runs[k].y;                                        \
+        double s[3] = {0, 0, 0};                                        \
+        for (; k < b->runs_count && runs[k].y == y; k++) {              \
+            const int x1 = max(runs[k].x1, r->x1);                      \
+            const int x2 = min(runs[k].x2, r->x2);                      \
+            if (x1 < x2)                                                \
+                cgn_kernels.moments_##type(buf + y*c->w + x1, x2 - x1, x1 - cx, s); \
+        }                                                               \
+        if (y / bands.rows != band) {                                   \
+            cgn_moments_add(&m, &mb, 1);                                \
+            memset(&mb, 0, sizeof(mb));                                 \
+            band = y / bands.rows;                                      \
+        }                                                               \
+        cgn_moments_add_row(&mb, s[0], s[1], s[2], y - cy);             \
+    }                                                                   \
+    cgn_moments_add(&m, &mb, 1);                                        \
+    cgn_calc_beam_finish(&m, cx, cy, r);                                \
+}
+
+cgn_runs_moments(f64, double)
+cgn_runs_moments(f32, float)
+
+// The same over the integer subtracted image, row sums are exact the same as in cgn_moments_masked_band_i32().
+static void cgn_calc_beam_runs_i32(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r) {
+    const int32_t *buf = b->subtracted;
+    const CgnBeamRun *runs = b->runs;
+    const int cx = (r->x1 + r->x2) / 2;
+    const int cy = (r->y1 + r->y2) / 2;
+    const int th = cgn_raw_threshold(b);
+    CgnBands bands;
+    cgn_make_bands(c, r->y1, r->y2, &bands);
+    CgnBeamMoments m = {0}, mb = {0};
+    int band = -1;
+    int k = cgn_first_run(b, r->y1);
+    while (k < b->runs_count && runs[k].y < r->y2) {
+        const int y = runs[k].y;
+        int64_t s[6] = {0, 0, 0, 0, 0, 0};
+        for (; k < b->runs_count && runs[k].y == y; k++) {
+            const int x1 = max(runs[k].x1, r->x1);
+            const int x2 = min(runs[k].x2, r->x2);
+            if (x1 < x2)
+                cgn_kernels.moments_masked_i32(buf + y*c->w + x1, x2 - x1, x1 - cx, th, s);
+        }
+        if (y / bands.rows != band) {
+            cgn_moments_add(&m, &mb, 1);
+            memset(&mb, 0, sizeof(mb));
+            band = y / bands.rows;
+        }
+        cgn_moments_add_row(&mb, s[0] - b->mean*s[3],
+            s[1] - b->mean*s[4], s[2] - b->mean*s[5], y - cy);
+    }
+    cgn_moments_add(&m, &mb, 1);
+    cgn_calc_beam_finish(&m, cx, cy, r);
+}
+
+// Runs are worth it when pixels above the threshold are few compared to the mask area,
+// a run costs about as much as several pixels of a dense pass.
+#define CGN_RUN_COST 8
+
+static int cgn_use_runs(const CgnBeamBkgnd *b, const CgnBeamResult *r) {
+    if (!b->runs || b->runs_count < 0)
+        return 0;
+    const int64_t area = (int64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+    return (int64_t)b->count + (int64_t)b->runs_count * CGN_RUN_COST < area;
+}
+
+// Moments over the current mask from summed-area tables when they are given,
+// from runs of pixels above the threshold when they are sparse, or by a pass over pixels.
+// Returns the number of pixels above the threshold when the background is subtracted on the fly.
+static int cgn_calc_beam_mask(const CgnBeamCalc *c, const CgnBeamBkgnd *b, const CgnSatTask *sat, CgnBeamResult *r) {
+    if (c->deterministic)
+        return cgn_calc_beam_masked(c, b, r);
+    if (sat)
+        return cgn_calc_beam_sat(sat, r);
+    if (b->subtracted && cgn_use_runs(b, r)) {
+        if (b->subtracted_type == CGN_SUBTRACTED_I32) {
+            cgn_calc_beam_runs_i32(c, b, r);
+        } else if (b->subtracted_type == CGN_SUBTRACTED_F32) {
+            cgn_calc_beam_runs_f32(c, b, r);
+        } else {
+            cgn_calc_beam_runs_f64(c, b, r);
+        }
+        return 0;
+    }
+    if (!b->subtracted || b->subtracted_type == CGN_SUBTRACTED_I32)
+        return cgn_calc_beam_masked(c, b, r);
+    if (b->subtracted_type == CGN_SUBTRACTED_F32) {
+        cgn_calc_beam_f32(b->subtracted, c, r);
+    } else {
+        cgn_calc_beam_f64(b->subtracted, c, r);
+    }
+    return 0;
+}
+
+static void cgn_set_nan(CgnBeamResult *r) {
+    memset(r, 0, sizeof(CgnBeamResult));
+    r->nan = 1;
+}
+
+// The mask of `mask_diam` diameters around the beam, clamped to the aperture.
+static void cgn_set_mask(const CgnBeamBkgnd *b, CgnBeamResult *r) {
+    const double xc = r->xc, yc = r->yc;
+    const double dx = r->dx, dy = r->dy;
+    r->x1 = xc - dx/2.0 * b->mask_diam; r->x1 = max(r->x1, b->ax1);
+    r->x2 = xc + dx/2.0 * b->mask_diam; r->x2 = min(r->x2, b->ax2);
+    r->y1 = yc - dy/2.0 * b->mask_diam; r->y1 = max(r->y1, b->ay1);
+    r->y2 = yc + dy/2.0 * b->mask_diam; r->y2 = min(r->y2, b->ay2);
+}
 
+// Iterates the mask until the beam diameter is found with the required precision.
+static void cgn_iterate_mask(const CgnBeamCalc *c, CgnBeamBkgnd *b, const CgnSatTask *s, CgnBeamResult *r) {
     for (b->iters = 0; b->iters < b->max_iter; b->iters++) {
         double xc0 = r->xc, yc0 = r->yc;
         double dx0 = r->dx, dy0 = r->dy;
-        r->x1 = xc0 - dx0/2.0 * b->mask_diam; r->x1 = max(r->x1, b->ax1);
-        r->x2 = xc0 + dx0/2.0 * b->mask_diam; r->x2 = min(r->x2, b->ax2);
-        r->y1 = yc0 - dy0/2.0 * b->mask_diam; r->y1 = max(r->y1, b->ay1);
-        r->y2 = yc0 + dy0/2.0 * b->mask_diam; r->y2 = min(r->y2, b->ay2);
+        cgn_set_mask(b, r);
 
-        cgn_calc_beam_f64(b->subtracted, c, r);
+        cgn_calc_beam_mask(c, b, s, r);
 
         double th = min(dx0, dy0) * b->precision;
         if (fabs(r->xc - xc0) < th && fabs(r->yc - yc0) < th &&
@@ -191,26 +1058,647 @@ void cgn_calc_beam_bkgnd(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnBeamResult *r
     }
 }
 
-#define cgn_copy_to                             \
-    *max = 0;                                   \
-    for (int i = 0; i < sz; i++) {              \
-        tgt[i] = buf[i];                        \
-        if (tgt[i] > *max) *max = tgt[i];       \
+// The library is built with -ffast-math, where isnan() and comparisons with nan
+// are folded as if there were no nan values, so the bits are checked instead.
+static inline int cgn_finite(double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return (u & 0x7FF0000000000000ull) != 0x7FF0000000000000ull;
+}
+
+static int cgn_result_finite(const CgnBeamResult *r) {
+    return cgn_finite(r->xc) && cgn_finite(r->yc) && cgn_finite(r->dx) && cgn_finite(r->dy);
+}
+
+// Takes the first moments over the mask of the beam estimate in `r`.
+// Returns false when the estimate is not usable.
+static int cgn_seeded_start(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r, int *count) {
+    if (r->nan || !cgn_result_finite(r) || r->dx <= 0 || r->dy <= 0)
+        return 0;
+    cgn_set_mask(b, r);
+    if (r->x2 <= r->x1 || r->y2 <= r->y1)
+        return 0;
+    r->nan = 0;
+    *count = cgn_calc_beam_mask(c, b, NULL, r);
+    return b->subtracted || *count >= 10;
+}
+
+// Takes the first moments over the mask of the previous result in `r`.
+// Returns false when the previous result is not usable or the beam has changed too much,
+// then calculation should start over from the whole aperture.
+static int cgn_warm_start(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r, int *count) {
+    if (b->warm_start <= 0)
+        return 0;
+    const CgnBeamResult prev = *r;
+    if (!cgn_seeded_start(c, b, r, count))
+        return 0;
+    const double th = min(prev.dx, prev.dy) * b->warm_start;
+    return cgn_result_finite(r) && fabs(r->xc - prev.xc) <= th && fabs(r->yc - prev.yc) <= th &&
+        fabs(r->dx - prev.dx) <= th && fabs(r->dy - prev.dy) <= th;
+}
+
+// Factors are powers of two up to 8, others are rounded down to them.
+static int cgn_pyramid_shift(int factor) {
+    int shift = 0;
+    while (shift < 3 && (2 << shift) <= factor) shift++;
+    return shift;
+}
+
+int cgn_pyramid_size(int w, int h, int factor) {
+    const int shift = cgn_pyramid_shift(factor);
+    return (w >> shift) * (h >> shift);
+}
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamBkgnd *b;
+    int w;     // level width
+    int shift; // log2 of the downsampling factor
+    CgnBands bands;
+} CgnPyramidTask;
+
+// Rows of each block are summed into a row of ints, then halved by pairs down to the level width.
+// Level pixels are rounded means of blocks, so they stay in the range of raw pixels
+// and the level can be processed by the same integer kernels as the subtracted image.
+#define cgn_pyramid_band(type, pix_t)                                   \
+static void cgn_pyramid_band_##type(void *ctx, int band) {              \
+    const CgnPyramidTask *t = ctx;                                      \
+    const CgnBeamBkgnd *b = t->b;                                       \
+    const pix_t *buf = (const pix_t*)t->c->buf;                         \
+    const int k = 1 << t->shift;                                        \
+    const int n = t->w * k;                                             \
+    const int x1 = b->ax1, x2 = x1 + n;                                 \
+    const int32_t half = 1 << (2*t->shift - 1);                         \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int32_t acc[n];                                                     \
+    for (int i = i1; i < i2; i++) {                                     \
+        const int y = b->ay1 + i*k;                                     \
+        cgn_kernels.copy_##type##_i32(cgn_row_##type(t->c, buf, y, x1, x2, tmp), n, acc); \
+        for (int j = 1; j < k; j++)                                     \
+            cgn_kernels.add_##type##_i32(cgn_row_##type(t->c, buf, y + j, x1, x2, tmp), n, acc); \
+        for (int m = n / 2; m >= t->w; m /= 2)                          \
+            cgn_kernels.pairs_i32(acc, m, acc);                         \
+        int32_t *dst = b->pyramid_buf + i*t->w;                         \
+        for (int j = 0; j < t->w; j++)                                  \
+            dst[j] = (acc[j] + half) >> (2*t->shift);                   \
+    }                                                                   \
+}
+
+cgn_pyramid_band(u8, uint8_t)
+cgn_pyramid_band(u16, uint16_t)
+
+// Finds the beam in the aperture downsampled by `pyramid` and takes the first moments
+// over the mask of that estimate at full resolution. Returns false when the coarse beam
+// is smaller than `pyramid_min` level pixels, then calculation should start over from the whole aperture.
+static int cgn_coarse_start(const CgnBeamCalc *c, const CgnBeamBkgnd *b, CgnBeamResult *r, int *count) {
+    const int shift = cgn_pyramid_shift(b->pyramid);
+    if (!shift || !b->pyramid_buf)
+        return 0;
+    const int k = 1 << shift;
+    CgnBeamCalc lc = *c;
+    lc.w = (b->ax2 - b->ax1) >> shift;
+    lc.h = (b->ay2 - b->ay1) >> shift;
+    lc.packing = CGN_UNPACKED;
+    if (lc.w <= 0 || lc.h <= 0)
+        return 0;
+
+    CgnPyramidTask t;
+    t.c = c;
+    t.b = b;
+    t.w = lc.w;
+    t.shift = shift;
+    cgn_make_bands(&lc, 0, lc.h, &t.bands);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_pyramid_band_u16 : cgn_pyramid_band_u8, &t, t.bands.count);
+
+    // The threshold is kept at the noise of raw pixels though means of blocks have k times lower noise.
+    // The beam has k*k times fewer pixels on the level, and noise pixels above the usual threshold
+    // would outweigh a small beam, while the coarse estimate only has to locate it.
+    CgnBeamBkgnd lb = *b;
+    lb.ax1 = 0, lb.ax2 = lc.w;
+    lb.ay1 = 0, lb.ay2 = lc.h;
+    lb.subtracted = b->pyramid_buf;
+    lb.subtracted_type = CGN_SUBTRACTED_I32;
+    // Runs and tables of the full frame don't belong to the level
+    lb.runs = NULL;
+    lb.runs_count = -1;
+    lb.sat = NULL;
+    CgnBeamResult lr;
+    lr.x1 = 0, lr.x2 = lc.w;
+    lr.y1 = 0, lr.y2 = lc.h;
+    lr.nan = 0;
+    if (cgn_calc_beam_mask(&lc, &lb, NULL, &lr) < 10)
+        return 0;
+    cgn_iterate_mask(&lc, &lb, NULL, &lr);
+
+    if (!cgn_result_finite(&lr) || lr.dx < b->pyramid_min || lr.dy < b->pyramid_min)
+        return 0;
+    r->xc = b->ax1 + lr.xc*k + (k - 1)/2.0;
+    r->yc = b->ay1 + lr.yc*k + (k - 1)/2.0;
+    r->dx = lr.dx*k;
+    r->dy = lr.dy*k;
+    r->nan = 0;
+    return cgn_seeded_start(c, b, r, count);
+}
+
+void cgn_calc_beam_bkgnd(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnBeamResult *r) {
+    b->runs_count = -1;
+    if (!cgn_bkgnd_stats(c, b)) {
+        b->count = 0;
+        cgn_set_nan(r);
+        return;
+    }
+    if (b->subtracted)
+        cgn_subtract_image(c, b);
+    if (b->subtracted && b->count < 10) {
+        cgn_set_nan(r);
+        return;
+    }
+
+    // Tables are not built for warm and coarse starts, passes over the small mask are cheaper
+    int count = 0;
+    CgnSatTask sat;
+    const CgnSatTask *s = NULL;
+    b->warm = cgn_warm_start(c, b, r, &count);
+    b->coarse = !b->warm && cgn_coarse_start(c, b, r, &count);
+    if (!b->warm && !b->coarse) {
+        r->x1 = b->ax1, r->x2 = b->ax2;
+        r->y1 = b->ay1, r->y2 = b->ay2;
+        r->nan = 0;
+
+        if (b->sat && !c->deterministic) {
+            cgn_sat_build(c, b, &sat);
+            s = &sat;
+        }
+        count = cgn_calc_beam_mask(c, b, s, r);
+    }
+
+    // Without the subtraction pass the count is only known after the first moments
+    if (!b->subtracted) {
+        b->count = count;
+        if (b->count < 10) {
+            cgn_set_nan(r);
+            return;
+        }
+    }
+
+    cgn_iterate_mask(c, b, s, r);
+}
+
+// Frames of a batch are taken by workers in runs of this length,
+// every run starts cold, and the next frames can be warm started from the previous ones.
+// So results don't depend on the number of threads, and runs are short enough to balance workers.
+#define CGN_BATCH_RUN 16
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const uint8_t *const *frames;
+    int count;
+    int next;
+    CgnBeamBkgnd *slots;
+    CgnBeamResult *results;
+} CgnBatchTask;
+
+// Each worker has its own copy of settings with scratch buffers of the same kinds as in the template.
+static int cgn_batch_alloc(const CgnBeamCalc *c, const CgnBeamBkgnd *tpl, CgnBeamBkgnd *b) {
+    const size_t px = (size_t)c->w * c->h;
+    const size_t value = tpl->subtracted_type == CGN_SUBTRACTED_F64 ? sizeof(double) : sizeof(float);
+    *b = *tpl;
+    b->subtracted = tpl->subtracted ? malloc(px * value) : NULL;
+    b->sat = tpl->sat ? malloc(cgn_sat_size(c->w, c->h) * sizeof(double)) : NULL;
+    b->runs = tpl->runs ? malloc(tpl->runs_size * sizeof(CgnBeamRun)) : NULL;
+    b->pyramid_buf = tpl->pyramid_buf ? malloc(cgn_pyramid_size(c->w, c->h, tpl->pyramid) * sizeof(int32_t)) : NULL;
+    return !tpl->subtracted == !b->subtracted && !tpl->sat == !b->sat &&
+        !tpl->runs == !b->runs && !tpl->pyramid_buf == !b->pyramid_buf;
+}
+
+static void cgn_batch_free(CgnBeamBkgnd *b) {
+    free(b->subtracted);
+    free(b->sat);
+    free(b->runs);
+    free(b->pyramid_buf);
+}
+
+// Every frame is calculated by a single thread, workers of the pool take runs of frames.
+static void cgn_batch_slot(void *ctx, int slot) {
+    CgnBatchTask *t = ctx;
+    CgnBeamBkgnd *b = t->slots + slot;
+    CgnBeamCalc c = *t->c;
+    c.pool = NULL;
+    int i1;
+    while ((i1 = __atomic_fetch_add(&t->next, CGN_BATCH_RUN, __ATOMIC_RELAXED)) < t->count) {
+        const int i2 = min(i1 + CGN_BATCH_RUN, t->count);
+        for (int i = i1; i < i2; i++) {
+            CgnBeamResult *r = t->results + i;
+            if (i > i1)
+                *r = r[-1];
+            else
+                cgn_set_nan(r);
+            c.buf = (uint8_t*)t->frames[i];
+            cgn_calc_beam_bkgnd(&c, b, r);
+        }
     }
+}
 
-void cgn_copy_u8_to_f64(const uint8_t *buf, int sz, double *tgt, double *max) {
-    cgn_copy_to
+int cgn_calc_beam_batch(const CgnBeamCalc *c, const CgnBeamBkgnd *b,
+    const uint8_t *const *frames, int count, CgnBeamResult *results) {
+    if (count <= 0)
+        return 1;
+    const int n = min(cgn_pool_threads(c->pool), (count + CGN_BATCH_RUN - 1) / CGN_BATCH_RUN);
+    CgnBeamBkgnd *slots = malloc(n * sizeof(CgnBeamBkgnd));
+    if (!slots)
+        return 0;
+    int ok = 1, allocated = 0;
+    for (; allocated < n && ok; allocated++)
+        ok = cgn_batch_alloc(c, b, slots + allocated);
+    if (ok) {
+        CgnBatchTask t;
+        t.c = c;
+        t.frames = frames;
+        t.count = count;
+        t.next = 0;
+        t.slots = slots;
+        t.results = results;
+        cgn_pool_run(c->pool, cgn_batch_slot, &t, n);
+    }
+    for (int i = 0; i < allocated; i++)
+        cgn_batch_free(slots + i);
+    free(slots);
+    return ok;
 }
 
-void cgn_copy_u16_to_f64(const uint16_t *buf, int sz, double *tgt, double *max) {
-    cgn_copy_to
+// Connected region of pixels above the threshold, `parent` links merged regions to their root.
+// Moments of merged regions are only summed into roots after labelling.
+typedef struct {
+    int parent;
+    CgnExactMoments e;
+} CgnBlob;
+
+// Run of pixels above the threshold, columns [x1, x2) of a row, and its region.
+typedef struct {
+    int x1, x2, label;
+} CgnBlobRun;
+
+// Regions of a band and runs of its first and last rows for linking them to neighbour bands.
+typedef struct {
+    CgnBlob *blobs;
+    int count, cap;
+    CgnBlobRun *first, *last;
+    int nfirst, nlast;
+    int failed;
+} CgnBlobBand;
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamBkgnd *b;
+    int th;
+    CgnBands bands;
+    CgnBlobBand band[CGN_MAX_BANDS];
+} CgnLabelTask;
+
+static int cgn_blob_find(CgnBlob *blobs, int k) {
+    while (blobs[k].parent != k) {
+        blobs[k].parent = blobs[blobs[k].parent].parent;
+        k = blobs[k].parent;
+    }
+    return k;
 }
 
-void cgn_copy_to_f64(const CgnBeamCalc *c, double *tgt, double *max) {
-    if (c->bpp > 8) {
-        cgn_copy_u16_to_f64((const uint16_t*)(c->buf), c->w*c->h, tgt, max);
+// The root of lower index is kept, so the result doesn't depend on the order of merges.
+static int cgn_blob_union(CgnBlob *blobs, int a, int b) {
+    a = cgn_blob_find(blobs, a);
+    b = cgn_blob_find(blobs, b);
+    if (a < b) blobs[b].parent = a;
+    else blobs[a].parent = b;
+    return min(a, b);
+}
+
+// Labels runs of a row by runs of the previous row touching them including diagonals.
+// New regions are appended to the band, returns 0 when they don't fit into memory.
+static int cgn_blob_link(CgnBlobBand *lb, const CgnBlobRun *prev, int nprev, CgnBlobRun *cur, int ncur) {
+    for (int j = 0, k = 0; j < ncur; j++) {
+        int label = -1;
+        while (k < nprev && prev[k].x2 < cur[j].x1)
+            k++;
+        for (int q = k; q < nprev && prev[q].x1 <= cur[j].x2; q++)
+            label = label < 0 ? cgn_blob_find(lb->blobs, prev[q].label) : cgn_blob_union(lb->blobs, label, prev[q].label);
+        if (label < 0) {
+            if (lb->count == lb->cap) {
+                const int cap = lb->cap ? lb->cap * 2 : 64;
+                CgnBlob *blobs = realloc(lb->blobs, cap * sizeof(CgnBlob));
+                if (!blobs)
+                    return 0;
+                lb->blobs = blobs;
+                lb->cap = cap;
+            }
+            label = lb->count++;
+            memset(lb->blobs + label, 0, sizeof(CgnBlob));
+            lb->blobs[label].parent = label;
+        }
+        cur[j].label = label;
+    }
+    return 1;
+}
+
+// Runs of non-zero values of row `v` starting at column `x1`, returns their number.
+static int cgn_blob_runs(const int32_t *v, int n, int x1, CgnBlobRun *runs) {
+    int count = 0, j = 0;
+    for (;;) {
+        while (j + 4 <= n && !v[j] && !v[j+1] && !v[j+2] && !v[j+3])
+            j += 4;
+        while (j < n && !v[j])
+            j++;
+        if (j == n)
+            return count;
+        runs[count].x1 = x1 + j;
+        while (j < n && v[j])
+            j++;
+        runs[count++].x2 = x1 + j;
+    }
+}
+
+static CgnBlobRun* cgn_blob_copy_runs(const CgnBlobRun *runs, int n) {
+    CgnBlobRun *dst = malloc(max(n, 1) * sizeof(CgnBlobRun));
+    if (dst)
+        memcpy(dst, runs, n * sizeof(CgnBlobRun));
+    return dst;
+}
+
+// Rows are thresholded into raw values and zeros by the same kernels as the integer subtracted image,
+// so pixels are read once, and only runs above the threshold are visited after that.
+#define cgn_label_band(type, pix_t)                                     \
+static void cgn_label_band_##type(void *ctx, int band) {                \
+    CgnLabelTask *t = ctx;                                              \
+    CgnBlobBand *lb = t->band + band;                                   \
+    const pix_t *buf = (const pix_t*)t->c->buf;                         \
+    const int x1 = t->b->ax1, n = t->b->ax2 - x1;                       \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int32_t d[n];                                                       \
+    CgnBlobRun runs[2][n/2 + 1];                                        \
+    CgnBlobRun *prev = runs[0], *cur = runs[1];                         \
+    int nprev = 0;                                                      \
+    memset(lb, 0, sizeof(CgnBlobBand));                                 \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        int32_t dmin, dmax;                                             \
+        const pix_t *row = cgn_row_##type(t->c, buf, i, x1, x1 + n, tmp); \
+        int ncur = 0;                                                   \
+        if (cgn_kernels.threshold_##type##_i32(row, n, t->th, d, &dmin, &dmax)) \
+            ncur = cgn_blob_runs(d, n, x1, cur);                        \
+        if (!cgn_blob_link(lb, prev, nprev, cur, ncur)) {               \
+            lb->failed = 1;                                             \
+            return;                                                     \
+        }                                                               \
+        for (int j = 0; j < ncur; j++) {                                \
+            int64_t s[6] = {0, 0, 0, 0, 0, 0};                          \
+            cgn_kernels.moments_masked_i32(d + cur[j].x1 - x1,          \
+                cur[j].x2 - cur[j].x1, cur[j].x1, 1, s);                \
+            cgn_exact_add_row(&lb->blobs[cur[j].label].e, s, i);        \
+        }                                                               \
+        if (i == i1) {                                                  \
+            lb->first = cgn_blob_copy_runs(cur, ncur);                  \
+            lb->nfirst = ncur;                                          \
+        }                                                               \
+        CgnBlobRun *r = prev; prev = cur; cur = r;                      \
+        nprev = ncur;                                                   \
+    }                                                                   \
+    lb->last = cgn_blob_copy_runs(prev, nprev);                         \
+    lb->nlast = nprev;                                                  \
+    lb->failed = !lb->first || !lb->last;                               \
+}
+
+cgn_label_band(u8, uint8_t)
+cgn_label_band(u16, uint16_t)
+
+// Spot being refined and the box around it free of other spots.
+typedef struct {
+    CgnBeamResult r;
+    int ax1, ay1, ax2, ay2;
+} CgnSpot;
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamBkgnd *b;
+    CgnSpot *spots;
+} CgnSpotTask;
+
+static int cgn_spot_cmp(const void *a, const void *b) {
+    const double pa = ((const CgnSpot*)a)->r.p, pb = ((const CgnSpot*)b)->r.p;
+    return pa > pb ? -1 : (pa < pb ? 1 : 0);
+}
+
+// Each spot is iterated by a single thread inside its own box,
+// spots falling back to moments of their regions when the first mask has too few pixels.
+static void cgn_spot_refine(void *ctx, int i) {
+    const CgnSpotTask *t = ctx;
+    CgnSpot *s = t->spots + i;
+    CgnBeamCalc c = *t->c;
+    c.pool = NULL;
+    CgnBeamBkgnd b = *t->b;
+    b.ax1 = s->ax1, b.ax2 = s->ax2;
+    b.ay1 = s->ay1, b.ay2 = s->ay2;
+    CgnBeamResult r = s->r;
+    int count;
+    if (cgn_seeded_start(&c, &b, &r, &count)) {
+        cgn_iterate_mask(&c, &b, NULL, &r);
+        s->r = r;
     } else {
-        cgn_copy_u8_to_f64((const uint8_t*)(c->buf), c->w*c->h, tgt, max);
+        s->r.x1 = b.ax1, s->r.x2 = b.ax2;
+        s->r.y1 = b.ay1, s->r.y2 = b.ay2;
+    }
+}
+
+// Joins regions of all bands into one array, linking runs of adjacent rows of neighbour bands,
+// and sums moments of merged regions into their roots. Returns NULL when out of memory.
+static CgnBlob* cgn_blob_merge(const CgnLabelTask *t, int *total) {
+    int offset[CGN_MAX_BANDS];
+    int n = 0;
+    for (int i = 0; i < t->bands.count; i++) {
+        offset[i] = n;
+        n += t->band[i].count;
+    }
+    CgnBlob *blobs = malloc(max(n, 1) * sizeof(CgnBlob));
+    if (!blobs)
+        return NULL;
+    for (int i = 0; i < t->bands.count; i++) {
+        const CgnBlobBand *lb = t->band + i;
+        for (int j = 0; j < lb->count; j++) {
+            blobs[offset[i] + j] = lb->blobs[j];
+            blobs[offset[i] + j].parent += offset[i];
+        }
+    }
+    for (int i = 1; i < t->bands.count; i++) {
+        const CgnBlobBand *up = t->band + i - 1, *lb = t->band + i;
+        for (int j = 0, k = 0; j < lb->nfirst; j++) {
+            const CgnBlobRun *r = lb->first + j;
+            while (k < up->nlast && up->last[k].x2 < r->x1)
+                k++;
+            for (int q = k; q < up->nlast && up->last[q].x1 <= r->x2; q++)
+                cgn_blob_union(blobs, offset[i] + r->label, offset[i-1] + up->last[q].label);
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        const int root = cgn_blob_find(blobs, k);
+        if (root != k)
+            cgn_exact_add(&blobs[root].e, &blobs[k].e);
+    }
+    *total = n;
+    return blobs;
+}
+
+int cgn_calc_multi_beam(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnMultiBeam *m) {
+    m->count = 0;
+    b->runs_count = -1;
+    if (!cgn_bkgnd_stats(c, b)) {
+        b->count = 0;
+        return 0;
+    }
+
+    CgnLabelTask *t = malloc(sizeof(CgnLabelTask));
+    if (!t)
+        return -1;
+    t->c = c;
+    t->b = b;
+    t->th = max(cgn_raw_threshold(b), 1);
+    cgn_make_bands(c, b->ay1, b->ay2, &t->bands);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_label_band_u16 : cgn_label_band_u8, t, t->bands.count);
+    int failed = 0;
+    for (int i = 0; i < t->bands.count; i++)
+        failed |= t->band[i].failed;
+    int total = 0;
+    CgnBlob *blobs = failed ? NULL : cgn_blob_merge(t, &total);
+    for (int i = 0; i < t->bands.count; i++) {
+        free(t->band[i].blobs);
+        free(t->band[i].first);
+        free(t->band[i].last);
+    }
+    free(t);
+    if (!blobs)
+        return -1;
+
+    // Roots are spots, their moments are relative to the frame origin,
+    // that is precise enough for the estimate that masks are then centered on
+    CgnSpot *spots = malloc(max(total, 1) * sizeof(CgnSpot));
+    if (!spots) {
+        free(blobs);
+        return -1;
+    }
+    int count = 0;
+    b->count = 0;
+    for (int k = 0; k < total; k++) {
+        if (blobs[k].parent != k)
+            continue;
+        b->count += blobs[k].e.n;
+        if (blobs[k].e.n < max(m->min_pixels, 1))
+            continue;
+        CgnBeamMoments bm;
+        cgn_exact_moments(&blobs[k].e, b->mean, &bm);
+        CgnSpot *s = spots + count++;
+        cgn_calc_beam_finish(&bm, 0, 0, &s->r);
+        s->r.nan = 0;
+    }
+    free(blobs);
+    qsort(spots, count, sizeof(CgnSpot), cgn_spot_cmp);
+
+    // Regions closer to a brighter spot than its diameter are fragments of its noisy edge
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        int fragment = 0;
+        for (int k = 0; k < kept && !fragment; k++)
+            fragment = sqr(spots[i].r.xc - spots[k].r.xc) + sqr(spots[i].r.yc - spots[k].r.yc) <
+                sqr(max(spots[k].r.dx, spots[k].r.dy));
+        if (!fragment)
+            spots[kept++] = spots[i];
+    }
+    count = kept;
+    m->count = count;
+
+    const int n = min(count, m->max_beams);
+    for (int i = 0; i < n; i++) {
+        // A single spot has no neighbours and is only bounded by the aperture
+        CgnSpot *s = spots + i;
+        s->ax1 = b->ax1, s->ax2 = b->ax2;
+        s->ay1 = b->ay1, s->ay2 = b->ay2;
+        if (count < 2)
+            continue;
+        double d2 = INFINITY;
+        for (int k = 0; k < count; k++)
+            if (k != i)
+                d2 = min(d2, sqr(spots[k].r.xc - s->r.xc) + sqr(spots[k].r.yc - s->r.yc));
+        // Box edges are clamped to the aperture before casting, they can be far outside of it
+        const double half = sqrt(d2) / 2;
+        s->ax1 = (int)floor(max((double)b->ax1, s->r.xc - half));
+        s->ax2 = (int)ceil(min((double)b->ax2, s->r.xc + half));
+        s->ay1 = (int)floor(max((double)b->ay1, s->r.yc - half));
+        s->ay2 = (int)ceil(min((double)b->ay2, s->r.yc + half));
+    }
+    // Spots are iterated over raw pixels with the background subtracted on the fly,
+    // buffers of the caller are not filled by this calculation
+    CgnBeamBkgnd sb = *b;
+    sb.subtracted = NULL;
+    sb.subtracted_type = CGN_SUBTRACTED_F64;
+    sb.sat = NULL;
+    sb.runs = NULL;
+    sb.runs_count = -1;
+    sb.warm_start = 0;
+    sb.pyramid = 0;
+    sb.pyramid_buf = NULL;
+    CgnSpotTask st;
+    st.c = c;
+    st.b = &sb;
+    st.spots = spots;
+    cgn_pool_run(c->pool, cgn_spot_refine, &st, n);
+    for (int i = 0; i < n; i++)
+        m->beams[i] = spots[i].r;
+    free(spots);
+    return count;
+}
+
+typedef struct {
+    const CgnBeamCalc *c;
+    double *tgt;
+    int with_max;
+    CgnBands bands;
+    double max[CGN_MAX_BANDS];
+} CgnCopyTask;
+
+// Rows are converted by SIMD kernels of the pixel type, the max is taken
+// from integer pixels of the row while it is still in cache.
+#define cgn_copy_band(type, pix_t)                                      \
+static void cgn_copy_band_##type(void *ctx, int band) {                 \
+    CgnCopyTask *t = ctx;                                               \
+    const pix_t *buf = (const pix_t*)t->c->buf;                         \
+    const int w = t->c->w;                                              \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    pix_t max = 0;                                                      \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        const pix_t *row = cgn_row_##type(t->c, buf, i, 0, w, tmp);     \
+        cgn_kernels.copy_##type(row, w, t->tgt + i*w);                  \
+        if (t->with_max)                                                \
+            for (int j = 0; j < w; j++)                                 \
+                max = row[j] > max ? row[j] : max;                      \
+    }                                                                   \
+    t->max[band] = max;                                                 \
+}
+
+cgn_copy_band(u8, uint8_t)
+cgn_copy_band(u16, uint16_t)
+
+void cgn_copy_to_f64(const CgnBeamCalc *c, double *tgt, double *max) {
+    CgnCopyTask t;
+    t.c = c;
+    t.tgt = tgt;
+    t.with_max = max != NULL;
+    cgn_make_bands(c, 0, c->h, &t.bands);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_copy_band_u16 : cgn_copy_band_u8, &t, t.bands.count);
+    if (max) {
+        *max = 0;
+        for (int i = 0; i < t.bands.count; i++)
+            *max = max(*max, t.max[i]);
     }
 }
 
@@ -226,69 +1714,397 @@ void cgn_copy_normalized_f64(double *src, double *tgt, int sz, double min, doubl
     }
 }
 
-#define _cgn_calc_brightness               \
-    double b_img = 0;                       \
-    for (int i = 0; i < h; i++) {           \
-        double b_row = 0;                   \
-        const int offset = i*w;             \
-        for (int j = 0; j < w; j += 8) {    \
-            double b0 = 0;                  \
-            for (int k = 0; k < 8; k++)     \
-                b0 += buf[offset + j + k];  \
-            b0 /= 8.0;                      \
-            if (b0 > b_row) b_row = b0;     \
-        }                                   \
-        if (b_row > b_img) b_img = b_row;   \
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamBright *b;
+    CgnBands bands;
+    int peak[CGN_MAX_BANDS];
+    int64_t sat[CGN_MAX_BANDS];
+} CgnBrightTask;
+
+// Raw pixels are taken, the sensor saturates before the dark frame is subtracted
+#define cgn_bright_band(type, pix_t)                                    \
+static void cgn_bright_band_##type(void *ctx, int band) {               \
+    CgnBrightTask *t = ctx;                                             \
+    const CgnBeamBright *b = t->b;                                      \
+    const int top = (1 << t->c->bpp) - 1;                               \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int peak = 0;                                                       \
+    int64_t sat = 0;                                                    \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        const pix_t *row = cgn_raw_row_##type(t->c, (const pix_t*)t->c->buf, i, b->x1, b->x2, tmp); \
+        cgn_kernels.bright_##type(row, b->x2 - b->x1, top, &peak, &sat); \
+    }                                                                   \
+    t->peak[band] = peak;                                               \
+    t->sat[band] = sat;                                                 \
+}
+
+cgn_bright_band(u8, uint8_t)
+cgn_bright_band(u16, uint16_t)
+
+void cgn_calc_bright(const CgnBeamCalc *c, CgnBeamBright *b) {
+    CgnBrightTask t;
+    t.c = c;
+    t.b = b;
+    cgn_make_bands(c, b->y1, b->y2, &t.bands);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_bright_band_u16 : cgn_bright_band_u8, &t, t.bands.count);
+
+    const int top = (1 << c->bpp) - 1;
+    int peak = 0;
+    int64_t sat = 0;
+    for (int i = 0; i < t.bands.count; i++) {
+        peak = max(peak, t.peak[i]);
+        sat += t.sat[i];
+    }
+    const int64_t count = (int64_t)(b->x2 - b->x1) * (b->y2 - b->y1);
+    b->brightness = peak / 8.0 / top;
+    b->saturated = count > 0 ? sat / (double)count : 0;
+    b->clipped = peak >= 8 * top;
+}
+
+// Rows of the area are split into parts counted in parallel, each part has its own banks.
+// Consecutive pixels go to different banks, so runs of equal pixels typical for flat
+// background don't stall on increments of the same counter waiting for each other.
+// There is a part per pool thread up to CGN_HIST_PARTS, as banks of each part are cleared
+// and merged on every call, that is 1MB of counters per part for 16-bit frames.
+#define CGN_HIST_PARTS 4
+#define CGN_HIST_BANKS 4
+
+int cgn_hist_size(int bpp) {
+    return (CGN_HIST_PARTS * CGN_HIST_BANKS) << bpp;
+}
+
+typedef struct {
+    const CgnBeamCalc *c;
+    const CgnBeamHist *h;
+    int parts;
+    int64_t block[CGN_HIST_PARTS];
+} CgnHistTask;
+
+// Pixels above the range are counted as saturated ones.
+// Sums of 8-pixel blocks are taken in the same pass for the brightness level.
+#define cgn_hist_part(type, pix_t)                                      \
+static void cgn_hist_part_##type(void *ctx, int part) {                 \
+    CgnHistTask *t = (CgnHistTask*)ctx;                                 \
+    const CgnBeamHist *h = t->h;                                        \
+    const int bins = 1 << t->c->bpp;                                    \
+    const int top = bins - 1;                                           \
+    uint32_t *b0 = h->bins + part * CGN_HIST_BANKS * bins;              \
+    uint32_t *b1 = b0 + bins;                                           \
+    uint32_t *b2 = b1 + bins;                                           \
+    uint32_t *b3 = b2 + bins;                                           \
+    memset(b0, 0, CGN_HIST_BANKS * bins * sizeof(uint32_t));            \
+    const int i1 = h->y1 + (h->y2 - h->y1) * part / t->parts;           \
+    const int i2 = h->y1 + (h->y2 - h->y1) * (part + 1) / t->parts;     \
+    const int n = h->x2 - h->x1;                                        \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int64_t block = 0;                                                  \
+    for (int i = i1; i < i2; i++) {                                     \
+        const pix_t *row = cgn_raw_row_##type(t->c, (const pix_t*)t->c->buf, i, h->x1, h->x2, tmp); \
+        int j = 0;                                                      \
+        for (; j + 8 <= n; j += 8) {                                    \
+            int64_t s = 0;                                              \
+            for (int k = j; k < j + 8; k += 4) {                        \
+                const int p0 = min(row[k+0], top);                      \
+                const int p1 = min(row[k+1], top);                      \
+                const int p2 = min(row[k+2], top);                      \
+                const int p3 = min(row[k+3], top);                      \
+                b0[p0]++;                                               \
+                b1[p1]++;                                               \
+                b2[p2]++;                                               \
+                b3[p3]++;                                               \
+                s += p0 + p1 + p2 + p3;                                 \
+            }                                                           \
+            block = max(block, s);                                      \
+        }                                                               \
+        for (; j < n; j++)                                              \
+            b0[min(row[j], top)]++;                                     \
+    }                                                                   \
+    t->block[part] = block;                                             \
+}
+
+cgn_hist_part(u8, uint8_t)
+cgn_hist_part(u16, uint16_t)
+
+void cgn_calc_hist(const CgnBeamCalc *c, CgnBeamHist *h) {
+    CgnHistTask t;
+    t.c = c;
+    t.h = h;
+    t.parts = min(cgn_pool_threads(c->pool), CGN_HIST_PARTS);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_hist_part_u16 : cgn_hist_part_u8, &t, t.parts);
+
+    const int bins = 1 << c->bpp;
+    int64_t block = 0;
+    for (int i = 0; i < t.parts; i++)
+        block = max(block, t.block[i]);
+    for (int k = 1; k < t.parts * CGN_HIST_BANKS; k++) {
+        const uint32_t *b = h->bins + k * bins;
+        for (int v = 0; v < bins; v++)
+            h->bins[v] += b[v];
     }
 
-double cgn_calc_brightness_u8(const uint8_t *buf, int w, int h) {
-    _cgn_calc_brightness
-    return b_img / 255.0;
+    int64_t count = 0, sum = 0;
+    h->min = 0;
+    h->max = 0;
+    for (int v = 0; v < bins; v++) {
+        if (!h->bins[v]) continue;
+        if (!count) h->min = v;
+        h->max = v;
+        count += h->bins[v];
+        sum += (int64_t)v * h->bins[v];
+    }
+    h->count = count;
+    h->mean = count ? sum / (double)count : 0;
+    h->saturated = h->bins[bins - 1];
+    h->brightness = block / 8.0 / (bins - 1);
 }
 
-double cgn_calc_brightness_u16(const uint16_t *buf, int w, int h, int bpp) {
-    _cgn_calc_brightness
-    return b_img / ((1 << bpp) - 1);
+int cgn_hist_percentile(const CgnBeamHist *h, double p) {
+    const int64_t target = (int64_t)ceil(p * h->count);
+    int64_t sum = 0;
+    for (int v = h->min; v < h->max; v++) {
+        sum += h->bins[v];
+        if (sum >= target) return v;
+    }
+    return h->max;
 }
 
-double cgn_calc_brightness(const CgnBeamCalc *c) {
-    if (c->bpp > 8) {
-        return cgn_calc_brightness_u16((const uint16_t*)(c->buf), c->w, c->h, c->bpp);
+void cgn_unpack_u16(const CgnBeamCalc *c, uint16_t *dst) {
+    if (c->packing == CGN_PACKED_10G40) {
+        cgn_convert_10g40_to_u16((uint8_t*)dst, c->buf, c->w*c->h/4*5);
+    } else if (c->packing == CGN_PACKED_12G24) {
+        cgn_convert_12g24_to_u16((uint8_t*)dst, c->buf, c->w*c->h/2*3);
     } else {
-        return cgn_calc_brightness_u8((const uint8_t*)(c->buf), c->w, c->h);
+        memcpy(dst, c->buf, c->w*c->h*sizeof(uint16_t));
     }
 }
 
-typedef struct { uint8_t b0, b1, b2, b3, b4; } PixelGroup10;
-void cgn_convert_10g40_to_u16(uint8_t *dst, uint8_t *src, int sz) {
-    int j = 0;
-    PixelGroup10 *g = (PixelGroup10*)src;
-    for (int i = 0; i < sz; i += 5) {
-        dst[j++] = ((g->b4 & 0b00000011) >> 0) | (g->b0 << 2);
-        dst[j++] = g->b0 >> 6;
-        dst[j++] = ((g->b4 & 0b00001100) >> 2) | (g->b1 << 2);
-        dst[j++] = g->b1 >> 6;
-        dst[j++] = ((g->b4 & 0b00110000) >> 4) | (g->b2 << 2);
-        dst[j++] = g->b2 >> 6;
-        dst[j++] = ((g->b4 & 0b11000000) >> 6) | (g->b3 << 2);
-        dst[j++] = g->b3 >> 6;
-        g++;
-    }
-}
-
-typedef struct { uint8_t b0, b1, b2; } PixelGroup12;
-void cgn_convert_12g24_to_u16(uint8_t *dst, uint8_t *src, int sz) {
-    int j = 0;
-    PixelGroup12 *g = (PixelGroup12*)src;
-    for (int i = 0; i < sz; i += 3) {
-        dst[j++] = (g->b2 & 0x0F) | (g->b0 << 4);
-        dst[j++] = g->b0 >> 4;
-        dst[j++] = (g->b2 >> 4) | (g->b1 << 4);
-        dst[j++] = g->b1 >> 4;
-        g++;
+typedef struct {
+    const CgnBeamCalc *c;
+    float *mean;
+    int n;
+    CgnBands bands;
+} CgnMeanTask;
+
+// The running mean needs no wide accumulator and is valid after every added frame.
+#define cgn_mean_band(type, pix_t)                                      \
+static void cgn_mean_band_##type(void *ctx, int band) {                 \
+    CgnMeanTask *t = ctx;                                               \
+    const pix_t *buf = (const pix_t*)t->c->buf;                         \
+    const int w = t->c->w;                                              \
+    const float k = 1.0f / (t->n + 1);                                  \
+    uint16_t tmp[cgn_row_tmp(t->c)];                                    \
+    int i1, i2;                                                         \
+    cgn_band_rows(&t->bands, band, &i1, &i2);                           \
+    for (int i = i1; i < i2; i++) {                                     \
+        const pix_t *row = cgn_row_##type(t->c, buf, i, 0, w, tmp);     \
+        float *m = t->mean + i*w;                                       \
+        if (t->n == 0) {                                                \
+            for (int j = 0; j < w; j++) m[j] = row[j];                  \
+        } else {                                                        \
+            for (int j = 0; j < w; j++) m[j] += (row[j] - m[j]) * k;    \
+        }                                                               \
+    }                                                                   \
+}
+
+cgn_mean_band(u8, uint8_t)
+cgn_mean_band(u16, uint16_t)
+
+void cgn_mean_add(const CgnBeamCalc *c, float *mean, int n) {
+    // Frames are averaged as they are, without the current dark frame subtracted
+    CgnBeamCalc raw = *c;
+    raw.dark = NULL;
+    CgnMeanTask t;
+    t.c = &raw;
+    t.mean = mean;
+    t.n = n;
+    cgn_make_bands(c, 0, c->h, &t.bands);
+    cgn_pool_run(c->pool, c->bpp > 8 ? cgn_mean_band_u16 : cgn_mean_band_u8, &t, t.bands.count);
+}
+
+int cgn_dark_finish(const float *mean, int sz, uint16_t *dark) {
+    double sum = 0;
+    for (int i = 0; i < sz; i++) {
+        const long v = lrintf(mean[i]);
+        dark[i] = v < 0 ? 0 : (v > 0xFFFF ? 0xFFFF : v);
+        sum += dark[i];
+    }
+    return sz > 0 ? (int)lround(sum / sz) : 0;
+}
+
+void cgn_flat_gain(const float *flat, const uint16_t *dark, int sz, float *gain) {
+    double sum = 0;
+    int count = 0;
+    for (int i = 0; i < sz; i++) {
+        const float v = dark ? flat[i] - dark[i] : flat[i];
+        if (v > 0) {
+            sum += v;
+            count++;
+        }
+    }
+    const float avg = count > 0 ? sum / count : 0;
+    for (int i = 0; i < sz; i++) {
+        const float v = dark ? flat[i] - dark[i] : flat[i];
+        gain[i] = v > 0 && avg > 0 ? avg / v : 1;
+    }
+}
+
+// Median of values clamped to 0..65535 by histogram of `bins`, then median of their deviations from it.
+static void cgn_median_dev(const float *v, int sz, uint32_t *bins, int *median, double *dev) {
+    memset(bins, 0, 65536*sizeof(uint32_t));
+    for (int i = 0; i < sz; i++) {
+        const long p = lrintf(v[i]);
+        bins[p < 0 ? 0 : (p > 0xFFFF ? 0xFFFF : p)]++;
+    }
+    const uint32_t half = sz/2;
+    int m = 0;
+    for (uint32_t n = 0; m < 0xFFFF && (n += bins[m]) <= half; m++);
+    memset(bins, 0, 65536*sizeof(uint32_t));
+    for (int i = 0; i < sz; i++) {
+        const long d = labs(lrintf(v[i]) - m);
+        bins[d > 0xFFFF ? 0xFFFF : d]++;
+    }
+    int d = 0;
+    for (uint32_t n = 0; d < 0xFFFF && (n += bins[d]) <= half; d++);
+    *median = m;
+    // Scaled to the standard deviation of normal noise
+    *dev = d * 1.4826;
+}
+
+static int cgn_is_defect(const int32_t *idx, int n, int32_t k) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (idx[mid] < k) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && idx[lo] == k;
+}
+
+// Average of good 4-neighbours of the defect `k`, or of diagonal ones when there are no good 4-neighbours.
+// Returns zero when all 8 neighbours are defects too.
+#define cgn_defect_neighbours(get)                                      \
+    const int x = k % w, y = k / w;                                     \
+    double sum = 0;                                                     \
+    int cnt = 0;                                                        \
+    for (int pass = 0; pass < 2 && cnt == 0; pass++) {                  \
+        static const int nb[2][4][2] = {                                \
+            {{-1, 0}, {1, 0}, {0, -1}, {0, 1}},                         \
+            {{-1, -1}, {1, -1}, {-1, 1}, {1, 1}},                       \
+        };                                                              \
+        for (int q = 0; q < 4; q++) {                                   \
+            const int nx = x + nb[pass][q][0], ny = y + nb[pass][q][1]; \
+            if (nx < 0 || nx >= w || ny < 0 || ny >= h) continue;       \
+            const int32_t nk = ny*w + nx;                               \
+            if (cgn_is_defect(idx, n, nk)) continue;                    \
+            sum += get(nk);                                             \
+            cnt++;                                                      \
+        }                                                               \
+    }
+
+static void cgn_fix_defects_f32(float *v, int w, int h, const int32_t *idx, int n) {
+    for (int i = 0; i < n; i++) {
+        const int32_t k = idx[i];
+        #define get(j) v[j]
+        cgn_defect_neighbours(get)
+        #undef get
+        if (cnt > 0) v[k] = sum / cnt;
+    }
+}
+
+int cgn_find_hot(float *dark, int w, int h, double nT, int32_t *idx) {
+    const int sz = w*h;
+    uint32_t *bins = (uint32_t*)malloc(65536*sizeof(uint32_t));
+    if (!bins) return -1;
+    int m;
+    double dev;
+    cgn_median_dev(dark, sz, bins, &m, &dev);
+    free(bins);
+    // Averaged dark frames can have deviation less than the quantization step
+    const double t = m + nT * max(dev, 1.0);
+    int n = 0;
+    for (int i = 0; i < sz; i++)
+        if (dark[i] > t)
+            idx[n++] = i;
+    cgn_fix_defects_f32(dark, w, h, idx, n);
+    return n;
+}
+
+int cgn_find_dead(float *flat, const uint16_t *dark, int w, int h, double ratio, int32_t *idx) {
+    const int sz = w*h;
+    uint32_t *bins = (uint32_t*)malloc(65536*sizeof(uint32_t));
+    if (!bins) return -1;
+    // Response is counted in place and then the dark frame is added back
+    if (dark) for (int i = 0; i < sz; i++) flat[i] -= dark[i];
+    int m;
+    double dev;
+    cgn_median_dev(flat, sz, bins, &m, &dev);
+    free(bins);
+    const double lo = m * ratio, hi = ratio > 0 ? m / ratio : INFINITY;
+    int n = 0;
+    for (int i = 0; i < sz; i++)
+        if (flat[i] < lo || flat[i] > hi)
+            idx[n++] = i;
+    cgn_fix_defects_f32(flat, w, h, idx, n);
+    if (dark) for (int i = 0; i < sz; i++) flat[i] += dark[i];
+    return n;
+}
+
+// Pixel `k` of the frame with packing, rows of packed frames follow without gaps.
+static inline int cgn_pixel_get(const CgnBeamCalc *c, int32_t k) {
+    const uint8_t *b = c->buf;
+    switch (c->packing) {
+    case CGN_PACKED_10G40:
+        b += k/4*5;
+        return (b[k%4] << 2) | ((b[4] >> (k%4*2)) & 3);
+    case CGN_PACKED_12G24:
+        b += k/2*3;
+        return (b[k%2] << 4) | ((b[2] >> (k%2*4)) & 15);
+    default:
+        return c->bpp > 8 ? ((const uint16_t*)b)[k] : b[k];
+    }
+}
+
+static inline void cgn_pixel_set(const CgnBeamCalc *c, int32_t k, int v) {
+    uint8_t *b = c->buf;
+    switch (c->packing) {
+    case CGN_PACKED_10G40:
+        b += k/4*5;
+        b[k%4] = v >> 2;
+        b[4] = (b[4] & ~(3 << (k%4*2))) | ((v & 3) << (k%4*2));
+        break;
+    case CGN_PACKED_12G24:
+        b += k/2*3;
+        b[k%2] = v >> 4;
+        b[2] = (b[2] & ~(15 << (k%2*4))) | ((v & 15) << (k%2*4));
+        break;
+    default:
+        if (c->bpp > 8) ((uint16_t*)b)[k] = v;
+        else b[k] = v;
+    }
+}
+
+void cgn_fix_defects(const CgnBeamCalc *c, const int32_t *idx, int n) {
+    const int w = c->w, h = c->h;
+    for (int i = 0; i < n; i++) {
+        const int32_t k = idx[i];
+        #define get(j) cgn_pixel_get(c, j)
+        cgn_defect_neighbours(get)
+        #undef get
+        if (cnt > 0) cgn_pixel_set(c, k, (int)(sum / cnt + 0.5));
     }
 }
 
+// Trailing bytes which do not make up a whole pixel group are ignored
+void cgn_convert_10g40_to_u16(uint8_t *dst, uint8_t *src, int sz) {
+    cgn_kernels.unpack_10g40(src, sz / 5 * 4, (uint16_t*)dst);
+}
+
+void cgn_convert_12g24_to_u16(uint8_t *dst, uint8_t *src, int sz) {
+    cgn_kernels.unpack_12g24(src, sz / 3 * 2, (uint16_t*)dst);
+}
 
 #ifdef USE_BLAS
 
@@ -42,13 +42,79 @@ void cgn_calc_beam_blas_u16(const uint16_t *b, CgnBeamCalcBlas *c, CgnBeamResult
 #endif // USE_BLAS
 
 
+// Persistent pool of worker threads, see cgn_pool_create().
+typedef struct CgnBeamPool CgnBeamPool;
+
+// Packed pixel formats of IDS cameras.
+enum {
+    CGN_UNPACKED,
+
+    // Mono10g40: 4 pixels in 5 bytes, high 8 bits of each pixel and then a byte of low bits.
+    CGN_PACKED_10G40,
+
+    // Mono12g24: 2 pixels in 3 bytes, high 8 bits of each pixel and then a byte of low bits.
+    CGN_PACKED_12G24,
+};
+
 typedef struct {
     int w;
     int h;
     int bpp;
     uint8_t *buf;
+
+    // Packed frames are decoded row by row right in calculation passes,
+    // so there is no need in expanding them into 16-bit pixels beforehand.
+    // The frame width must be a multiple of the pixel group size then.
+    int packing;
+
+    // Optional dark frame of `w*h` reference values, see cgn_dark_finish().
+    // It is subtracted from raw pixels in the same passes that read them, mask iterations over raw pixels
+    // do it in registers right before thresholding, so there is no separate pass making a corrected frame.
+    // Pixels become `p - dark + dark_level` clamped to the range of `bpp`, where `dark_level` keeps
+    // the noise around dark values from clipping at zero.
+    // Each iteration reads the reference again, with many iterations the I32 subtracted image is faster.
+    // cgn_calc_bright(), cgn_calc_hist() and cgn_unpack_u16() give raw pixels as they are.
+    const uint16_t *dark;
+    int dark_level;
+
+    // Optional flat-field gains of `w*h` values, see cgn_flat_gain(). They are only applied with `dark`,
+    // pixels are then `(p - dark)*gain + dark_level` rounded to nearest.
+    const float *gain;
+
+    // Optional pool of worker threads.
+    // Calculations are done in the calling thread when it is NULL.
+    // Results are the same either way and don't depend on the number of threads.
+    CgnBeamPool *pool;
+
+    // Enables the deterministic mode when not zero. Moments of integer pixels are accumulated
+    // in exact 64/128-bit integer sums instead of doubles, and the background is only subtracted
+    // from the final sums. Results then don't depend on the SIMD level or the order of summation,
+    // and don't drift with floating point contraction of other builds and compilers.
+    // With background subtraction, mask iterations always take moments from raw pixels
+    // or the integer subtracted image, summed-area tables, runs and f64/f32 subtracted images
+    // are not used for them.
+    int deterministic;
 } CgnBeamCalc;
 
+// Types of values in the `subtracted` buffer of CgnBeamBkgnd.
+enum {
+    // Pixel values with background subtracted.
+    CGN_SUBTRACTED_F64,
+
+    // The same rounded to floats, it takes half the memory of doubles.
+    CGN_SUBTRACTED_F32,
+
+    // Raw pixel values above the noise threshold and zeros for others.
+    // Values with background subtracted are then `p - mean` for non-zero pixels.
+    // Moments are taken from exact integer sums the same way as when subtracting on the fly.
+    CGN_SUBTRACTED_I32,
+};
+
+// Run of pixels above the noise threshold, columns [x1, x2) of row `y`.
+typedef struct {
+    int y, x1, x2;
+} CgnBeamRun;
+
 typedef struct {
     // Aperture bounds inside that calculations should be carried out.
     int ax1, ay1, ax2, ay2;
@@ -73,9 +139,61 @@ typedef struct {
     // ISO 11146 states that it should be 3.
     double mask_diam;
 
-    // Pixel values with background subtracted.
+    // Pixel values with background subtracted, `w*h` values of `subtracted_type`.
     // Only pixes inside aperture bonds have valid values.
-    double *subtracted;
+    // When it is NULL, the background is subtracted on the fly while calculating moments
+    // right from raw pixels, and the subtracted image can be got by cgn_copy_subtracted_f64().
+    void *subtracted;
+
+    // One of CGN_SUBTRACTED_* types, zero means doubles.
+    int subtracted_type;
+
+    // Optional buffer of cgn_sat_size() doubles for summed-area tables of moments.
+    // When given, mask iterations take moments from the tables instead of passes over
+    // `subtracted`, so each of them costs in proportion to the mask perimeter, not its area.
+    // Results can differ from ones calculated without tables in the last digits.
+    double *sat;
+
+    // Optional arena of `runs_size` runs for the sparse list of pixels above the noise threshold.
+    // When given, the pass making `subtracted` lists runs of its non-zero pixels sorted by rows,
+    // and mask iterations take moments only over runs crossing the mask when pixels
+    // above the threshold are few compared to the mask area.
+    // The arena is split evenly between row bands, so it should have some reserve.
+    // Runs separated by short gaps of zeros are merged, the zeros add nothing to moments.
+    // Results can differ from ones calculated by dense passes in the last digits.
+    CgnBeamRun *runs;
+    int runs_size;
+
+    // Number of runs listed by the latest calculation,
+    // -1 when they have not fit into the arena or there is no `subtracted` buffer.
+    int runs_count;
+
+    // Enables the temporal warm start when positive.
+    // The incoming result is then taken as the result of the previous frame,
+    // and the first moments are taken over its mask instead of the whole aperture.
+    // When the beam center or diameters differ from the previous ones by more than
+    // this fraction of the previous diameter, or the previous result is nan,
+    // calculation falls back to the cold start from the whole aperture.
+    double warm_start;
+
+    // Set when the latest calculation has been started from the previous result.
+    int warm;
+
+    // Enables the coarse-to-fine start on cold starts when 2, 4 or 8.
+    // The beam is first found in the aperture downsampled by averaging blocks of this size,
+    // then exact moments are calculated at full resolution starting from the mask of that estimate
+    // instead of the whole aperture. Other values are rounded down to these factors.
+    int pyramid;
+
+    // Buffer of cgn_pyramid_size() ints for the downsampled aperture, the coarse start is off without it.
+    int32_t *pyramid_buf;
+
+    // The min diameter of the coarse beam in downsampled pixels along both axes.
+    // Smaller beams are under-sampled on the coarse level, and calculation starts from the whole aperture.
+    double pyramid_min;
+
+    // Set when the latest calculation has been started from the coarse estimate.
+    int coarse;
 
     // The latest calculation aperture inside that the beam diameter has been calculated with required precision.
     // Can not be larger and clamped to initial aperture bounds.
@@ -85,15 +203,59 @@ typedef struct {
     int iters;
 
     // Background and noise values.
+    // They are estimated in a single pass from exact integer sums of corner pixels and their squares
+    // for any type of the subtracted image, the same as when subtracting the background on the fly.
     double mean, sdev;
 
     // Min and max pixel values after backgdound subtracted.
+    // When `subtracted` is NULL, they are only updated by cgn_copy_subtracted_f64().
     double min, max;
 
     // Number of pixels about the noise threshol/
+    // On warm starts without `subtracted` buffer, only pixels inside the first mask are counted.
     int count;
 } CgnBeamBkgnd;
 
+// Histogram of raw pixel values over an area of the frame, the dark frame is not applied
+// the same as for cgn_calc_bright(), so it describes pixels as the camera gives them.
+// All the statistics are collected in a single pass over pixels.
+typedef struct {
+    // Area of the frame to be counted, e.g. the aperture.
+    int x1, y1, x2, y2;
+
+    // Scratch space of cgn_hist_size() counters provided by the caller,
+    // the first `1 << bpp` of them are the histogram itself.
+    uint32_t *bins;
+
+    // Number of counted pixels and their statistics.
+    int count;
+    int min, max;
+    double mean;
+
+    // Number of pixels at the top of the range `(1 << bpp) - 1`,
+    // values above the range are counted as saturated too.
+    int saturated;
+
+    // The max of averages of 8-pixel blocks along rows relative to the range,
+    // it is the same level as cgn_calc_bright() gives when the area width is a multiple of 8.
+    double brightness;
+} CgnBeamHist;
+
+// Exposure level of the area, it is cheap enough to be taken from every frame.
+typedef struct {
+    int x1, y1, x2, y2;
+
+    // The max of averages of 8-pixel groups along rows relative to the range,
+    // groups start from `x1`, the last shorter group of a row is averaged over its own pixels.
+    double brightness;
+
+    // Fraction of pixels at the top of the range `(1 << bpp) - 1` or above it.
+    double saturated;
+
+    // The brightest group is at the top of the range entirely, the beam is cut by the sensor.
+    int clipped;
+} CgnBeamBright;
+
 typedef struct {
     int x1, x2;
     int y1, y2;
@@ -111,13 +273,111 @@ typedef struct {
 
 void cgn_calc_beam_naive(const CgnBeamCalc *c, CgnBeamResult *r);
 void cgn_calc_beam_bkgnd(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnBeamResult *r);
+
+// Calculates `results` of `count` frames of the same size and format as `c`, its `buf` is ignored.
+// Settings of all frames are taken from the template `b`, and every worker of `c->pool`
+// gets its own scratch buffers of the same kinds that the template has, buffers of the template itself
+// are not touched. Frames are calculated in parallel, each frame by a single thread.
+// With `warm_start` frames are started from the previous frame of the same run of 16 frames,
+// so results don't depend on the number of threads.
+// Returns 0 when scratch buffers could not be allocated.
+int cgn_calc_beam_batch(const CgnBeamCalc *c, const CgnBeamBkgnd *b,
+    const uint8_t *const *frames, int count, CgnBeamResult *results);
+
+// Spots of multi-beam calculation, see cgn_calc_multi_beam().
+typedef struct {
+    // Results of `max_beams` capacity, spots are ordered by power, the brightest first.
+    CgnBeamResult *beams;
+    int max_beams;
+
+    // Connected regions of fewer pixels above the noise threshold are taken as noise.
+    int min_pixels;
+
+    // Number of spots found by the latest calculation. It can be more than `max_beams`,
+    // only the brightest of them are refined and written into `beams` then.
+    int count;
+} CgnMultiBeam;
+
+// Finds all spots in the aperture, e.g. of a fibre bundle or a beam splitter.
+// Pixels above the noise threshold are labelled into 8-connected regions in a single pass
+// by row bands in parallel, raw moments of regions are accumulated along the way.
+// Then each spot is refined by its own ISO mask iteration from the moments of its region,
+// the mask is kept inside the box of half the distance to the nearest spot around the spot,
+// so close spots don't take in each other. Spots are refined in parallel, each by a single thread.
+// Settings are taken from `b` as for cgn_calc_beam_bkgnd(), the background is subtracted on the fly,
+// `subtracted`, `sat`, `runs`, `warm_start` and `pyramid` are not used. `b` gets background values.
+// Returns the number of spots or -1 when out of memory.
+int cgn_calc_multi_beam(const CgnBeamCalc *c, CgnBeamBkgnd *b, CgnMultiBeam *m);
+
+int cgn_sat_size(int w, int h);
+int cgn_pyramid_size(int w, int h, int factor);
+
+// Writes pixel values with background subtracted as they would be in `subtracted` buffer,
+// using background values of the latest cgn_calc_beam_bkgnd() call, and updates `min` and `max`.
+// It is for displaying results when the background is subtracted on the fly.
+void cgn_copy_subtracted_f64(const CgnBeamCalc *c, CgnBeamBkgnd *b, double *tgt);
+// `max` is optional, it is better taken from the histogram when there is one.
 void cgn_copy_to_f64(const CgnBeamCalc *c, double *tgt, double *max);
 void cgn_normalize_f64(double *buf, int sz, double min, double max);
 void cgn_copy_normalized_f64(double *src, double *tgt, int sz, double min, double max);
-double cgn_calc_brightness(const CgnBeamCalc *c);
+
+// Takes brightness and saturation in a single pass of integer kernels by row bands in parallel.
+void cgn_calc_bright(const CgnBeamCalc *c, CgnBeamBright *b);
+
+int cgn_hist_size(int bpp);
+void cgn_calc_hist(const CgnBeamCalc *c, CgnBeamHist *h);
+
+// Returns the lowest value that is not less than `p` (0..1) fraction of counted pixels.
+int cgn_hist_percentile(const CgnBeamHist *h, double p);
 void cgn_convert_10g40_to_u16(uint8_t *dst, uint8_t *src, int sz);
 void cgn_convert_12g24_to_u16(uint8_t *dst, uint8_t *src, int sz);
 
+// Expands the whole packed frame into 16-bit pixels, unpacked 16-bit frames are copied as is.
+void cgn_unpack_u16(const CgnBeamCalc *c, uint16_t *dst);
+
+// Adds raw pixels of the frame to `mean` of `w*h` values which is the mean of `n` frames added before,
+// `n = 0` starts a new mean. The frame is taken without `dark` subtracted whether it is given or not.
+void cgn_mean_add(const CgnBeamCalc *c, float *mean, int n);
+
+// Rounds the mean of dark frames into the reference for `dark` of CgnBeamCalc.
+// Returns the average dark value that is good for `dark_level`.
+int cgn_dark_finish(const float *mean, int sz, uint16_t *dark);
+
+// Makes gains leveling the mean of flat frames with the `dark` reference subtracted, `dark` can be NULL.
+// Pixels not brighter than the dark reference get unit gains.
+void cgn_flat_gain(const float *flat, const uint16_t *dark, int sz, float *gain);
+
+// Finds hot pixels in the mean of dark frames, those brighter than its median by more than `nT` deviations.
+// Writes their indices in ascending order into `idx` of `w*h` capacity and returns their number, or -1 when out of memory.
+// Found pixels are replaced in the mean by their neighbours, so the reference made of it afterwards has no outliers.
+int cgn_find_hot(float *dark, int w, int h, double nT, int32_t *idx);
+
+// Finds dead and hot pixels in the mean of flat frames, those whose response over the `dark` reference (can be NULL)
+// is less than `ratio` (0..1) or more than `1/ratio` of the median response. Otherwise the same as cgn_find_hot().
+int cgn_find_dead(float *flat, const uint16_t *dark, int w, int h, double ratio, int32_t *idx);
+
+// Replaces pixels at ascending indices `idx` right in the frame by the average of their non-defect neighbours.
+// Only listed pixels are touched, so calculations after this see a clean frame at no cost in their passes.
+void cgn_fix_defects(const CgnBeamCalc *c, const int32_t *idx, int n);
+
+// Starts `threads` workers, the calling thread only waits for them to finish.
+// When `first_cpu` is not negative, workers are pinned to consecutive cores starting from it,
+// so several cameras can be given their own cores and don't compete for them.
+// Returns NULL if threads could not be started.
+CgnBeamPool* cgn_pool_create(int threads, int first_cpu);
+void cgn_pool_free(CgnBeamPool *pool);
+
+// Returns the number of workers, 1 for NULL pool as calculations are done in the calling thread then.
+int cgn_pool_threads(const CgnBeamPool *pool);
+
+typedef void (*CgnPoolTask)(void *ctx, int index);
+
+// Runs `task(ctx, i)` for each i in [0, count) and waits for all of them to finish.
+// Tasks are taken by workers in arbitrary order, so they must write to their own slots.
+// Runs tasks one by one in the calling thread when `pool` is NULL.
+// It is public for other libraries sharing the pool, e.g. renderer of the demo camera.
+void cgn_pool_run(CgnBeamPool *pool, CgnPoolTask task, void *ctx, int count);
+
 #ifdef __cplusplus
 }
 #endif
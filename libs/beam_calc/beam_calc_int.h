@@ -0,0 +1,119 @@
+#ifndef _CIGNUS_BEAM_CALC_INT_H_
+#define _CIGNUS_BEAM_CALC_INT_H_
+
+// Internal declarations shared between beam_calc sources.
+// It is not a part of the public API, don't include it into the app.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    CGN_SIMD_SCALAR,
+    CGN_SIMD_SSE42,
+    CGN_SIMD_AVX2,
+    CGN_SIMD_AVX512,
+    CGN_SIMD_COUNT,
+};
+
+// Dark frame correction of a row for kernels, see `dark` of CgnBeamCalc.
+// Pixels become `p - d[j] + level`, or `(p - d[j])*g[j] + level` rounded to nearest
+// when `g` is not NULL, clamped to [0, maxv].
+typedef struct {
+    const uint16_t *d;
+    const float *g;
+    int level;
+    int maxv;
+} CgnRowDark;
+
+// Row kernels. Each of them processes `n` consecutive pixels of a single row.
+// Integer kernels assume the frame width is less than 65536,
+// which keeps products `p*x` of 16-bit pixels inside int32.
+typedef struct {
+    // Moment sums s[0] = sum(p), s[1] = sum(p*x), s[2] = sum(p*x^2)
+    // where x starts from `x0` and increments by 1 for each next pixel.
+    void (*moments_u8)(const uint8_t *row, int n, int x0, int64_t *s);
+    void (*moments_u16)(const uint16_t *row, int n, int x0, int64_t *s);
+    void (*moments_f64)(const double *row, int n, int x0, double *s);
+    void (*moments_f32)(const float *row, int n, int x0, double *s);
+
+    // Moments of pixels `p >= t` only, s[0..2] are the same as for moments_*,
+    // and s[3] = count, s[4] = sum(x), s[5] = sum(x^2) of those pixels.
+    // Moments of pixels with background `m` subtracted are then s[0] - m*s[3] and so on.
+    void (*moments_masked_u8)(const uint8_t *row, int n, int x0, int t, int64_t *s);
+    void (*moments_masked_u16)(const uint16_t *row, int n, int x0, int t, int64_t *s);
+    void (*moments_masked_i32)(const int32_t *row, int n, int x0, int t, int64_t *s);
+
+    // Pixel sums s[0] = sum(p), s[1] = sum(p^2).
+    void (*stats_u8)(const uint8_t *row, int n, int64_t *s);
+    void (*stats_u16)(const uint16_t *row, int n, int64_t *s);
+
+    // Brightness of a row: update `peak` with the max sum of consecutive 8-pixel groups,
+    // the last shorter group is scaled to 8 pixels, and add the number of pixels `p >= top` to `sat`.
+    void (*bright_u8)(const uint8_t *row, int n, int top, int *peak, int64_t *sat);
+    void (*bright_u16)(const uint16_t *row, int n, int top, int *peak, int64_t *sat);
+
+    // Copy pixels to doubles.
+    void (*copy_u8)(const uint8_t *row, int n, double *dst);
+    void (*copy_u16)(const uint16_t *row, int n, double *dst);
+
+    // Copy pixels to compact types of the subtracted image.
+    void (*copy_u8_f32)(const uint8_t *row, int n, float *dst);
+    void (*copy_u16_f32)(const uint16_t *row, int n, float *dst);
+    void (*copy_u8_i32)(const uint8_t *row, int n, int32_t *dst);
+    void (*copy_u16_i32)(const uint16_t *row, int n, int32_t *dst);
+
+    // Add pixels to int32 values, sums of rows of downsampling blocks.
+    void (*add_u8_i32)(const uint8_t *row, int n, int32_t *dst);
+    void (*add_u16_i32)(const uint16_t *row, int n, int32_t *dst);
+
+    // Write `n` sums of adjacent pairs `src[2j] + src[2j+1]`, `dst` may be the same as `src`.
+    void (*pairs_i32)(const int32_t *src, int n, int32_t *dst);
+
+    // Write `p-m` when `p > th` and 0 otherwise, update min and max of written values.
+    // Return the number of pixels above the threshold.
+    int (*subtract_u8)(const uint8_t *row, int n, double th, double m, double *dst, double *min, double *max);
+    int (*subtract_u16)(const uint16_t *row, int n, double th, double m, double *dst, double *min, double *max);
+
+    // The same with floats written, min and max are of values before rounding to float.
+    int (*subtract_u8_f32)(const uint8_t *row, int n, double th, double m, float *dst, double *min, double *max);
+    int (*subtract_u16_f32)(const uint16_t *row, int n, double th, double m, float *dst, double *min, double *max);
+
+    // Write `p` when `p >= t` and 0 otherwise, update min and max of written values.
+    // Return the number of pixels above the threshold.
+    int (*threshold_u8_i32)(const uint8_t *row, int n, int t, int32_t *dst, int32_t *min, int32_t *max);
+    int (*threshold_u16_i32)(const uint16_t *row, int n, int t, int32_t *dst, int32_t *min, int32_t *max);
+
+    // Unpack `n` pixels of IDS packed formats into 16-bit ones,
+    // `n` must be a multiple of the number of pixels in a group (4 and 2).
+    void (*unpack_10g40)(const uint8_t *src, int n, uint16_t *dst);
+    void (*unpack_12g24)(const uint8_t *src, int n, uint16_t *dst);
+
+    // Write corrected pixels, `dst` may be the same as `row`.
+    void (*correct_u8)(const uint8_t *row, const CgnRowDark *k, int n, uint8_t *dst);
+    void (*correct_u16)(const uint16_t *row, const CgnRowDark *k, int n, uint16_t *dst);
+
+    // The same as moments_masked_* for corrected pixels, `t` is the threshold of corrected values.
+    void (*moments_masked_dark_u8)(const uint8_t *row, const CgnRowDark *k, int n, int x0, int t, int64_t *s);
+    void (*moments_masked_dark_u16)(const uint16_t *row, const CgnRowDark *k, int n, int x0, int t, int64_t *s);
+} CgnBeamKernels;
+
+// Kernels of the best instruction set supported by CPU.
+// They are selected at program startup, see cgn_select_kernels().
+extern CgnBeamKernels cgn_kernels;
+
+// Forces a particular instruction set, mostly for benchmarking.
+// Returns the actually selected level, which can be lower
+// than requested one if CPU does not support it.
+// Pass CGN_SIMD_COUNT to select the best supported level.
+int cgn_select_kernels(int level);
+
+const char* cgn_simd_name(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CIGNUS_BEAM_CALC_INT_H_
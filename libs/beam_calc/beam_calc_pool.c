@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+
+#include "beam_calc.h"
+#include "beam_calc_int.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+struct CgnBeamPool {
+    int threads;
+    int first_cpu;
+    int started;
+    pthread_t *workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+
+    // Current job, changed under the lock only
+    CgnPoolTask task;
+    void *ctx;
+    int count;
+    unsigned gen;
+    int busy;
+    int quit;
+
+    // Index of the next task to take
+    int next;
+};
+
+// Pinning is best effort, the thread just stays unpinned when the core does not exist.
+static void cgn_pin_thread(int cpu) {
+#ifdef _WIN32
+    if (cpu < (int)sizeof(DWORD_PTR)*8)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#else
+    if (cpu < CPU_SETSIZE) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+}
+
+static void cgn_pool_work(CgnBeamPool *pool) {
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+        pool->task(pool->ctx, i);
+}
+
+static void* cgn_pool_worker(void *arg) {
+    CgnBeamPool *pool = arg;
+    const int index = __atomic_fetch_add(&pool->started, 1, __ATOMIC_RELAXED);
+    if (pool->first_cpu >= 0)
+        cgn_pin_thread(pool->first_cpu + index);
+
+    // The pool is created with gen 0, so a job posted
+    // before the worker gets here is not missed
+    unsigned gen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->gen == gen && !pool->quit)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        gen = pool->gen;
+        pthread_mutex_unlock(&pool->lock);
+
+        cgn_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+CgnBeamPool* cgn_pool_create(int threads, int first_cpu) {
+    if (threads < 1)
+        return NULL;
+    CgnBeamPool *pool = calloc(1, sizeof(CgnBeamPool));
+    if (!pool)
+        return NULL;
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->first_cpu = first_cpu;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, cgn_pool_worker, pool) != 0)
+            break;
+        pool->threads++;
+    }
+    if (pool->threads < threads) {
+        cgn_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void cgn_pool_free(CgnBeamPool *pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads; i++)
+        pthread_join(pool->workers[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+int cgn_pool_threads(const CgnBeamPool *pool) {
+    return pool ? pool->threads : 1;
+}
+
+void cgn_pool_run(CgnBeamPool *pool, CgnPoolTask task, void *ctx, int count) {
+    if (!pool || count < 2) {
+        for (int i = 0; i < count; i++)
+            task(ctx, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->next = 0;
+    pool->busy = pool->threads;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
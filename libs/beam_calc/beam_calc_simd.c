@@ -0,0 +1,1322 @@
+#include "beam_calc_int.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CGN_X86
+#include <immintrin.h>
+#endif
+
+#define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+CgnBeamKernels cgn_kernels;
+
+//------------------------------------------------------------------------------
+//                              Scalar kernels
+//------------------------------------------------------------------------------
+// They are used as is when no SIMD is available
+// and also for processing tails of rows in SIMD kernels.
+
+#define cgn_moments_scalar(acc_t)                      \
+    acc_t s0 = 0, s1 = 0, s2 = 0;                       \
+    for (int j = 0; j < n; j++) {                       \
+        const acc_t v = row[j];                         \
+        const acc_t x = x0 + j;                         \
+        s0 += v;                                        \
+        s1 += v * x;                                    \
+        s2 += v * x * x;                                \
+    }                                                   \
+    s[0] += s0;                                         \
+    s[1] += s1;                                         \
+    s[2] += s2;
+
+static void moments_u8_scalar(const uint8_t *row, int n, int x0, int64_t *s) {
+    cgn_moments_scalar(int64_t)
+}
+
+static void moments_u16_scalar(const uint16_t *row, int n, int x0, int64_t *s) {
+    cgn_moments_scalar(int64_t)
+}
+
+static void moments_f64_scalar(const double *row, int n, int x0, double *s) {
+    cgn_moments_scalar(double)
+}
+
+static void moments_f32_scalar(const float *row, int n, int x0, double *s) {
+    cgn_moments_scalar(double)
+}
+
+#define cgn_moments_masked_scalar(pixel)                \
+    int64_t s0 = 0, s1 = 0, s2 = 0, c0 = 0, c1 = 0, c2 = 0; \
+    for (int j = 0; j < n; j++) {                       \
+        const int64_t v = pixel;                        \
+        if (v >= t) {                                   \
+            const int64_t x = x0 + j;                   \
+            s0 += v;                                    \
+            s1 += v * x;                                \
+            s2 += v * x * x;                            \
+            c0++;                                       \
+            c1 += x;                                    \
+            c2 += x * x;                                \
+        }                                               \
+    }                                                   \
+    s[0] += s0;                                         \
+    s[1] += s1;                                         \
+    s[2] += s2;                                         \
+    s[3] += c0;                                         \
+    s[4] += c1;                                         \
+    s[5] += c2;
+
+static void moments_masked_u8_scalar(const uint8_t *row, int n, int x0, int t, int64_t *s) {
+    cgn_moments_masked_scalar(row[j])
+}
+
+static void moments_masked_u16_scalar(const uint16_t *row, int n, int x0, int t, int64_t *s) {
+    cgn_moments_masked_scalar(row[j])
+}
+
+static void moments_masked_i32_scalar(const int32_t *row, int n, int x0, int t, int64_t *s) {
+    cgn_moments_masked_scalar(row[j])
+}
+
+#define cgn_stats_scalar                \
+    int64_t s0 = 0, s1 = 0;             \
+    for (int j = 0; j < n; j++) {       \
+        const int64_t v = row[j];       \
+        s0 += v;                        \
+        s1 += v * v;                    \
+    }                                   \
+    s[0] += s0;                         \
+    s[1] += s1;
+
+static void stats_u8_scalar(const uint8_t *row, int n, int64_t *s) {
+    cgn_stats_scalar
+}
+
+static void stats_u16_scalar(const uint16_t *row, int n, int64_t *s) {
+    cgn_stats_scalar
+}
+
+// The last group shorter than 8 pixels is scaled up to 8 pixels by its own size
+#define cgn_bright_scalar                               \
+    int pk = *peak, count = 0, j = 0;                   \
+    for (; j < n; j += 8) {                             \
+        const int g = min(8, n - j);                    \
+        int b = 0;                                      \
+        for (int k = j; k < j + g; k++) {               \
+            b += row[k];                                \
+            count += row[k] >= top;                     \
+        }                                               \
+        pk = max(pk, g == 8 ? b : b * 8 / g);           \
+    }                                                   \
+    *peak = pk;                                         \
+    *sat += count;
+
+static void bright_u8_scalar(const uint8_t *row, int n, int top, int *peak, int64_t *sat) {
+    cgn_bright_scalar
+}
+
+static void bright_u16_scalar(const uint16_t *row, int n, int top, int *peak, int64_t *sat) {
+    cgn_bright_scalar
+}
+
+static void copy_u8_scalar(const uint8_t *row, int n, double *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void copy_u16_scalar(const uint16_t *row, int n, double *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void copy_u8_f32_scalar(const uint8_t *row, int n, float *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void copy_u16_f32_scalar(const uint16_t *row, int n, float *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void copy_u8_i32_scalar(const uint8_t *row, int n, int32_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void copy_u16_i32_scalar(const uint16_t *row, int n, int32_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] = row[j];
+}
+
+static void add_u8_i32_scalar(const uint8_t *row, int n, int32_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] += row[j];
+}
+
+static void add_u16_i32_scalar(const uint16_t *row, int n, int32_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] += row[j];
+}
+
+static void pairs_i32_scalar(const int32_t *src, int n, int32_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] = src[2*j] + src[2*j+1];
+}
+
+
+#define cgn_subtract_scalar                     \
+    int count = 0;                              \
+    double lo = *min, hi = *max;                \
+    for (int j = 0; j < n; j++) {               \
+        double v = 0;                           \
+        if (row[j] > th) {                      \
+            count++;                            \
+            v = row[j] - m;                     \
+        }                                       \
+        dst[j] = v;                             \
+        if (v > hi) hi = v;                     \
+        if (v < lo) lo = v;                     \
+    }                                           \
+    *min = lo;                                  \
+    *max = hi;                                  \
+    return count;
+
+static int subtract_u8_scalar(const uint8_t *row, int n, double th, double m, double *dst, double *min, double *max) {
+    cgn_subtract_scalar
+}
+
+static int subtract_u16_scalar(const uint16_t *row, int n, double th, double m, double *dst, double *min, double *max) {
+    cgn_subtract_scalar
+}
+
+static int subtract_u8_f32_scalar(const uint8_t *row, int n, double th, double m, float *dst, double *min, double *max) {
+    cgn_subtract_scalar
+}
+
+static int subtract_u16_f32_scalar(const uint16_t *row, int n, double th, double m, float *dst, double *min, double *max) {
+    cgn_subtract_scalar
+}
+
+#define cgn_threshold_scalar                    \
+    int count = 0;                              \
+    int32_t lo = *min, hi = *max;               \
+    for (int j = 0; j < n; j++) {               \
+        int32_t v = 0;                          \
+        if (row[j] >= t) {                      \
+            count++;                            \
+            v = row[j];                         \
+        }                                       \
+        dst[j] = v;                             \
+        if (v > hi) hi = v;                     \
+        if (v < lo) lo = v;                     \
+    }                                           \
+    *min = lo;                                  \
+    *max = hi;                                  \
+    return count;
+
+static int threshold_u8_i32_scalar(const uint8_t *row, int n, int t, int32_t *dst, int32_t *min, int32_t *max) {
+    cgn_threshold_scalar
+}
+
+static int threshold_u16_i32_scalar(const uint16_t *row, int n, int t, int32_t *dst, int32_t *min, int32_t *max) {
+    cgn_threshold_scalar
+}
+
+static void unpack_10g40_scalar(const uint8_t *src, int n, uint16_t *dst) {
+    for (int j = 0; j < n; j += 4, src += 5) {
+        dst[j+0] = (src[0] << 2) | ((src[4] >> 0) & 3);
+        dst[j+1] = (src[1] << 2) | ((src[4] >> 2) & 3);
+        dst[j+2] = (src[2] << 2) | ((src[4] >> 4) & 3);
+        dst[j+3] = (src[3] << 2) | ((src[4] >> 6) & 3);
+    }
+}
+
+static void unpack_12g24_scalar(const uint8_t *src, int n, uint16_t *dst) {
+    for (int j = 0; j < n; j += 2, src += 3) {
+        dst[j+0] = (src[0] << 4) | (src[2] & 0x0F);
+        dst[j+1] = (src[1] << 4) | (src[2] >> 4);
+    }
+}
+
+// Gains are rounded to nearest even the same way as vector conversions do
+static inline int cgn_dark_pixel(int p, const CgnRowDark *k, int j) {
+    int v = p - k->d[j];
+    if (k->g) v = lrintf(v * k->g[j]);
+    v += k->level;
+    return v < 0 ? 0 : (v > k->maxv ? k->maxv : v);
+}
+
+// Correction of the rest of the row starting from pixel `j`
+static inline CgnRowDark cgn_dark_tail(const CgnRowDark *k, int j) {
+    const CgnRowDark t = {k->d + j, k->g ? k->g + j : NULL, k->level, k->maxv};
+    return t;
+}
+
+static void correct_u8_scalar(const uint8_t *row, const CgnRowDark *k, int n, uint8_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] = cgn_dark_pixel(row[j], k, j);
+}
+
+static void correct_u16_scalar(const uint16_t *row, const CgnRowDark *k, int n, uint16_t *dst) {
+    for (int j = 0; j < n; j++) dst[j] = cgn_dark_pixel(row[j], k, j);
+}
+
+static void moments_masked_dark_u8_scalar(const uint8_t *row, const CgnRowDark *k, int n, int x0, int t, int64_t *s) {
+    cgn_moments_masked_scalar(cgn_dark_pixel(row[j], k, j))
+}
+
+static void moments_masked_dark_u16_scalar(const uint16_t *row, const CgnRowDark *k, int n, int x0, int t, int64_t *s) {
+    cgn_moments_masked_scalar(cgn_dark_pixel(row[j], k, j))
+}
+
+#ifdef CGN_X86
+
+//------------------------------------------------------------------------------
+//                          Generic SIMD kernels
+//------------------------------------------------------------------------------
+// Kernel bodies are written in terms of a small vocabulary of macros
+// which is defined separately for each instruction set below:
+//
+// VI, VD               - integer and double vector types
+// ILANES, DLANES       - number of int32 and double lanes
+// LOAD_U8, LOAD_U16    - load ILANES pixels and widen them to int32
+// LOAD_I32             - load ILANES int32 values
+// I_*                  - int32/int64 operations, I_CMPGT32 gives all-ones lanes
+// D_*                  - double operations
+// D_LOAD_F32           - load DLANES floats and convert them to doubles
+// D_STORE_F32          - convert DLANES doubles to floats and store them
+// I_LO_PD, I_HI_PD     - convert lower and upper halves of int32 vector to doubles
+// I_PS, F_STORE        - convert int32 vector to floats and store them
+// F_LOAD, F_MUL        - load and multiply ILANES floats
+// F_ROUND              - convert floats to int32 rounding to nearest
+// STORE_U8, STORE_U16  - narrow int32 values already clamped to the range and store them
+// D_SUBTRACT           - masked subtraction with counting of set lanes
+// I_PAIRS              - sums of adjacent pairs of lanes of two vectors, in order
+// I_SHUFFLE8           - byte shuffle inside of each 128-bit lane
+// I_BCAST128           - repeat 128-bit vector in all lanes
+// LOAD_10G40           - load 2 pixel groups of 10g40 into the start of each 128-bit lane
+// LOAD_12G24           - load 4 pixel groups of 12g24 into the start of each 128-bit lane
+// READ_10G40/12G24     - number of bytes touched by these loads
+
+static inline uint32_t cgn_load_u32(const void *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void cgn_store_u32(void *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline int64_t cgn_hsum_i32(const int32_t *v, int n) {
+    int64_t s = 0;
+    for (int i = 0; i < n; i++) s += v[i];
+    return s;
+}
+
+static inline int64_t cgn_hsum_i64(const int64_t *v, int n) {
+    int64_t s = 0;
+    for (int i = 0; i < n; i++) s += v[i];
+    return s;
+}
+
+static inline double cgn_hsum_f64(const double *v, int n) {
+    double s = 0;
+    for (int i = 0; i < n; i++) s += v[i];
+    return s;
+}
+
+// Products p*x fit into int32, but p*x^2 does not,
+// so the second product is taken with widening to int64 for even and odd lanes separately.
+#define cgn_moments_simd(type, load)                                    \
+static void moments_##type##_simd(const type##_t *row, int n, int x0, int64_t *s) { \
+    VI s0 = I_ZERO, s1e = I_ZERO, s1o = I_ZERO, s2e = I_ZERO, s2o = I_ZERO; \
+    VI x = I_ADD32(I_SET1(x0), I_IDX);                                  \
+    const VI dx = I_SET1(ILANES);                                       \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI v = load(row + j);                                     \
+        const VI vx = I_MULLO32(v, x);                                  \
+        const VI xo = I_SRL64(x);                                       \
+        s0 = I_ADD32(s0, v);                                            \
+        s1e = I_ADD64(s1e, I_MUL32(v, x));                              \
+        s1o = I_ADD64(s1o, I_MUL32(I_SRL64(v), xo));                    \
+        s2e = I_ADD64(s2e, I_MUL32(vx, x));                             \
+        s2o = I_ADD64(s2o, I_MUL32(I_SRL64(vx), xo));                   \
+        x = I_ADD32(x, dx);                                             \
+    }                                                                   \
+    int32_t t32[ILANES];                                                \
+    int64_t t64[ILANES];                                                \
+    I_STORE(t32, s0);                                                   \
+    s[0] += cgn_hsum_i32(t32, ILANES);                                  \
+    I_STORE(t64, I_ADD64(s1e, s1o));                                    \
+    s[1] += cgn_hsum_i64(t64, ILANES/2);                                \
+    I_STORE(t64, I_ADD64(s2e, s2o));                                    \
+    s[2] += cgn_hsum_i64(t64, ILANES/2);                                \
+    moments_##type##_scalar(row + j, n - j, x0 + j, s);                 \
+}
+
+// The same products for pixels above the threshold, plus sums of their coordinates.
+// Sums of x fit into int32 for rows shorter than 65536, but x^2 are widened like p*x^2.
+// The loop continues from `j` and leaves it at the tail, `pixels` loads a vector at `j`.
+#define cgn_moments_masked_loop(pixels)                                 \
+{                                                                       \
+    VI s0 = I_ZERO, s1e = I_ZERO, s1o = I_ZERO, s2e = I_ZERO, s2o = I_ZERO; \
+    VI c0 = I_ZERO, c1 = I_ZERO, c2e = I_ZERO, c2o = I_ZERO;            \
+    VI x = I_ADD32(I_SET1(x0), I_IDX);                                  \
+    const VI dx = I_SET1(ILANES);                                       \
+    const VI tv = I_SET1(t - 1);                                        \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI p = pixels;                                            \
+        const VI mask = I_CMPGT32(p, tv);                               \
+        const VI v = I_AND(p, mask);                                    \
+        const VI xm = I_AND(x, mask);                                   \
+        const VI vx = I_MULLO32(v, x);                                  \
+        const VI xo = I_SRL64(x);                                       \
+        s0 = I_ADD32(s0, v);                                            \
+        s1e = I_ADD64(s1e, I_MUL32(v, x));                              \
+        s1o = I_ADD64(s1o, I_MUL32(I_SRL64(v), xo));                    \
+        s2e = I_ADD64(s2e, I_MUL32(vx, x));                             \
+        s2o = I_ADD64(s2o, I_MUL32(I_SRL64(vx), xo));                   \
+        c0 = I_SUB32(c0, mask);                                         \
+        c1 = I_ADD32(c1, xm);                                           \
+        c2e = I_ADD64(c2e, I_MUL32(xm, x));                             \
+        c2o = I_ADD64(c2o, I_MUL32(I_SRL64(xm), xo));                   \
+        x = I_ADD32(x, dx);                                             \
+    }                                                                   \
+    int32_t t32[ILANES];                                                \
+    int64_t t64[ILANES];                                                \
+    I_STORE(t32, s0);                                                   \
+    s[0] += cgn_hsum_i32(t32, ILANES);                                  \
+    I_STORE(t64, I_ADD64(s1e, s1o));                                    \
+    s[1] += cgn_hsum_i64(t64, ILANES/2);                                \
+    I_STORE(t64, I_ADD64(s2e, s2o));                                    \
+    s[2] += cgn_hsum_i64(t64, ILANES/2);                                \
+    I_STORE(t32, c0);                                                   \
+    s[3] += cgn_hsum_i32(t32, ILANES);                                  \
+    I_STORE(t32, c1);                                                   \
+    s[4] += cgn_hsum_i32(t32, ILANES);                                  \
+    I_STORE(t64, I_ADD64(c2e, c2o));                                    \
+    s[5] += cgn_hsum_i64(t64, ILANES/2);                                \
+}
+
+#define cgn_moments_masked_simd(type, load)                             \
+static void moments_masked_##type##_simd(const type##_t *row, int n, int x0, int t, int64_t *s) { \
+    int j = 0;                                                          \
+    cgn_moments_masked_loop(load(row + j))                              \
+    moments_masked_##type##_scalar(row + j, n - j, x0 + j, t, s);       \
+}
+
+// Pixels are not negative, so signed I_MUL32 gives exact p^2 even for 16-bit ones
+#define cgn_stats_simd(type, load)                                      \
+static void stats_##type##_simd(const type##_t *row, int n, int64_t *s) { \
+    VI s0 = I_ZERO, s1e = I_ZERO, s1o = I_ZERO;                         \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI v = load(row + j);                                     \
+        const VI vo = I_SRL64(v);                                       \
+        s0 = I_ADD32(s0, v);                                            \
+        s1e = I_ADD64(s1e, I_MUL32(v, v));                              \
+        s1o = I_ADD64(s1o, I_MUL32(vo, vo));                            \
+    }                                                                   \
+    int32_t t32[ILANES];                                                \
+    int64_t t64[ILANES];                                                \
+    I_STORE(t32, s0);                                                   \
+    s[0] += cgn_hsum_i32(t32, ILANES);                                  \
+    I_STORE(t64, I_ADD64(s1e, s1o));                                    \
+    s[1] += cgn_hsum_i64(t64, ILANES/2);                                \
+    stats_##type##_scalar(row + j, n - j, s);                           \
+}
+
+// Eight vectors of pixels are reduced by three levels of adjacent pairs
+// into one vector of sums of consecutive 8-pixel groups, in order.
+#define cgn_bright_simd(type, load)                                     \
+static void bright_##type##_simd(const type##_t *row, int n, int top, int *peak, int64_t *sat) { \
+    const VI tv = I_SET1(top - 1);                                      \
+    VI pk = I_SET1(*peak), count = I_ZERO;                              \
+    int j = 0;                                                          \
+    for (; j + 8*ILANES <= n; j += 8*ILANES) {                          \
+        VI v[8];                                                        \
+        for (int k = 0; k < 8; k++) {                                   \
+            v[k] = load(row + j + k*ILANES);                            \
+            count = I_SUB32(count, I_CMPGT32(v[k], tv));                \
+        }                                                               \
+        const VI q0 = I_PAIRS(I_PAIRS(v[0], v[1]), I_PAIRS(v[2], v[3])); \
+        const VI q1 = I_PAIRS(I_PAIRS(v[4], v[5]), I_PAIRS(v[6], v[7])); \
+        pk = I_MAX32(pk, I_PAIRS(q0, q1));                              \
+    }                                                                   \
+    int32_t tmp[ILANES];                                                \
+    I_STORE(tmp, pk);                                                   \
+    for (int k = 0; k < ILANES; k++) *peak = max(*peak, tmp[k]);        \
+    I_STORE(tmp, count);                                                \
+    *sat += cgn_hsum_i32(tmp, ILANES);                                  \
+    bright_##type##_scalar(row + j, n - j, top, peak, sat);             \
+}
+
+#define cgn_moments_fp_simd(name, pix_t, load)                          \
+static void moments_##name##_simd(const pix_t *row, int n, int x0, double *s) { \
+    VD s0 = D_ZERO, s1 = D_ZERO, s2 = D_ZERO;                           \
+    VD x = D_ADD(D_SET1(x0), D_IDX);                                    \
+    const VD dx = D_SET1(DLANES);                                       \
+    int j = 0;                                                          \
+    for (; j + DLANES <= n; j += DLANES) {                              \
+        const VD v = load(row + j);                                     \
+        const VD vx = D_MUL(v, x);                                      \
+        s0 = D_ADD(s0, v);                                              \
+        s1 = D_ADD(s1, vx);                                             \
+        s2 = D_ADD(s2, D_MUL(vx, x));                                   \
+        x = D_ADD(x, dx);                                               \
+    }                                                                   \
+    double t[DLANES];                                                   \
+    D_STORE(t, s0);                                                     \
+    s[0] += cgn_hsum_f64(t, DLANES);                                    \
+    D_STORE(t, s1);                                                     \
+    s[1] += cgn_hsum_f64(t, DLANES);                                    \
+    D_STORE(t, s2);                                                     \
+    s[2] += cgn_hsum_f64(t, DLANES);                                    \
+    moments_##name##_scalar(row + j, n - j, x0 + j, s);                 \
+}
+
+#define cgn_copy_simd(type, load)                                       \
+static void copy_##type##_simd(const type##_t *row, int n, double *dst) { \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI v = load(row + j);                                     \
+        D_STORE(dst + j, I_LO_PD(v));                                   \
+        D_STORE(dst + j + DLANES, I_HI_PD(v));                          \
+    }                                                                   \
+    copy_##type##_scalar(row + j, n - j, dst + j);                      \
+}
+
+// Pixels are widened to int32 anyway, so they are stored as is or converted to floats
+#define cgn_copy_compact_simd(type, load)                               \
+static void copy_##type##_f32_simd(const type##_t *row, int n, float *dst) { \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES)                                \
+        F_STORE(dst + j, I_PS(load(row + j)));                          \
+    copy_##type##_f32_scalar(row + j, n - j, dst + j);                  \
+}                                                                       \
+static void copy_##type##_i32_simd(const type##_t *row, int n, int32_t *dst) { \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES)                                \
+        I_STORE(dst + j, load(row + j));                                \
+    copy_##type##_i32_scalar(row + j, n - j, dst + j);                  \
+}
+
+// Rows of pyramid blocks are summed vertically, then halved by pairs as many times as needed.
+// `pairs_i32` may work in place as it never writes ahead of what it has read.
+#define cgn_add_simd(type, load)                                        \
+static void add_##type##_i32_simd(const type##_t *row, int n, int32_t *dst) { \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES)                                \
+        I_STORE(dst + j, I_ADD32(LOAD_I32(dst + j), load(row + j)));    \
+    add_##type##_i32_scalar(row + j, n - j, dst + j);                   \
+}
+
+#define cgn_pairs_simd                                                  \
+static void pairs_i32_simd(const int32_t *src, int n, int32_t *dst) {   \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES)                                \
+        I_STORE(dst + j, I_PAIRS(LOAD_I32(src + 2*j), LOAD_I32(src + 2*j + ILANES))); \
+    pairs_i32_scalar(src + 2*j, n - j, dst + j);                        \
+}
+
+// `suffix` and `store` select the type of written values, doubles are converted to it
+#define cgn_subtract_simd(type, suffix, dst_t, load, store)             \
+static int subtract_##type##suffix##_simd(const type##_t *row, int n, double th, double m, dst_t *dst, double *min, double *max) { \
+    const VD thv = D_SET1(th);                                          \
+    const VD mv = D_SET1(m);                                            \
+    VD lo = D_SET1(*min), hi = D_SET1(*max);                            \
+    int count = 0;                                                      \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI v = load(row + j);                                     \
+        VD t;                                                           \
+        D_SUBTRACT(I_LO_PD(v), thv, mv, t, count);                      \
+        lo = D_MIN(lo, t);                                              \
+        hi = D_MAX(hi, t);                                              \
+        store(dst + j, t);                                              \
+        D_SUBTRACT(I_HI_PD(v), thv, mv, t, count);                      \
+        lo = D_MIN(lo, t);                                              \
+        hi = D_MAX(hi, t);                                              \
+        store(dst + j + DLANES, t);                                     \
+    }                                                                   \
+    double tmp[DLANES];                                                 \
+    D_STORE(tmp, lo);                                                   \
+    for (int k = 0; k < DLANES; k++) *min = min(*min, tmp[k]);          \
+    D_STORE(tmp, hi);                                                   \
+    for (int k = 0; k < DLANES; k++) *max = max(*max, tmp[k]);          \
+    return count + subtract_##type##suffix##_scalar(row + j, n - j, th, m, dst + j, min, max); \
+}
+
+#define cgn_threshold_simd(type, load)                                  \
+static int threshold_##type##_i32_simd(const type##_t *row, int n, int t, int32_t *dst, int32_t *min, int32_t *max) { \
+    const VI tv = I_SET1(t - 1);                                        \
+    VI lo = I_SET1(*min), hi = I_SET1(*max), count = I_ZERO;            \
+    int j = 0;                                                          \
+    for (; j + ILANES <= n; j += ILANES) {                              \
+        const VI p = load(row + j);                                     \
+        const VI mask = I_CMPGT32(p, tv);                               \
+        const VI v = I_AND(p, mask);                                    \
+        count = I_SUB32(count, mask);                                   \
+        lo = I_MIN32(lo, v);                                            \
+        hi = I_MAX32(hi, v);                                            \
+        I_STORE(dst + j, v);                                            \
+    }                                                                   \
+    int32_t tmp[ILANES];                                                \
+    I_STORE(tmp, lo);                                                   \
+    for (int k = 0; k < ILANES; k++) *min = min(*min, tmp[k]);          \
+    I_STORE(tmp, hi);                                                   \
+    for (int k = 0; k < ILANES; k++) *max = max(*max, tmp[k]);          \
+    I_STORE(tmp, count);                                                \
+    return cgn_hsum_i32(tmp, ILANES) + threshold_##type##_i32_scalar(row + j, n - j, t, dst + j, min, max); \
+}
+
+// Pixels corrected by the dark frame `d` and gains `g` at `j`, see CgnRowDark.
+// Gains are multiplied in floats, rows without them stay in integers.
+#define DARK_PIXELS(load, j)                                            \
+    I_MIN32(I_MAX32(I_ADD32(I_SUB32(load(row + j), LOAD_U16(d + j)), lv), I_ZERO), hv)
+#define DARK_GAIN_PIXELS(load, j)                                       \
+    I_MIN32(I_MAX32(I_ADD32(F_ROUND(F_MUL(I_PS(I_SUB32(load(row + j), LOAD_U16(d + j))), F_LOAD(g + j))), lv), I_ZERO), hv)
+
+// The gain check is hoisted out of loops.
+#define cgn_correct_simd(type, load, store)                             \
+static void correct_##type##_simd(const type##_t *row, const CgnRowDark *k, int n, type##_t *dst) { \
+    const uint16_t *d = k->d;                                           \
+    const float *g = k->g;                                              \
+    const VI lv = I_SET1(k->level);                                     \
+    const VI hv = I_SET1(k->maxv);                                      \
+    int j = 0;                                                          \
+    if (g) {                                                            \
+        for (; j + ILANES <= n; j += ILANES)                            \
+            store(dst + j, DARK_GAIN_PIXELS(load, j));                  \
+    } else {                                                            \
+        for (; j + ILANES <= n; j += ILANES)                            \
+            store(dst + j, DARK_PIXELS(load, j));                       \
+    }                                                                   \
+    const CgnRowDark tail = cgn_dark_tail(k, j);                        \
+    correct_##type##_scalar(row + j, &tail, n - j, dst + j);            \
+}
+
+// Pixels are corrected in registers right before thresholding, so mask iterations
+// over raw frames cost almost the same as without the dark frame.
+#define cgn_moments_masked_dark_simd(type, load)                        \
+static void moments_masked_dark_##type##_simd(const type##_t *row, const CgnRowDark *k, int n, int x0, int t, int64_t *s) { \
+    const uint16_t *d = k->d;                                           \
+    const float *g = k->g;                                              \
+    const VI lv = I_SET1(k->level);                                     \
+    const VI hv = I_SET1(k->maxv);                                      \
+    int j = 0;                                                          \
+    if (g) {                                                            \
+        cgn_moments_masked_loop(DARK_GAIN_PIXELS(load, j))              \
+    } else {                                                            \
+        cgn_moments_masked_loop(DARK_PIXELS(load, j))                   \
+    }                                                                   \
+    const CgnRowDark tail = cgn_dark_tail(k, j);                        \
+    moments_masked_dark_##type##_scalar(row + j, &tail, n - j, x0 + j, t, s); \
+}
+
+// Each 16-bit lane gets its high bits byte and the byte of low bits of its group,
+// then the low bits are moved into place by a per-lane multiplier.
+// Loads touch more bytes than they consume, so the last groups are left for the scalar tail.
+#define cgn_unpack_simd                                                 \
+static void unpack_10g40_simd(const uint8_t *src, int n, uint16_t *dst) { \
+    const VI hi = I_BCAST128(_mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1)); \
+    const VI lo = I_BCAST128(_mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1)); \
+    const VI mul = I_SET1_64(0x0001000400100040LL);                     \
+    const VI mask = I_SET1(0x00030003);                                 \
+    const int sz = n / 4 * 5;                                           \
+    int j = 0;                                                          \
+    for (; j / 4 * 5 + READ_10G40 <= sz; j += 2*ILANES) {               \
+        const VI v = LOAD_10G40(src + j / 4 * 5);                       \
+        const VI h = I_SLL16(I_SHUFFLE8(v, hi), 2);                     \
+        const VI l = I_AND(I_SRL16(I_MULLO16(I_SHUFFLE8(v, lo), mul), 6), mask); \
+        I_STORE(dst + j, I_OR(h, l));                                   \
+    }                                                                   \
+    unpack_10g40_scalar(src + j / 4 * 5, n - j, dst + j);               \
+}                                                                       \
+static void unpack_12g24_simd(const uint8_t *src, int n, uint16_t *dst) { \
+    const VI idx = I_BCAST128(_mm_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10)); \
+    /* Even lanes keep the low nibble of b2, odd lanes get it shifted */ \
+    const VI hi = I_SET1((int)0xFFFFFFF0);                              \
+    const VI lo = I_SET1(0x0000000F);                                   \
+    const int sz = n / 2 * 3;                                           \
+    int j = 0;                                                          \
+    for (; j / 2 * 3 + READ_12G24 <= sz; j += 2*ILANES) {               \
+        /* Lanes are (b0 << 8 | b2) and (b1 << 8 | b2) */               \
+        const VI v = I_SHUFFLE8(LOAD_12G24(src + j / 2 * 3), idx);      \
+        I_STORE(dst + j, I_OR(I_AND(I_SRL16(v, 4), hi), I_AND(v, lo))); \
+    }                                                                   \
+    unpack_12g24_scalar(src + j / 2 * 3, n - j, dst + j);               \
+}
+
+#define cgn_kernels_simd(isa)                                           \
+    cgn_moments_simd(uint8, LOAD_U8)                                    \
+    cgn_moments_simd(uint16, LOAD_U16)                                  \
+    cgn_moments_fp_simd(f64, double, D_LOAD)                            \
+    cgn_moments_fp_simd(f32, float, D_LOAD_F32)                         \
+    cgn_moments_masked_simd(uint8, LOAD_U8)                             \
+    cgn_moments_masked_simd(uint16, LOAD_U16)                           \
+    cgn_moments_masked_simd(int32, LOAD_I32)                            \
+    cgn_stats_simd(uint8, LOAD_U8)                                      \
+    cgn_stats_simd(uint16, LOAD_U16)                                    \
+    cgn_bright_simd(uint8, LOAD_U8)                                     \
+    cgn_bright_simd(uint16, LOAD_U16)                                   \
+    cgn_copy_simd(uint8, LOAD_U8)                                       \
+    cgn_copy_simd(uint16, LOAD_U16)                                     \
+    cgn_copy_compact_simd(uint8, LOAD_U8)                               \
+    cgn_copy_compact_simd(uint16, LOAD_U16)                             \
+    cgn_add_simd(uint8, LOAD_U8)                                        \
+    cgn_add_simd(uint16, LOAD_U16)                                      \
+    cgn_pairs_simd                                                      \
+    cgn_subtract_simd(uint8, , double, LOAD_U8, D_STORE)                \
+    cgn_subtract_simd(uint16, , double, LOAD_U16, D_STORE)              \
+    cgn_subtract_simd(uint8, _f32, float, LOAD_U8, D_STORE_F32)         \
+    cgn_subtract_simd(uint16, _f32, float, LOAD_U16, D_STORE_F32)       \
+    cgn_threshold_simd(uint8, LOAD_U8)                                  \
+    cgn_threshold_simd(uint16, LOAD_U16)                                \
+    cgn_correct_simd(uint8, LOAD_U8, STORE_U8)                          \
+    cgn_correct_simd(uint16, LOAD_U16, STORE_U16)                       \
+    cgn_moments_masked_dark_simd(uint8, LOAD_U8)                        \
+    cgn_moments_masked_dark_simd(uint16, LOAD_U16)                      \
+    cgn_unpack_simd                                                     \
+    static void cgn_init_kernels_##isa(CgnBeamKernels *k) {             \
+        k->moments_u8 = moments_uint8_simd;                             \
+        k->moments_u16 = moments_uint16_simd;                           \
+        k->moments_f64 = moments_f64_simd;                              \
+        k->moments_f32 = moments_f32_simd;                              \
+        k->moments_masked_u8 = moments_masked_uint8_simd;               \
+        k->moments_masked_u16 = moments_masked_uint16_simd;             \
+        k->moments_masked_i32 = moments_masked_int32_simd;              \
+        k->stats_u8 = stats_uint8_simd;                                 \
+        k->stats_u16 = stats_uint16_simd;                               \
+        k->bright_u8 = bright_uint8_simd;                               \
+        k->bright_u16 = bright_uint16_simd;                             \
+        k->copy_u8 = copy_uint8_simd;                                   \
+        k->copy_u16 = copy_uint16_simd;                                 \
+        k->copy_u8_f32 = copy_uint8_f32_simd;                           \
+        k->copy_u16_f32 = copy_uint16_f32_simd;                         \
+        k->copy_u8_i32 = copy_uint8_i32_simd;                           \
+        k->copy_u16_i32 = copy_uint16_i32_simd;                         \
+        k->add_u8_i32 = add_uint8_i32_simd;                             \
+        k->add_u16_i32 = add_uint16_i32_simd;                           \
+        k->pairs_i32 = pairs_i32_simd;                                  \
+        k->subtract_u8 = subtract_uint8_simd;                           \
+        k->subtract_u16 = subtract_uint16_simd;                         \
+        k->subtract_u8_f32 = subtract_uint8_f32_simd;                   \
+        k->subtract_u16_f32 = subtract_uint16_f32_simd;                 \
+        k->threshold_u8_i32 = threshold_uint8_i32_simd;                 \
+        k->threshold_u16_i32 = threshold_uint16_i32_simd;               \
+        k->unpack_10g40 = unpack_10g40_simd;                            \
+        k->unpack_12g24 = unpack_12g24_simd;                            \
+        k->correct_u8 = correct_uint8_simd;                             \
+        k->correct_u16 = correct_uint16_simd;                           \
+        k->moments_masked_dark_u8 = moments_masked_dark_uint8_simd;     \
+        k->moments_masked_dark_u16 = moments_masked_dark_uint16_simd;   \
+    }
+
+// Scalar kernels are called by generic ones with the `uint8`/`uint16` names
+#define moments_uint8_scalar moments_u8_scalar
+#define moments_uint16_scalar moments_u16_scalar
+#define moments_masked_uint8_scalar moments_masked_u8_scalar
+#define moments_masked_uint16_scalar moments_masked_u16_scalar
+#define moments_masked_int32_scalar moments_masked_i32_scalar
+#define stats_uint8_scalar stats_u8_scalar
+#define stats_uint16_scalar stats_u16_scalar
+#define bright_uint8_scalar bright_u8_scalar
+#define bright_uint16_scalar bright_u16_scalar
+#define copy_uint8_scalar copy_u8_scalar
+#define copy_uint16_scalar copy_u16_scalar
+#define copy_uint8_f32_scalar copy_u8_f32_scalar
+#define copy_uint16_f32_scalar copy_u16_f32_scalar
+#define copy_uint8_i32_scalar copy_u8_i32_scalar
+#define copy_uint16_i32_scalar copy_u16_i32_scalar
+#define add_uint8_i32_scalar add_u8_i32_scalar
+#define add_uint16_i32_scalar add_u16_i32_scalar
+#define subtract_uint8_scalar subtract_u8_scalar
+#define subtract_uint16_scalar subtract_u16_scalar
+#define subtract_uint8_f32_scalar subtract_u8_f32_scalar
+#define subtract_uint16_f32_scalar subtract_u16_f32_scalar
+#define threshold_uint8_i32_scalar threshold_u8_i32_scalar
+#define threshold_uint16_i32_scalar threshold_u16_i32_scalar
+#define correct_uint8_scalar correct_u8_scalar
+#define correct_uint16_scalar correct_u16_scalar
+#define moments_masked_dark_uint8_scalar moments_masked_dark_u8_scalar
+#define moments_masked_dark_uint16_scalar moments_masked_dark_u16_scalar
+
+//------------------------------------------------------------------------------
+//                                 SSE4.2
+//------------------------------------------------------------------------------
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+
+#define VI __m128i
+#define VD __m128d
+#define ILANES 4
+#define DLANES 2
+#define LOAD_U8(p) _mm_cvtepu8_epi32(_mm_cvtsi32_si128(cgn_load_u32(p)))
+#define LOAD_U16(p) _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(p)))
+#define LOAD_I32(p) _mm_loadu_si128((const __m128i*)(p))
+#define I_ZERO _mm_setzero_si128()
+#define I_SET1(a) _mm_set1_epi32(a)
+#define I_IDX _mm_setr_epi32(0, 1, 2, 3)
+#define I_ADD32 _mm_add_epi32
+#define I_ADD64 _mm_add_epi64
+#define I_SUB32 _mm_sub_epi32
+#define I_AND _mm_and_si128
+#define I_CMPGT32 _mm_cmpgt_epi32
+#define I_MIN32 _mm_min_epi32
+#define I_MAX32 _mm_max_epi32
+#define I_MULLO32 _mm_mullo_epi32
+#define I_MUL32 _mm_mul_epi32
+#define I_SRL64(a) _mm_srli_epi64(a, 32)
+#define I_STORE(p, a) _mm_storeu_si128((__m128i*)(p), a)
+#define I_LO_PD(a) _mm_cvtepi32_pd(a)
+#define I_HI_PD(a) _mm_cvtepi32_pd(_mm_srli_si128(a, 8))
+#define I_PS _mm_cvtepi32_ps
+#define I_OR _mm_or_si128
+#define I_SET1_64 _mm_set1_epi64x
+#define I_SLL16 _mm_slli_epi16
+#define I_SRL16 _mm_srli_epi16
+#define I_MULLO16 _mm_mullo_epi16
+#define I_PAIRS _mm_hadd_epi32
+#define I_SHUFFLE8 _mm_shuffle_epi8
+#define I_BCAST128(a) (a)
+#define LOAD_10G40(p) _mm_loadu_si128((const __m128i*)(p))
+#define LOAD_12G24(p) _mm_loadu_si128((const __m128i*)(p))
+#define READ_10G40 16
+#define READ_12G24 16
+#define F_STORE _mm_storeu_ps
+#define F_LOAD _mm_loadu_ps
+#define F_MUL _mm_mul_ps
+#define F_ROUND _mm_cvtps_epi32
+#define STORE_U8(p, a) cgn_store_u32(p, _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(a, a), a)))
+#define STORE_U16(p, a) _mm_storel_epi64((__m128i*)(p), _mm_packus_epi32(a, a))
+#define D_ZERO _mm_setzero_pd()
+#define D_SET1 _mm_set1_pd
+#define D_IDX _mm_setr_pd(0, 1)
+#define D_LOAD _mm_loadu_pd
+#define D_STORE _mm_storeu_pd
+#define D_LOAD_F32(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p))))
+#define D_STORE_F32(p, a) _mm_storel_pi((__m64*)(p), _mm_cvtpd_ps(a))
+#define D_ADD _mm_add_pd
+#define D_SUB _mm_sub_pd
+#define D_MUL _mm_mul_pd
+#define D_MIN _mm_min_pd
+#define D_MAX _mm_max_pd
+#define D_SUBTRACT(v, th, m, t, count) {                                \
+    const VD mask = _mm_cmpgt_pd(v, th);                                \
+    t = _mm_and_pd(mask, _mm_sub_pd(v, m));                             \
+    count += __builtin_popcount(_mm_movemask_pd(mask));                 \
+}
+
+#define moments_uint8_simd moments_u8_sse42
+#define moments_uint16_simd moments_u16_sse42
+#define moments_f64_simd moments_f64_sse42
+#define moments_masked_uint8_simd moments_masked_u8_sse42
+#define moments_masked_uint16_simd moments_masked_u16_sse42
+#define stats_uint8_simd stats_u8_sse42
+#define stats_uint16_simd stats_u16_sse42
+#define bright_uint8_simd bright_u8_sse42
+#define bright_uint16_simd bright_u16_sse42
+#define copy_uint8_simd copy_u8_sse42
+#define copy_uint16_simd copy_u16_sse42
+#define subtract_uint8_simd subtract_u8_sse42
+#define subtract_uint16_simd subtract_u16_sse42
+#define moments_f32_simd moments_f32_sse42
+#define moments_masked_int32_simd moments_masked_i32_sse42
+#define copy_uint8_f32_simd copy_u8_f32_sse42
+#define copy_uint16_f32_simd copy_u16_f32_sse42
+#define copy_uint8_i32_simd copy_u8_i32_sse42
+#define copy_uint16_i32_simd copy_u16_i32_sse42
+#define add_uint8_i32_simd add_u8_i32_sse42
+#define add_uint16_i32_simd add_u16_i32_sse42
+#define pairs_i32_simd pairs_i32_sse42
+#define subtract_uint8_f32_simd subtract_u8_f32_sse42
+#define subtract_uint16_f32_simd subtract_u16_f32_sse42
+#define threshold_uint8_i32_simd threshold_u8_i32_sse42
+#define threshold_uint16_i32_simd threshold_u16_i32_sse42
+#define unpack_10g40_simd unpack_10g40_sse42
+#define unpack_12g24_simd unpack_12g24_sse42
+#define correct_uint8_simd correct_u8_sse42
+#define correct_uint16_simd correct_u16_sse42
+#define moments_masked_dark_uint8_simd moments_masked_dark_u8_sse42
+#define moments_masked_dark_uint16_simd moments_masked_dark_u16_sse42
+
+cgn_kernels_simd(sse42)
+
+#undef VI
+#undef VD
+#undef ILANES
+#undef DLANES
+#undef LOAD_U8
+#undef LOAD_U16
+#undef LOAD_I32
+#undef I_ZERO
+#undef I_SET1
+#undef I_IDX
+#undef I_ADD32
+#undef I_ADD64
+#undef I_SUB32
+#undef I_AND
+#undef I_CMPGT32
+#undef I_MIN32
+#undef I_MAX32
+#undef I_MULLO32
+#undef I_MUL32
+#undef I_SRL64
+#undef I_STORE
+#undef I_LO_PD
+#undef I_HI_PD
+#undef I_PS
+#undef I_OR
+#undef I_SET1_64
+#undef I_SLL16
+#undef I_SRL16
+#undef I_MULLO16
+#undef I_PAIRS
+#undef I_SHUFFLE8
+#undef I_BCAST128
+#undef LOAD_10G40
+#undef LOAD_12G24
+#undef READ_10G40
+#undef READ_12G24
+#undef F_STORE
+#undef F_LOAD
+#undef F_MUL
+#undef F_ROUND
+#undef STORE_U8
+#undef STORE_U16
+#undef D_ZERO
+#undef D_SET1
+#undef D_IDX
+#undef D_LOAD
+#undef D_STORE
+#undef D_LOAD_F32
+#undef D_STORE_F32
+#undef D_ADD
+#undef D_SUB
+#undef D_MUL
+#undef D_MIN
+#undef D_MAX
+#undef D_SUBTRACT
+#undef moments_uint8_simd
+#undef moments_uint16_simd
+#undef moments_f64_simd
+#undef moments_masked_uint8_simd
+#undef moments_masked_uint16_simd
+#undef stats_uint8_simd
+#undef stats_uint16_simd
+#undef bright_uint8_simd
+#undef bright_uint16_simd
+#undef copy_uint8_simd
+#undef copy_uint16_simd
+#undef subtract_uint8_simd
+#undef subtract_uint16_simd
+#undef moments_f32_simd
+#undef moments_masked_int32_simd
+#undef copy_uint8_f32_simd
+#undef copy_uint16_f32_simd
+#undef copy_uint8_i32_simd
+#undef copy_uint16_i32_simd
+#undef add_uint8_i32_simd
+#undef add_uint16_i32_simd
+#undef pairs_i32_simd
+#undef subtract_uint8_f32_simd
+#undef subtract_uint16_f32_simd
+#undef threshold_uint8_i32_simd
+#undef threshold_uint16_i32_simd
+#undef unpack_10g40_simd
+#undef unpack_12g24_simd
+#undef correct_uint8_simd
+#undef correct_uint16_simd
+#undef moments_masked_dark_uint8_simd
+#undef moments_masked_dark_uint16_simd
+#pragma GCC pop_options
+
+//------------------------------------------------------------------------------
+//                                  AVX2
+//------------------------------------------------------------------------------
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+// Packing works inside of 128-bit lanes, so their lower halves are gathered then
+static inline __m128i cgn_pack_u16_avx2(__m256i a) {
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(a, a), 0x08));
+}
+
+#define VI __m256i
+#define VD __m256d
+#define ILANES 8
+#define DLANES 4
+#define LOAD_U8(p) _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(p)))
+#define LOAD_U16(p) _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p)))
+#define LOAD_I32(p) _mm256_loadu_si256((const __m256i*)(p))
+#define I_ZERO _mm256_setzero_si256()
+#define I_SET1(a) _mm256_set1_epi32(a)
+#define I_IDX _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+#define I_ADD32 _mm256_add_epi32
+#define I_ADD64 _mm256_add_epi64
+#define I_SUB32 _mm256_sub_epi32
+#define I_AND _mm256_and_si256
+#define I_CMPGT32 _mm256_cmpgt_epi32
+#define I_MIN32 _mm256_min_epi32
+#define I_MAX32 _mm256_max_epi32
+#define I_MULLO32 _mm256_mullo_epi32
+#define I_MUL32 _mm256_mul_epi32
+#define I_SRL64(a) _mm256_srli_epi64(a, 32)
+#define I_STORE(p, a) _mm256_storeu_si256((__m256i*)(p), a)
+#define I_LO_PD(a) _mm256_cvtepi32_pd(_mm256_castsi256_si128(a))
+#define I_HI_PD(a) _mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1))
+#define I_PS _mm256_cvtepi32_ps
+#define I_OR _mm256_or_si256
+#define I_SET1_64 _mm256_set1_epi64x
+#define I_SLL16 _mm256_slli_epi16
+#define I_SRL16 _mm256_srli_epi16
+#define I_MULLO16 _mm256_mullo_epi16
+#define I_PAIRS(a, b) _mm256_permute4x64_epi64(_mm256_hadd_epi32(a, b), 0xD8)
+#define I_SHUFFLE8 _mm256_shuffle_epi8
+#define I_BCAST128 _mm256_broadcastsi128_si256
+#define LOAD_10G40(p) _mm256_loadu2_m128i((const __m128i*)((p) + 10), (const __m128i*)(p))
+#define LOAD_12G24(p) _mm256_loadu2_m128i((const __m128i*)((p) + 12), (const __m128i*)(p))
+#define READ_10G40 26
+#define READ_12G24 28
+#define F_STORE _mm256_storeu_ps
+#define F_LOAD _mm256_loadu_ps
+#define F_MUL _mm256_mul_ps
+#define F_ROUND _mm256_cvtps_epi32
+#define STORE_U8(p, a) _mm_storel_epi64((__m128i*)(p), _mm_packus_epi16(cgn_pack_u16_avx2(a), _mm_setzero_si128()))
+#define STORE_U16(p, a) _mm_storeu_si128((__m128i*)(p), cgn_pack_u16_avx2(a))
+#define D_ZERO _mm256_setzero_pd()
+#define D_SET1 _mm256_set1_pd
+#define D_IDX _mm256_setr_pd(0, 1, 2, 3)
+#define D_LOAD _mm256_loadu_pd
+#define D_STORE _mm256_storeu_pd
+#define D_LOAD_F32(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define D_STORE_F32(p, a) _mm_storeu_ps(p, _mm256_cvtpd_ps(a))
+#define D_ADD _mm256_add_pd
+#define D_SUB _mm256_sub_pd
+#define D_MUL _mm256_mul_pd
+#define D_MIN _mm256_min_pd
+#define D_MAX _mm256_max_pd
+#define D_SUBTRACT(v, th, m, t, count) {                                \
+    const VD mask = _mm256_cmp_pd(v, th, _CMP_GT_OQ);                   \
+    t = _mm256_and_pd(mask, _mm256_sub_pd(v, m));                       \
+    count += __builtin_popcount(_mm256_movemask_pd(mask));              \
+}
+
+#define moments_uint8_simd moments_u8_avx2
+#define moments_uint16_simd moments_u16_avx2
+#define moments_f64_simd moments_f64_avx2
+#define moments_masked_uint8_simd moments_masked_u8_avx2
+#define moments_masked_uint16_simd moments_masked_u16_avx2
+#define stats_uint8_simd stats_u8_avx2
+#define stats_uint16_simd stats_u16_avx2
+#define bright_uint8_simd bright_u8_avx2
+#define bright_uint16_simd bright_u16_avx2
+#define copy_uint8_simd copy_u8_avx2
+#define copy_uint16_simd copy_u16_avx2
+#define subtract_uint8_simd subtract_u8_avx2
+#define subtract_uint16_simd subtract_u16_avx2
+#define moments_f32_simd moments_f32_avx2
+#define moments_masked_int32_simd moments_masked_i32_avx2
+#define copy_uint8_f32_simd copy_u8_f32_avx2
+#define copy_uint16_f32_simd copy_u16_f32_avx2
+#define copy_uint8_i32_simd copy_u8_i32_avx2
+#define copy_uint16_i32_simd copy_u16_i32_avx2
+#define add_uint8_i32_simd add_u8_i32_avx2
+#define add_uint16_i32_simd add_u16_i32_avx2
+#define pairs_i32_simd pairs_i32_avx2
+#define subtract_uint8_f32_simd subtract_u8_f32_avx2
+#define subtract_uint16_f32_simd subtract_u16_f32_avx2
+#define threshold_uint8_i32_simd threshold_u8_i32_avx2
+#define threshold_uint16_i32_simd threshold_u16_i32_avx2
+#define unpack_10g40_simd unpack_10g40_avx2
+#define unpack_12g24_simd unpack_12g24_avx2
+#define correct_uint8_simd correct_u8_avx2
+#define correct_uint16_simd correct_u16_avx2
+#define moments_masked_dark_uint8_simd moments_masked_dark_u8_avx2
+#define moments_masked_dark_uint16_simd moments_masked_dark_u16_avx2
+
+cgn_kernels_simd(avx2)
+
+#undef VI
+#undef VD
+#undef ILANES
+#undef DLANES
+#undef LOAD_U8
+#undef LOAD_U16
+#undef LOAD_I32
+#undef I_ZERO
+#undef I_SET1
+#undef I_IDX
+#undef I_ADD32
+#undef I_ADD64
+#undef I_SUB32
+#undef I_AND
+#undef I_CMPGT32
+#undef I_MIN32
+#undef I_MAX32
+#undef I_MULLO32
+#undef I_MUL32
+#undef I_SRL64
+#undef I_STORE
+#undef I_LO_PD
+#undef I_HI_PD
+#undef I_PS
+#undef I_OR
+#undef I_SET1_64
+#undef I_SLL16
+#undef I_SRL16
+#undef I_MULLO16
+#undef I_PAIRS
+#undef I_SHUFFLE8
+#undef I_BCAST128
+#undef LOAD_10G40
+#undef LOAD_12G24
+#undef READ_10G40
+#undef READ_12G24
+#undef F_STORE
+#undef F_LOAD
+#undef F_MUL
+#undef F_ROUND
+#undef STORE_U8
+#undef STORE_U16
+#undef D_ZERO
+#undef D_SET1
+#undef D_IDX
+#undef D_LOAD
+#undef D_STORE
+#undef D_LOAD_F32
+#undef D_STORE_F32
+#undef D_ADD
+#undef D_SUB
+#undef D_MUL
+#undef D_MIN
+#undef D_MAX
+#undef D_SUBTRACT
+#undef moments_uint8_simd
+#undef moments_uint16_simd
+#undef moments_f64_simd
+#undef moments_masked_uint8_simd
+#undef moments_masked_uint16_simd
+#undef stats_uint8_simd
+#undef stats_uint16_simd
+#undef bright_uint8_simd
+#undef bright_uint16_simd
+#undef copy_uint8_simd
+#undef copy_uint16_simd
+#undef subtract_uint8_simd
+#undef subtract_uint16_simd
+#undef moments_f32_simd
+#undef moments_masked_int32_simd
+#undef copy_uint8_f32_simd
+#undef copy_uint16_f32_simd
+#undef copy_uint8_i32_simd
+#undef copy_uint16_i32_simd
+#undef add_uint8_i32_simd
+#undef add_uint16_i32_simd
+#undef pairs_i32_simd
+#undef subtract_uint8_f32_simd
+#undef subtract_uint16_f32_simd
+#undef threshold_uint8_i32_simd
+#undef threshold_uint16_i32_simd
+#undef unpack_10g40_simd
+#undef unpack_12g24_simd
+#undef correct_uint8_simd
+#undef correct_uint16_simd
+#undef moments_masked_dark_uint8_simd
+#undef moments_masked_dark_uint16_simd
+#pragma GCC pop_options
+
+//------------------------------------------------------------------------------
+//                                AVX-512
+//------------------------------------------------------------------------------
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+
+// 10-byte pairs of groups are not aligned to dwords, so they are inserted one by one
+static inline __m512i cgn_load_10g40_avx512(const uint8_t *p) {
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)p));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 10)), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 20)), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 30)), 3);
+}
+
+#define VI __m512i
+#define VD __m512d
+#define ILANES 16
+#define DLANES 8
+#define LOAD_U8(p) _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(p)))
+#define LOAD_U16(p) _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p)))
+#define LOAD_I32(p) _mm512_loadu_si512((const void*)(p))
+#define I_ZERO _mm512_setzero_si512()
+#define I_SET1(a) _mm512_set1_epi32(a)
+#define I_IDX _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#define I_ADD32 _mm512_add_epi32
+#define I_ADD64 _mm512_add_epi64
+#define I_SUB32 _mm512_sub_epi32
+#define I_AND _mm512_and_si512
+#define I_CMPGT32(a, b) _mm512_maskz_mov_epi32(_mm512_cmpgt_epi32_mask(a, b), _mm512_set1_epi32(-1))
+#define I_MIN32 _mm512_min_epi32
+#define I_MAX32 _mm512_max_epi32
+#define I_MULLO32 _mm512_mullo_epi32
+#define I_MUL32 _mm512_mul_epi32
+#define I_SRL64(a) _mm512_srli_epi64(a, 32)
+#define I_STORE(p, a) _mm512_storeu_si512((void*)(p), a)
+#define I_LO_PD(a) _mm512_cvtepi32_pd(_mm512_castsi512_si256(a))
+#define I_HI_PD(a) _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(a, 1))
+#define I_PS _mm512_cvtepi32_ps
+#define I_OR _mm512_or_si512
+#define I_SET1_64 _mm512_set1_epi64
+#define I_SLL16 _mm512_slli_epi16
+#define I_SRL16 _mm512_srli_epi16
+#define I_MULLO16 _mm512_mullo_epi16
+#define I_PAIRS(a, b) _mm512_add_epi32(                                \
+    _mm512_permutex2var_epi32(a, _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30), b), \
+    _mm512_permutex2var_epi32(a, _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31), b))
+#define I_SHUFFLE8 _mm512_shuffle_epi8
+#define I_BCAST128 _mm512_broadcast_i32x4
+#define LOAD_10G40 cgn_load_10g40_avx512
+#define LOAD_12G24(p) _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0), \
+    _mm512_maskz_loadu_epi8(0xFFFFFFFFFFFFULL, p))
+#define READ_10G40 46
+#define READ_12G24 48
+#define F_STORE _mm512_storeu_ps
+#define F_LOAD _mm512_loadu_ps
+#define F_MUL _mm512_mul_ps
+#define F_ROUND _mm512_cvtps_epi32
+#define STORE_U8(p, a) _mm_storeu_si128((__m128i*)(p), _mm512_cvtepi32_epi8(a))
+#define STORE_U16(p, a) _mm256_storeu_si256((__m256i*)(p), _mm512_cvtepi32_epi16(a))
+#define D_ZERO _mm512_setzero_pd()
+#define D_SET1 _mm512_set1_pd
+#define D_IDX _mm512_setr_pd(0, 1, 2, 3, 4, 5, 6, 7)
+#define D_LOAD _mm512_loadu_pd
+#define D_STORE _mm512_storeu_pd
+#define D_LOAD_F32(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+#define D_STORE_F32(p, a) _mm256_storeu_ps(p, _mm512_cvtpd_ps(a))
+#define D_ADD _mm512_add_pd
+#define D_SUB _mm512_sub_pd
+#define D_MUL _mm512_mul_pd
+#define D_MIN _mm512_min_pd
+#define D_MAX _mm512_max_pd
+#define D_SUBTRACT(v, th, m, t, count) {                                \
+    const __mmask8 mask = _mm512_cmp_pd_mask(v, th, _CMP_GT_OQ);        \
+    t = _mm512_maskz_sub_pd(mask, v, m);                                \
+    count += __builtin_popcount(mask);                                  \
+}
+
+#define moments_uint8_simd moments_u8_avx512
+#define moments_uint16_simd moments_u16_avx512
+#define moments_f64_simd moments_f64_avx512
+#define moments_masked_uint8_simd moments_masked_u8_avx512
+#define moments_masked_uint16_simd moments_masked_u16_avx512
+#define stats_uint8_simd stats_u8_avx512
+#define stats_uint16_simd stats_u16_avx512
+#define bright_uint8_simd bright_u8_avx512
+#define bright_uint16_simd bright_u16_avx512
+#define copy_uint8_simd copy_u8_avx512
+#define copy_uint16_simd copy_u16_avx512
+#define subtract_uint8_simd subtract_u8_avx512
+#define subtract_uint16_simd subtract_u16_avx512
+#define moments_f32_simd moments_f32_avx512
+#define moments_masked_int32_simd moments_masked_i32_avx512
+#define copy_uint8_f32_simd copy_u8_f32_avx512
+#define copy_uint16_f32_simd copy_u16_f32_avx512
+#define copy_uint8_i32_simd copy_u8_i32_avx512
+#define copy_uint16_i32_simd copy_u16_i32_avx512
+#define add_uint8_i32_simd add_u8_i32_avx512
+#define add_uint16_i32_simd add_u16_i32_avx512
+#define pairs_i32_simd pairs_i32_avx512
+#define subtract_uint8_f32_simd subtract_u8_f32_avx512
+#define subtract_uint16_f32_simd subtract_u16_f32_avx512
+#define threshold_uint8_i32_simd threshold_u8_i32_avx512
+#define threshold_uint16_i32_simd threshold_u16_i32_avx512
+#define unpack_10g40_simd unpack_10g40_avx512
+#define unpack_12g24_simd unpack_12g24_avx512
+#define correct_uint8_simd correct_u8_avx512
+#define correct_uint16_simd correct_u16_avx512
+#define moments_masked_dark_uint8_simd moments_masked_dark_u8_avx512
+#define moments_masked_dark_uint16_simd moments_masked_dark_u16_avx512
+
+cgn_kernels_simd(avx512)
+
+#pragma GCC pop_options
+
+#endif // CGN_X86
+
+//------------------------------------------------------------------------------
+//                                Dispatching
+//------------------------------------------------------------------------------
+
+static void cgn_init_kernels_scalar(CgnBeamKernels *k) {
+    k->moments_u8 = moments_u8_scalar;
+    k->moments_u16 = moments_u16_scalar;
+    k->moments_f64 = moments_f64_scalar;
+    k->moments_f32 = moments_f32_scalar;
+    k->moments_masked_u8 = moments_masked_u8_scalar;
+    k->moments_masked_u16 = moments_masked_u16_scalar;
+    k->moments_masked_i32 = moments_masked_i32_scalar;
+    k->stats_u8 = stats_u8_scalar;
+    k->stats_u16 = stats_u16_scalar;
+    k->bright_u8 = bright_u8_scalar;
+    k->bright_u16 = bright_u16_scalar;
+    k->copy_u8 = copy_u8_scalar;
+    k->copy_u16 = copy_u16_scalar;
+    k->copy_u8_f32 = copy_u8_f32_scalar;
+    k->copy_u16_f32 = copy_u16_f32_scalar;
+    k->copy_u8_i32 = copy_u8_i32_scalar;
+    k->copy_u16_i32 = copy_u16_i32_scalar;
+    k->add_u8_i32 = add_u8_i32_scalar;
+    k->add_u16_i32 = add_u16_i32_scalar;
+    k->pairs_i32 = pairs_i32_scalar;
+    k->subtract_u8 = subtract_u8_scalar;
+    k->subtract_u16 = subtract_u16_scalar;
+    k->subtract_u8_f32 = subtract_u8_f32_scalar;
+    k->subtract_u16_f32 = subtract_u16_f32_scalar;
+    k->threshold_u8_i32 = threshold_u8_i32_scalar;
+    k->threshold_u16_i32 = threshold_u16_i32_scalar;
+    k->unpack_10g40 = unpack_10g40_scalar;
+    k->unpack_12g24 = unpack_12g24_scalar;
+    k->correct_u8 = correct_u8_scalar;
+    k->correct_u16 = correct_u16_scalar;
+    k->moments_masked_dark_u8 = moments_masked_dark_u8_scalar;
+    k->moments_masked_dark_u16 = moments_masked_dark_u16_scalar;
+}
+
+static int cgn_max_simd_level() {
+#ifdef CGN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return CGN_SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return CGN_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return CGN_SIMD_SSE42;
+#endif
+    return CGN_SIMD_SCALAR;
+}
+
+int cgn_select_kernels(int level) {
+    level = min(level, cgn_max_simd_level());
+    switch (level) {
+#ifdef CGN_X86
+    case CGN_SIMD_AVX512: cgn_init_kernels_avx512(&cgn_kernels); break;
+    case CGN_SIMD_AVX2: cgn_init_kernels_avx2(&cgn_kernels); break;
+    case CGN_SIMD_SSE42: cgn_init_kernels_sse42(&cgn_kernels); break;
+#endif
+    default: level = CGN_SIMD_SCALAR; cgn_init_kernels_scalar(&cgn_kernels);
+    }
+    return level;
+}
+
+const char* cgn_simd_name(int level) {
+    switch (level) {
+    case CGN_SIMD_SSE42: return "sse4.2";
+    case CGN_SIMD_AVX2: return "avx2";
+    case CGN_SIMD_AVX512: return "avx512";
+    }
+    return "scalar";
+}
+
+// Kernels are selected once before main() so that camera threads never race on the table
+__attribute__((constructor)) static void cgn_init_kernels() {
+    cgn_select_kernels(CGN_SIMD_COUNT);
+}
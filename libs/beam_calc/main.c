@@ -1,93 +1,461 @@
 /*
 
-GCC 11.2x64 Intel i7-2600 CPU 3.40GHz
+GCC 12.2x64 Intel Xeon (AVX-512), VM with a single core available
+
+*** The sample images ../../beams/beam_8b_ast.pgm and beam_16b_ast.pgm are not
+*** in the repository, numbers are for synthetic stand-ins of the same size:
+*** a gaussian beam of 960x660 1/e2 diameters at [1567,965] rotated by 11.5 degrees,
+*** 8-bit: peak 210 over offset 3 with noise sdev 1.3,
+*** 16-bit: peak 54000 over offset 920 with noise sdev 320.
+*** Tables further below were measured at other times with different machine load,
+*** only numbers inside of the same table compare with each other.
 
 Image: ../../beams/beam_8b_ast.pgm
 Image size: 2592x2048
 Max gray: 255
-Max value: 212
+Max value: 217
 Data offset: 17
 
 Image: ../../beams/beam_16b_ast.pgm
 Image size: 2592x2048
 Max gray: 65535
-Max value: 54228
-Data offset: 19
+Max value: 55915
+Data offset: 20
 
 Frames: 30
 
-*** BLAS methods give slightly better performance
-*** but they seem to fight for CPU resources with other tasks.
-*** So outside of synthetic tests, in the reap app with ui and plotting,
-*** their performance drops significantly (8-15 -> 20-45 ms/frame)
-*** while performance of "naive" methods stay almost the same
-
-blas_8
-center=[1534,981], diam=[1474,1120], angle=-11.8
-Elapsed: 0.245s, FPS: 122.4, 8.2ms/frame
-
-blas_16
-center=[1534,981], diam=[1475,1120], angle=-11.8
-Elapsed: 0.253s, FPS: 118.6, 8.4ms/frame
+*** Moments are accumulated in a single pass with exact integer row sums.
+*** The previous two-pass version, built with the same flags and run right after this one,
+*** took 13.3 and 14.3 ms/frame for naive_8 and naive_16, 34.7 and 32.5 for bkgnd (max_iter=0).
+*** Results of both versions are the same.
+***
+*** Naive moments are taken over the whole frame without background subtraction,
+*** so the offset and noise spread over all pixels pull them away from the beam,
+*** and differently for the 8-bit and 16-bit images whose background levels differ.
 
 naive_8
-center=[1534,981], diam=[1474,1120], angle=-11.8
-Elapsed: 0.355s, FPS: 84.5, 11.8ms/frame
+center=[1512,977], diam=[1653,1228], angle=1.6
+Elapsed: 0.042s, FPS: 714.6, 1.4ms/frame
 
 naive_16
-center=[1534,981], diam=[1475,1120], angle=-11.8
-Elapsed: 0.313s, FPS: 95.8, 10.4ms/frame
+center=[1495,981], diam=[1811,1354], angle=0.8
+Elapsed: 0.056s, FPS: 534.0, 1.9ms/frame
+
+*** Kernels are selected at runtime by CPU features (beam_calc_simd.c),
+*** the program runs all levels supported by CPU, ms/frame:
+***
+***             scalar  sse4.2  avx2  avx512
+*** naive_8       5.5     4.1    2.2    1.4
+*** naive_16      5.6     4.3    3.0    1.9
+*** bkgnd_8      22.2    16.8   14.4   13.7
+*** bkgnd_16     19.7    16.8   13.5   13.9
+***
+*** Numbers below are for the best level (avx512)
 
 *** With background subtraction without iterating:
 
 max_iter=0, precision=0.05, corner_fraction=0.035, nT=3.0, mask_diam=3.0
 
 bkgnd_8
-center=[1567,965], diam=[985,678], angle=-11.5
-mean=3.61, sdev=1.26, min=0.00, max=208.39, iters=0
-Elapsed: 0.605s, FPS: 49.6, 20.2ms/frame
+center=[1567,965], diam=[929,639], angle=11.4
+mean=2.51, sdev=1.30, min=0.00, max=214.49, iters=0
+Elapsed: 0.412s, FPS: 72.8, 13.7ms/frame
 
 bkgnd_16
-center=[1567,965], diam=[985,678], angle=-11.5
-mean=927.29, sdev=324.80, min=0.00, max=53555.71, iters=0
-Elapsed: 0.651s, FPS: 46.1, 21.7ms/frame
+center=[1567,965], diam=[932,641], angle=11.4
+mean=918.72, sdev=317.93, min=0.00, max=54996.28, iters=0
+Elapsed: 0.416s, FPS: 72.2, 13.9ms/frame
 
 *** For good quality test images having rather constant and black background,
-*** without iterations it gives almost the same results but >1.5 times faster:
+*** without iterations it gives almost the same results but faster:
 
 max_iter=25, precision=0.001, corner_fraction=0.035, nT=3.0, mask_diam=3.0
 
 bkgnd_8
-center=[1567,965], diam=[979,673], angle=-11.6
-Elapsed: 1.146s, FPS: 26.2, 38.2ms/frame
-mean=3.61, sdev=1.26, min=0.00, max=208.39, iters=2
+center=[1567,965], diam=[929,639], angle=11.4
+Elapsed: 0.580s, FPS: 51.7, 19.3ms/frame
+mean=2.51, sdev=1.30, min=0.00, max=214.49, iters=1
 
 bkgnd_16
-center=[1567,965], diam=[979,673], angle=-11.6
-Elapsed: 1.118s, FPS: 26.8, 37.3ms/frame
-mean=927.29, sdev=324.80, min=0.00, max=53555.71, iters=2
+center=[1567,965], diam=[931,641], angle=11.4
+Elapsed: 0.780s, FPS: 38.5, 26.0ms/frame
+mean=918.72, sdev=317.93, min=0.00, max=54996.28, iters=2
+
+*** Worker pool, max_iter=25, best SIMD level, ms/frame.
+*** Results are bit-identical for any number of threads.
+*** The machine had a single core available for this run,
+*** so numbers only show that the pool overhead is negligible:
+***
+***             no pool  1      2      4      8
+*** bkgnd_8       9.4    8.2    8.2    8.4    8.3
+*** bkgnd_16      8.7    8.6    8.6    9.0    8.9
+
+*** Summed-area tables over 16x16 blocks, max_iter=25 and precision=0
+*** to force all iterations, ms/frame, results differ in the 14-15th digit:
+***
+***             off    on
+*** bkgnd_8     53.4   9.7
+*** bkgnd_16    52.0   9.7
+
+*** Background subtracted on the fly (`subtracted` is NULL), max_iter=25,
+*** without pool, ms/frame, results are the same in all printed digits:
+***
+***             off    on
+*** bkgnd_8     19.9   6.0
+*** bkgnd_16    27.0   10.2
+
+*** Types of the subtracted image, max_iter=25, without pool, ms/frame.
+*** i32 gives the same results as subtracting on the fly,
+*** f32 differs from f64 in the 9-10th digit:
+***
+***             f64    f32    i32
+*** bkgnd_8     18.1   10.5   11.4
+*** bkgnd_16    23.6   13.6   15.7
+
+*** Packed frames (the 16-bit image truncated to 10/12 bits), max_iter=25,
+*** without pool, ms/frame, results of both ways are the same:
+***
+***                unpack+calc  packed
+*** naive_10g40       4.3        2.5
+*** bkgnd_10g40       9.9        9.9
+*** naive_12g24       3.7        2.5
+*** bkgnd_12g24       9.9       10.0
+***
+*** Packed rows are decoded again on every background iteration,
+*** with SIMD unpackers this costs about the same as the single 16-bit copy
+*** (it was 24.9 and 12.6 ms/frame for bkgnd with scalar unpacking)
+
+*** cgn_copy_to_f64() converts rows by SIMD kernels of the pixel type in band tasks
+*** and reads packed frames as is, the max is taken from integer pixels of the row.
+*** Before, it was a scalar loop pasted per pixel type by a macro, updating the max
+*** through the pointer at every pixel. 2592x2048 random pixels, without pool, ms/frame:
+***
+***                macro  kernels
+*** copy_8          6.8    5.9
+*** copy_8+max     10.2    5.8
+*** copy_16         6.6    6.2
+*** copy_16+max    11.7    6.3
+*** unpack_copy     -     10.0  (10g40 and 12g24, same doubles and max)
+*** packed_copy     -      8.1
+
+*** Histogram gives brightness, max and other statistics in one pass,
+*** without pool, ms/frame, brightness and max are the same:
+***
+***                brightness+max  hist
+*** 8-bit               12.7        8.1
+*** 16-bit              13.6        9.7
+
+*** Brightness by integer kernels replacing the double one, with saturated fraction
+*** and clipped flag in the same pass, whole frame, without pool, ms/frame.
+*** The former scan of doubles also read past the row end for widths not a multiple of 8,
+*** now the last shorter group is averaged over its own pixels. It is cheap enough
+*** to be taken from every frame, brightness is the same as the histogram gives:
+***
+***                bright  hist
+*** 8-bit            0.8    8.1
+*** 16-bit           1.4   10.0
+
+*** Warm start from the previous result on the same frame, max_iter=25,
+*** background subtracted on the fly, without pool, ms/frame.
+*** The test beam is large, its 3-diameter mask covers most of the frame,
+*** so the gain is in the skipped pass over the whole aperture only:
+***
+***             cold   warm
+*** bkgnd_8      4.6    4.0
+*** bkgnd_16     7.6    4.7
+
+*** Coarse-to-fine start, background subtracted on the fly, max_iter=25,
+*** without pool, pyramid_min=8, ms/frame. The last two rows are synthetic 12-bit
+*** beams of given diameter in a 20MP frame (5472x3648).
+*** Results are the same as from the whole aperture, or differ inside of
+*** `precision` when iterations approach the same diameter from the other side.
+***
+***                 full   2x     4x     8x
+*** 8-bit            5.1   10.2   6.4    5.6
+*** 16-bit           8.3   11.5   7.8    6.6
+*** 20MP, d=400     13.0   22.9   12.2   10.2
+*** 20MP, d=40      12.2   18.3   10.7   18.7 (falls back, d=5 on the level)
+***
+*** Building of the level is bound by memory bandwidth the same as the pass over
+*** the whole aperture that it replaces, so only 4x and 8x levels pay off,
+*** the gain is in cheaper iterations from a good first mask.
+*** The level threshold uses the noise of raw pixels, with the threshold lowered
+*** by averaging, noise pixels outweighed the 40px beam on the 4x level
+*** (22.3 ms/frame then).
+***
+*** With the i32 subtracted image and sparse runs the level is calculated over
+*** its own blocks only, runs and tables of the full frame are not passed to it.
+*** Before, the level searched full frame runs, found no pixels for the 40px beam
+*** and silently fell back to the whole aperture. The subtraction pass is already
+*** done then, and the level is built on top of it, so it doesn't pay off, ms/frame:
+***
+***                 full   4x
+*** 8-bit           11.3   13.6
+*** 16-bit          12.3   13.7
+*** 20MP, d=400     19.1   26.8
+*** 20MP, d=40      18.3   27.2
+
+*** Sparse runs of pixels above the threshold for mask iterations, max_iter=25,
+*** precision=0 (all iterations are done), without pool, ms/frame.
+*** About 1M pixels of the test frame are above the threshold, in 10-11k runs,
+*** results differ from dense passes in the 13th digit:
+***
+***             dense   runs
+*** f64_8       133.0   42.9
+*** f64_16      138.8   47.7
+*** f32_8        77.9   36.9
+*** f32_16       87.0   35.5
+*** i32_8        94.3   42.9
+*** i32_16       89.0   47.0
+***
+*** Without merging of runs across short gaps of zeros there were 56-59k runs
+*** of 18px on average, their scalar tails made i32 slower than dense (106 ms/frame)
+
+*** Corner statistics for the f64 subtracted image are taken in a single pass
+*** from exact integer sums of pixels and their squares, the same as for other types.
+*** Before, corners were gathered into the beginning of `subtracted` as doubles,
+*** then the second pass took squared deviations and zeroed the scratch space.
+*** Results are the same in all printed digits, the gain is only seen with large corners,
+*** corner_fraction=0.25 on a 2592x2048 noise frame, max_iter=0, ms/frame:
+***
+***             gather+sqdev  single pass
+*** bkgnd_8         8.5           6.7
+*** bkgnd_16        8.9           7.3
+
+*** Batch of 64 frames 1296x1024 with a moving 16-bit beam, background subtracted on the fly,
+*** frame by frame with the pool splitting each frame into bands vs cgn_calc_beam_batch()
+*** giving whole frames to workers. Results are the same in all bits.
+*** The machine had a single core available for this run, so numbers only show
+*** that the batch costs the same on one thread, ms/frame:
+***
+***             single  batch
+*** threads=1     1.2    1.2
+*** threads=8     1.3    1.2
+
+*** Deterministic mode: moments of integer pixels are summed in exact 64/128-bit integers,
+*** the background is subtracted from the final sums only. Results are bit-exact for all
+*** SIMD levels and 1-8 threads, and differ from the double sums in the 16-17th digit
+*** (naive results are the same in all digits), max_iter=25, without pool, ms/frame:
+***
+***             doubles  exact
+*** naive_8       1.4     1.4
+*** naive_16      1.7     1.6
+*** bkgnd_8       4.7     4.6
+*** bkgnd_16      7.1     7.2
+***
+*** Summed-area tables, runs and f64/f32 subtracted images are not used for moments
+*** in this mode, so it is slower than them when they pay off.
+
+*** Dark frame correction: the reference is averaged by cgn_mean_add() over 30 frames
+*** of fixed pattern noise (3.9ms/frame), flat-field gains are of 20% vignetting.
+*** Pixels are corrected right in the passes reading them, mask iterations correct them
+*** in registers before thresholding. Compared to a separate pass making the corrected frame
+*** before calculation, results are the same in all bits, ms/frame:
+***
+***                   max_iter=0      max_iter=25
+***                  pass  fused     pass  fused
+*** dark_8            4.9   4.6      10.8   11.1
+*** dark_gain_8       6.6   6.1      11.2   16.0
+*** dark_16           6.2   4.7       8.1    9.0
+*** dark_gain_16      7.8   6.3      10.2   12.5
+***
+*** Each fused iteration reads the reference and gains along with pixels, so with many iterations
+*** over wide masks the I32 `subtracted` image is better, it is corrected once when being made.
+
+*** Defect pixels: 1000 hot pixels stuck at the top of the range, max_iter=0, ms/frame.
+*** cgn_find_hot() finds all of them in the dark mean in 30ms. cgn_fix_defects() replaces
+*** them right in the frame in 0.26-0.31ms, passes over the frame don't check for defects:
+***
+***                 clean   defects   fixed
+*** bkgnd_8           2.4     2.4      2.7
+*** bkgnd_16          2.7     2.9      3.0
+***
+*** Defects shift the center by 1.4px and shrink diameters by 38px (8-bit) and 15px (16-bit),
+*** after fixing differences to the clean frame are below 0.003px.
+
+*** Multi-beam: grids of n*n spots on 16-bit frame, max_iter=25, ms/frame. Regions above the threshold
+*** are labelled by row bands in a single pass, then each spot is iterated inside its own box.
+*** Results are the same for any number of threads, the machine had a single core for this run:
+***
+***                     no pool   1      2      4      8
+*** spots=1,  d=512      10.7    11.1   11.1   11.3   12.1
+*** spots=4,  d=256      10.6    10.8   11.1   11.0   11.0
+*** spots=16, d=128      12.3    12.1   12.2   12.4   12.1
+*** spots=64, d=64       15.1    14.4   14.7   14.2   14.8
+***
+*** The spots=1 row is from a later run. A single spot has no neighbour to bound its box,
+*** its mask is iterated inside the whole aperture. Before, the box was cast from infinite
+*** half-distances, so the spot was left with unrefined moments of its region.
+*** Centers are found within 0.04px of the true ones. Single beam cgn_calc_beam_bkgnd()
+*** takes 5.7ms/frame for the same frame (and finds the whole grid as one beam).
+***
+*** Spots are refined with the background subtracted on the fly whatever buffers `b` has.
+*** Before, the subtracted image, tables and warm start given for single beam calculation
+*** were taken by spot iterations, though this calculation never fills them.
 
 */
 #include "beam_calc.h"
+#include "beam_calc_int.h"
 
+#include <math.h>
 #include <stdlib.h>
 #include <time.h>
 
 #include "../../calc/pgm.h"
 
-#define FRAMES 1
+#define FRAMES 30
+#define MAX_THREADS 8
 #define FILENAME_8 "../../beams/beam_8b_ast.pgm"
 #define FILENAME_16 "../../beams/beam_16b_ast.pgm"
+#define LARGE_W 5472
+#define LARGE_H 3648
+#define BATCH_FRAMES 64
+#define DEFECTS 1000
+#define MULTI_MAX 64
+
+// Wall time, clock() would sum up CPU time of all pool threads
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Packs high bits of 16-bit pixels into IDS formats
+static void pack_10g40(const uint16_t *src, uint8_t *dst, int sz) {
+    for (int i = 0; i < sz; i += 4, dst += 5) {
+        uint8_t lo = 0;
+        for (int k = 0; k < 4; k++) {
+            const int v = src[i+k] >> 6;
+            dst[k] = v >> 2;
+            lo |= (v & 3) << (2*k);
+        }
+        dst[4] = lo;
+    }
+}
+
+static void pack_12g24(const uint16_t *src, uint8_t *dst, int sz) {
+    for (int i = 0; i < sz; i += 2, dst += 3) {
+        const int v0 = src[i] >> 4;
+        const int v1 = src[i+1] >> 4;
+        dst[0] = v0 >> 4;
+        dst[1] = v1 >> 4;
+        dst[2] = (v0 & 0x0F) | ((v1 & 0x0F) << 4);
+    }
+}
+
+// Round 16-bit beam of 4-sigma diameter `d` over noisy background, 12 bits used
+static void make_beam(uint16_t *buf, int w, int h, double xc, double yc, double d) {
+    for (int i = 0; i < h; i++)
+        for (int j = 0; j < w; j++) {
+            const double r2 = (j - xc)*(j - xc) + (i - yc)*(i - yc);
+            buf[i*w + j] = 3500 * exp(-8 * r2 / (d*d)) + 100 + rand() % 64;
+        }
+}
+
+// Grid of `n*n` round spots of 4-sigma diameter `d` with powers growing along rows, 12 bits used
+static void make_spots(uint16_t *buf, int w, int h, int n, double d) {
+    for (int i = 0; i < h; i++)
+        for (int j = 0; j < w; j++) {
+            const int a = i * n / h, b = j * n / w;
+            const double xc = (b + 0.5) * w / n + 0.3, yc = (a + 0.5) * h / n + 0.7;
+            const double r2 = (j - xc)*(j - xc) + (i - yc)*(i - yc);
+            buf[i*w + j] = (1500 + 1500.0*(a*n + b)/(n*n)) * exp(-8 * r2 / (d*d)) + 100 + rand() % 64;
+        }
+}
+
+// Dark frame correction as a separate pass making the corrected frame
+static void correct_frame(const CgnBeamCalc *c, const uint16_t *dark, const float *gain, int level, uint8_t *dst) {
+    for (int i = 0; i < c->h; i++) {
+        const int k = i*c->w;
+        const CgnRowDark d = {dark + k, gain ? gain + k : NULL, level, (1 << c->bpp) - 1};
+        if (c->bpp > 8)
+            cgn_kernels.correct_u16((const uint16_t*)c->buf + k, &d, c->w, (uint16_t*)dst + k);
+        else
+            cgn_kernels.correct_u8(c->buf + k, &d, c->w, dst + k);
+    }
+}
+
+// Unpacked frame without dark correction, gain and threads, pixels are given by the caller
+static void init_calc(CgnBeamCalc *c, int w, int h) {
+    memset(c, 0, sizeof(*c));
+    c->w = w;
+    c->h = h;
+    c->packing = CGN_UNPACKED;
+}
+
+// Default background parameters over the whole frame, all optional buffers are off
+static void init_bkgnd(CgnBeamBkgnd *b, int w, int h) {
+    memset(b, 0, sizeof(*b));
+    b->max_iter = 25;
+    b->precision = 0.001;
+    b->corner_fraction = 0.035;
+    b->nT = 3;
+    b->mask_diam = 3;
+    b->subtracted_type = CGN_SUBTRACTED_F64;
+    b->runs_count = -1;
+    b->ax2 = w;
+    b->ay2 = h;
+}
 
 #define MEASURE(ident, func) { \
-    printf("\n" ident "\n"); \
-    clock_t tm = clock(); \
+    printf("\n%s\n", ident); \
+    double tm = seconds(); \
     for (int i = 0; i < FRAMES; i++) func; \
-    double elapsed = (clock() - tm)/(double)CLOCKS_PER_SEC; \
+    double elapsed = seconds() - tm; \
     printf("center=[%.0f,%.0f], diam=[%.0f,%.0f], angle=%.1f\n", r.xc, r.yc, r.dx, r.dy, r.phi); \
     printf("Elapsed: %.3fs, FPS: %.1f, %.1fms/frame\n", elapsed, FRAMES/elapsed, elapsed/(double)FRAMES*1000); \
 }
 
+// Beam calculated from the whole aperture and from coarse estimates, differences are to the former
+static void bench_coarse(const CgnBeamCalc *c) {
+    int32_t *pyramid = (int32_t*)malloc(cgn_pyramid_size(c->w, c->h, 2) * sizeof(int32_t));
+
+    CgnBeamBkgnd b;
+    init_bkgnd(&b, c->w, c->h);
+    b.pyramid_buf = pyramid;
+    b.pyramid_min = 8;
+
+    CgnBeamResult r;
+    r.x1 = 0, r.x2 = c->w;
+    r.y1 = 0, r.y2 = c->h;
+    MEASURE("full", cgn_calc_beam_bkgnd(c, &b, &r));
+    const CgnBeamResult full = r;
+    printf("xc=%.3f, yc=%.3f, dx=%.3f, dy=%.3f, iters=%d\n", r.xc, r.yc, r.dx, r.dy, b.iters);
+
+    for (b.pyramid = 2; b.pyramid <= 8; b.pyramid *= 2) {
+        char ident[32];
+        snprintf(ident, sizeof(ident), "coarse_%d", b.pyramid);
+        MEASURE(ident, cgn_calc_beam_bkgnd(c, &b, &r));
+        printf("iters=%d, coarse=%d, diff to full: xc=%.1e, yc=%.1e, dx=%.1e, dy=%.1e\n", b.iters, b.coarse,
+            r.xc - full.xc, r.yc - full.yc, r.dx - full.dx, r.dy - full.dy);
+    }
+
+    // Runs are listed over the integer subtracted image at full resolution, the level must not take them
+    const int runs_size = c->w*c->h/16;
+    int32_t *subtracted = (int32_t*)malloc((size_t)c->w*c->h * sizeof(int32_t));
+    CgnBeamRun *runs = (CgnBeamRun*)malloc(runs_size * sizeof(CgnBeamRun));
+    if (!subtracted || !runs) {
+        perror("Unable to allocate runs");
+        exit(EXIT_FAILURE);
+    }
+    b.subtracted = subtracted;
+    b.subtracted_type = CGN_SUBTRACTED_I32;
+    b.runs = runs;
+    b.runs_size = runs_size;
+    b.pyramid = 0;
+    MEASURE("full_runs", cgn_calc_beam_bkgnd(c, &b, &r));
+    const CgnBeamResult full_runs = r;
+    printf("iters=%d, runs=%d\n", b.iters, b.runs_count);
+    b.pyramid = 4;
+    MEASURE("coarse_runs_4", cgn_calc_beam_bkgnd(c, &b, &r));
+    printf("iters=%d, coarse=%d, runs=%d, diff to full: xc=%.1e, yc=%.1e, dx=%.1e, dy=%.1e\n",
+        b.iters, b.coarse, b.runs_count, r.xc - full_runs.xc, r.yc - full_runs.yc,
+        r.dx - full_runs.dx, r.dy - full_runs.dy);
+    free(subtracted);
+    free(runs);
+    free(pyramid);
+}
+
 int main() {
     int w, h, offset8;
     uint8_t *buf8 = read_pgm(FILENAME_8, &w, &h, &offset8);
@@ -113,8 +481,8 @@ int main() {
     }
     uint16_t max16 = 0;
     for (int i = 0; i < w*h; i++)
-        if (max16 < ((uint16_t*)buf16)[offset16+i]) {
-            max16 = ((uint16_t*)buf16)[offset16+i];
+        if (max16 < ((uint16_t*)(buf16+offset16))[i]) {
+            max16 = ((uint16_t*)(buf16+offset16))[i];
         }
     printf("Max value: %d\n", max16);
     printf("Data offset: %d\n\n", offset16);
@@ -141,49 +509,584 @@ int main() {
         cgn_calc_beam_blas_free(&c);
     }
 #endif
-    {
+    for (int simd = CGN_SIMD_SCALAR; simd < CGN_SIMD_COUNT; simd++) {
+        if (cgn_select_kernels(simd) != simd) break;
+        printf("\n*** SIMD: %s\n", cgn_simd_name(simd));
         CgnBeamResult r;
         r.x1 = 0, r.x2 = w;
         r.y1 = 0, r.y2 = h;
 
         CgnBeamCalc c;
-        c.w = w;
-        c.h = h;
+        init_calc(&c, w, h);
 
-        c.bits = 8;
+        c.bpp = 8;
         c.buf = buf8+offset8;
         MEASURE("naive_8", cgn_calc_beam_naive(&c, &r));
 
-        c.bits = 16;
+        c.bpp = 16;
         c.buf = buf16+offset16;
         MEASURE("naive_16", cgn_calc_beam_naive(&c, &r));
 
         CgnBeamBkgnd b;
-        //b.max_iter = 25;
+        init_bkgnd(&b, w, h);
         b.max_iter = 0;
-        //b.precision = 0.001;
         b.precision = 0.05;
-        b.corner_fraction = 0.035;
-        b.nT = 3;
-        b.mask_diam = 3;
         b.subtracted = subtracted;
-        b.ax1 = 0;
-        b.ay1 = 0;
-        b.ax2 = w;
-        b.ay2 = h;
         printf("\nmax_iter=%d, precision=%.3f, corner_fraction=%.3f, nT=%.1f, mask_diam=%.1f\n",
             b.max_iter, b.precision, b.corner_fraction, b.nT, b.mask_diam);
 
-        c.bits = 8;
+        c.bpp = 8;
         c.buf = buf8+offset8;
         MEASURE("bkgnd_8", cgn_calc_beam_bkgnd(&c, &b, &r));
         printf("mean=%.2f, sdev=%.2f, min=%.2f, max=%.2f, iters=%d\n", b.mean, b.sdev, b.min, b.max, b.iters);
 
-        c.bits = 16;
+        c.bpp = 16;
         c.buf = buf16+offset16;
         MEASURE("bkgnd_16", cgn_calc_beam_bkgnd(&c, &b, &r));
         printf("mean=%.2f, sdev=%.2f, min=%.2f, max=%.2f, iters=%d\n", b.mean, b.sdev, b.min, b.max, b.iters);
     }
+
+    cgn_select_kernels(CGN_SIMD_COUNT);
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        printf("\n*** Threads: %d\n", threads);
+        CgnBeamResult r;
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.pool = cgn_pool_create(threads, -1);
+        if (!c.pool) {
+            printf("Unable to start threads\n");
+            break;
+        }
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.subtracted = subtracted;
+
+        c.bpp = 8;
+        c.buf = buf8+offset8;
+        MEASURE("bkgnd_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+
+        c.bpp = 16;
+        c.buf = buf16+offset16;
+        MEASURE("bkgnd_16", cgn_calc_beam_bkgnd(&c, &b, &r));
+
+        cgn_pool_free(c.pool);
+    }
+
+    double *sat = (double*)malloc(sizeof(double)*cgn_sat_size(w, h));
+    if (!sat) {
+        perror("Unable to allocate summed-area tables");
+        exit(EXIT_FAILURE);
+    }
+    for (int use_sat = 0; use_sat < 2; use_sat++) {
+        printf("\n*** Summed-area tables: %s\n", use_sat ? "on" : "off");
+        CgnBeamResult r;
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.precision = 0;
+        b.subtracted = subtracted;
+        b.sat = use_sat ? sat : NULL;
+
+        c.bpp = 8;
+        c.buf = buf8+offset8;
+        MEASURE("bkgnd_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, iters=%d\n", r.xc, r.yc, r.dx, r.dy, b.iters);
+
+        c.bpp = 16;
+        c.buf = buf16+offset16;
+        MEASURE("bkgnd_16", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, iters=%d\n", r.xc, r.yc, r.dx, r.dy, b.iters);
+    }
+    for (int lazy = 0; lazy < 2; lazy++) {
+        printf("\n*** Background subtracted on the fly: %s\n", lazy ? "on" : "off");
+        CgnBeamResult r;
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.subtracted = lazy ? NULL : subtracted;
+
+        c.bpp = 8;
+        c.buf = buf8+offset8;
+        MEASURE("bkgnd_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, count=%d\n", r.xc, r.yc, r.dx, r.dy, b.count);
+
+        c.bpp = 16;
+        c.buf = buf16+offset16;
+        MEASURE("bkgnd_16", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, count=%d\n", r.xc, r.yc, r.dx, r.dy, b.count);
+    }
+    const char *type_names[] = { "f64", "f32", "i32" };
+    for (int type = CGN_SUBTRACTED_F64; type <= CGN_SUBTRACTED_I32; type++) {
+        printf("\n*** Subtracted image type: %s\n", type_names[type]);
+        CgnBeamResult r;
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.subtracted = subtracted;
+        b.subtracted_type = type;
+
+        c.bpp = 8;
+        c.buf = buf8+offset8;
+        MEASURE("bkgnd_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, max=%.15g\n", r.xc, r.yc, r.dx, r.dy, b.max);
+
+        c.bpp = 16;
+        c.buf = buf16+offset16;
+        MEASURE("bkgnd_16", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, max=%.15g\n", r.xc, r.yc, r.dx, r.dy, b.max);
+    }
+    const int runs_size = w*h/16;
+    CgnBeamRun *runs = (CgnBeamRun*)malloc(runs_size * sizeof(CgnBeamRun));
+    for (int type = CGN_SUBTRACTED_F64; type <= CGN_SUBTRACTED_I32; type++) {
+        printf("\n*** Sparse runs, subtracted image type: %s\n", type_names[type]);
+        CgnBeamResult r;
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.precision = 0;
+        b.subtracted = subtracted;
+        b.subtracted_type = type;
+
+        for (int bpp = 8; bpp <= 16; bpp += 8) {
+            c.bpp = bpp;
+            c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+            b.runs = NULL;
+            MEASURE(bpp > 8 ? "dense_16" : "dense_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+            const CgnBeamResult dense = r;
+            b.runs = runs;
+            b.runs_size = runs_size;
+            MEASURE(bpp > 8 ? "runs_16" : "runs_8", cgn_calc_beam_bkgnd(&c, &b, &r));
+            printf("count=%d, runs=%d, diff to dense: xc=%.1e, yc=%.1e, dx=%.1e, dy=%.1e\n", b.count, b.runs_count,
+                r.xc - dense.xc, r.yc - dense.yc, r.dx - dense.dx, r.dy - dense.dy);
+        }
+    }
+    free(runs);
+    uint8_t *packed = (uint8_t*)malloc(w*h*2);
+    uint16_t *unpacked = (uint16_t*)malloc(w*h*2);
+    double *copied = (double*)malloc(sizeof(double)*w*h);
+    if (!packed || !unpacked || !copied) {
+        perror("Unable to allocate packed frames");
+        exit(EXIT_FAILURE);
+    }
+    for (int packing = CGN_PACKED_10G40; packing <= CGN_PACKED_12G24; packing++) {
+        CgnBeamCalc p;
+        init_calc(&p, w, h);
+        p.buf = packed;
+        p.packing = packing;
+        if (packing == CGN_PACKED_10G40) {
+            p.bpp = 10;
+            pack_10g40((const uint16_t*)(buf16+offset16), packed, w*h);
+        } else {
+            p.bpp = 12;
+            pack_12g24((const uint16_t*)(buf16+offset16), packed, w*h);
+        }
+        printf("\n*** Packed %d-bit frames\n", p.bpp);
+        CgnBeamResult r;
+        r.x1 = 0, r.x2 = w;
+        r.y1 = 0, r.y2 = h;
+        CgnBeamCalc c = p;
+        c.buf = (uint8_t*)unpacked;
+        c.packing = CGN_UNPACKED;
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+
+        MEASURE("unpack_naive", (cgn_unpack_u16(&p, unpacked), cgn_calc_beam_naive(&c, &r)));
+        MEASURE("packed_naive", cgn_calc_beam_naive(&p, &r));
+
+        MEASURE("unpack_bkgnd", (cgn_unpack_u16(&p, unpacked), cgn_calc_beam_bkgnd(&c, &b, &r)));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, count=%d\n", r.xc, r.yc, r.dx, r.dy, b.count);
+
+        MEASURE("packed_bkgnd", cgn_calc_beam_bkgnd(&p, &b, &r));
+        printf("xc=%.15g, yc=%.15g, dx=%.15g, dy=%.15g, count=%d\n", r.xc, r.yc, r.dx, r.dy, b.count);
+
+        double max_unpacked, max_packed;
+        MEASURE("unpack_copy", (cgn_unpack_u16(&p, unpacked), cgn_copy_to_f64(&c, subtracted, &max_unpacked)));
+        MEASURE("packed_copy", cgn_copy_to_f64(&p, copied, &max_packed));
+        printf("max=%.0f, same: %s\n", max_packed, max_packed == max_unpacked &&
+            memcmp(copied, subtracted, sizeof(double)*w*h) == 0 ? "yes" : "NO");
+    }
+    free(packed);
+    free(unpacked);
+    free(copied);
+
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+
+        CgnBeamHist hist;
+        hist.x1 = 0;
+        hist.y1 = 0;
+        hist.x2 = w;
+        hist.y2 = h;
+        hist.bins = (uint32_t*)malloc(cgn_hist_size(bpp) * sizeof(uint32_t));
+        if (!hist.bins) {
+            perror("Unable to allocate histogram");
+            exit(EXIT_FAILURE);
+        }
+
+        CgnBeamBright bright;
+        bright.x1 = 0;
+        bright.y1 = 0;
+        bright.x2 = w;
+        bright.y2 = h;
+        double tm = seconds();
+        for (int i = 0; i < FRAMES; i++)
+            cgn_calc_bright(&c, &bright);
+        double elapsed = seconds() - tm;
+        printf("\nbright_%d\n", bpp);
+        printf("brightness=%.6f, saturated=%.6f, clipped=%d\n", bright.brightness, bright.saturated, bright.clipped);
+        printf("Elapsed: %.3fs, FPS: %.1f, %.1fms/frame\n", elapsed, FRAMES/elapsed, elapsed/(double)FRAMES*1000);
+
+        tm = seconds();
+        for (int i = 0; i < FRAMES; i++)
+            cgn_calc_hist(&c, &hist);
+        elapsed = seconds() - tm;
+        printf("\nhist_%d\n", bpp);
+        printf("brightness=%.6f, max=%d, min=%d, mean=%.3f, saturated=%d, p50=%d, p99=%d\n",
+            hist.brightness, hist.max, hist.min, hist.mean, hist.saturated,
+            cgn_hist_percentile(&hist, 0.5), cgn_hist_percentile(&hist, 0.99));
+        printf("Elapsed: %.3fs, FPS: %.1f, %.1fms/frame\n", elapsed, FRAMES/elapsed, elapsed/(double)FRAMES*1000);
+        free(hist.bins);
+    }
+
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        printf("\n*** Warm start, %d-bit\n", bpp);
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+
+        CgnBeamResult r;
+        r.x1 = 0, r.x2 = w;
+        r.y1 = 0, r.y2 = h;
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+
+        MEASURE("cold", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.3f, yc=%.3f, dx=%.3f, dy=%.3f, iters=%d\n", r.xc, r.yc, r.dx, r.dy, b.iters);
+
+        b.warm_start = 0.1;
+        MEASURE("warm", cgn_calc_beam_bkgnd(&c, &b, &r));
+        printf("xc=%.3f, yc=%.3f, dx=%.3f, dy=%.3f, iters=%d, warm=%d\n", r.xc, r.yc, r.dx, r.dy, b.iters, b.warm);
+    }
+
+    printf("\n*** Coarse-to-fine start\n");
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+        printf("\n%d-bit\n", bpp);
+        bench_coarse(&c);
+    }
+    {
+        CgnBeamCalc c;
+        init_calc(&c, LARGE_W, LARGE_H);
+        c.bpp = 16;
+        uint16_t *large = (uint16_t*)malloc(c.w*c.h*2);
+        c.buf = (uint8_t*)large;
+        for (int d = 400; d >= 40; d /= 10) {
+            make_beam(large, c.w, c.h, 3000.3, 1500.7, d);
+            printf("\n%dx%d, d=%d\n", c.w, c.h, d);
+            bench_coarse(&c);
+        }
+        free(large);
+    }
+
+    printf("\n*** Batch of frames\n");
+    {
+        CgnBeamCalc c;
+        init_calc(&c, w/2, h/2);
+        c.bpp = 16;
+        const int sz = c.w*c.h;
+        uint16_t *batch = (uint16_t*)malloc((size_t)sz*2*BATCH_FRAMES);
+        if (!batch) {
+            perror("Unable to allocate batch frames");
+            exit(EXIT_FAILURE);
+        }
+        const uint8_t *frames[BATCH_FRAMES];
+        for (int i = 0; i < BATCH_FRAMES; i++) {
+            make_beam(batch + (size_t)i*sz, c.w, c.h, c.w/2 + 200*sin(i*0.1), c.h/2 + 200*cos(i*0.1), 300);
+            frames[i] = (const uint8_t*)(batch + (size_t)i*sz);
+        }
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, c.w, c.h);
+
+        CgnBeamResult single[BATCH_FRAMES], results[BATCH_FRAMES];
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            c.pool = cgn_pool_create(threads, -1);
+            if (!c.pool) {
+                printf("Unable to start threads\n");
+                break;
+            }
+            double tm = seconds();
+            for (int i = 0; i < BATCH_FRAMES; i++) {
+                c.buf = (uint8_t*)frames[i];
+                cgn_calc_beam_bkgnd(&c, &b, single + i);
+            }
+            const double elapsed_single = seconds() - tm;
+            tm = seconds();
+            const int ok = cgn_calc_beam_batch(&c, &b, frames, BATCH_FRAMES, results);
+            const double elapsed_batch = seconds() - tm;
+            int same = ok;
+            for (int i = 0; i < BATCH_FRAMES && same; i++)
+                same = single[i].xc == results[i].xc && single[i].yc == results[i].yc &&
+                    single[i].dx == results[i].dx && single[i].dy == results[i].dy;
+            printf("threads=%d, frames=%d, single: %.1fms/frame, batch: %.1fms/frame, results: %s\n",
+                threads, BATCH_FRAMES, elapsed_single/BATCH_FRAMES*1000, elapsed_batch/BATCH_FRAMES*1000,
+                !ok ? "not allocated" : same ? "same" : "DIFFERENT");
+            cgn_pool_free(c.pool);
+        }
+        free(batch);
+    }
+
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        printf("\n*** Deterministic mode, %d-bit\n", bpp);
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+
+        CgnBeamResult r;
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+
+        for (c.deterministic = 0; c.deterministic <= 1; c.deterministic++) {
+            r.x1 = 0, r.x2 = w;
+            r.y1 = 0, r.y2 = h;
+            MEASURE(c.deterministic ? "exact_naive" : "naive", cgn_calc_beam_naive(&c, &r));
+            printf("xc=%.17g, yc=%.17g, dx=%.17g, dy=%.17g, phi=%.17g\n", r.xc, r.yc, r.dx, r.dy, r.phi);
+            MEASURE(c.deterministic ? "exact_bkgnd" : "bkgnd", cgn_calc_beam_bkgnd(&c, &b, &r));
+            printf("xc=%.17g, yc=%.17g, dx=%.17g, dy=%.17g, phi=%.17g\n", r.xc, r.yc, r.dx, r.dy, r.phi);
+        }
+
+        // Exact results must not change with SIMD level and threads
+        c.deterministic = 1;
+        const CgnBeamResult ref = r;
+        int same = 1;
+        for (int simd = CGN_SIMD_SCALAR; simd < CGN_SIMD_COUNT; simd++) {
+            if (cgn_select_kernels(simd) != simd) break;
+            for (int threads = 0; threads <= MAX_THREADS; threads = threads ? threads*2 : 1) {
+                c.pool = threads ? cgn_pool_create(threads, -1) : NULL;
+                cgn_calc_beam_bkgnd(&c, &b, &r);
+                same &= r.xc == ref.xc && r.yc == ref.yc && r.dx == ref.dx && r.dy == ref.dy && r.phi == ref.phi;
+                cgn_pool_free(c.pool);
+            }
+        }
+        cgn_select_kernels(CGN_SIMD_COUNT);
+        printf("Same for all SIMD levels and threads: %s\n", same ? "yes" : "NO");
+    }
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        printf("\n*** Dark frame correction, %d-bit\n", bpp);
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+
+        // Fixed pattern of column offsets and hot pixels plus temporal noise
+        const int sz = w*h;
+        const int scale = bpp > 8 ? 256 : 1;
+        float *mean = (float*)malloc(sz * sizeof(float));
+        float *gain = (float*)malloc(sz * sizeof(float));
+        uint16_t *dark = (uint16_t*)malloc(sz * sizeof(uint16_t));
+        uint8_t *frame = (uint8_t*)malloc(sz * 2);
+        uint8_t *corrected = (uint8_t*)malloc(sz * 2);
+        if (!mean || !gain || !dark || !frame || !corrected) {
+            perror("Unable to allocate dark frames");
+            exit(EXIT_FAILURE);
+        }
+        CgnBeamCalc d = c;
+        d.buf = frame;
+        double elapsed = 0;
+        for (int k = 0; k < FRAMES; k++) {
+            for (int i = 0; i < sz; i++) {
+                const int v = ((i % w) % 7 + (i % 997 == 0 ? 20 : 0) + rand() % 3) * scale;
+                if (bpp > 8) ((uint16_t*)frame)[i] = v; else frame[i] = v;
+            }
+            const double tm = seconds();
+            cgn_mean_add(&d, mean, k);
+            elapsed += seconds() - tm;
+        }
+        printf("\nmean_add\nElapsed: %.1fms/frame\n", elapsed/FRAMES*1000);
+        const int level = cgn_dark_finish(mean, sz, dark);
+        printf("dark_level=%d\n", level);
+
+        // Flat field with 20% vignetting
+        for (int i = 0; i < h; i++)
+            for (int j = 0; j < w; j++) {
+                const double r2 = ((j - w/2.0)*(j - w/2.0) + (i - h/2.0)*(i - h/2.0)) / (w*w/4.0 + h*h/4.0);
+                mean[i*w + j] = dark[i*w + j] + 100*scale*(1 - 0.2*r2);
+            }
+        cgn_flat_gain(mean, dark, sz, gain);
+
+        CgnBeamResult r;
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+
+        for (b.max_iter = 0; b.max_iter <= 25; b.max_iter += 25) {
+            printf("\nmax_iter=%d\n", b.max_iter);
+            MEASURE("bkgnd", cgn_calc_beam_bkgnd(&c, &b, &r));
+            for (int with_gain = 0; with_gain <= 1; with_gain++) {
+                // Corrected frame made by a separate pass and then calculated as raw one
+                CgnBeamCalc s = c;
+                s.buf = corrected;
+                MEASURE(with_gain ? "pass_dark_gain" : "pass_dark",
+                    (correct_frame(&c, dark, with_gain ? gain : NULL, level, corrected), cgn_calc_beam_bkgnd(&s, &b, &r)));
+                const CgnBeamResult ref = r;
+
+                c.dark = dark;
+                c.dark_level = level;
+                c.gain = with_gain ? gain : NULL;
+                MEASURE(with_gain ? "fused_dark_gain" : "fused_dark", cgn_calc_beam_bkgnd(&c, &b, &r));
+                printf("mean=%.2f, sdev=%.2f, same: %s\n", b.mean, b.sdev,
+                    r.xc == ref.xc && r.yc == ref.yc && r.dx == ref.dx && r.dy == ref.dy ? "yes" : "NO");
+                c.dark = NULL;
+                c.gain = NULL;
+            }
+        }
+        free(mean);
+        free(gain);
+        free(dark);
+        free(frame);
+        free(corrected);
+    }
+    for (int bpp = 8; bpp <= 16; bpp += 8) {
+        printf("\n*** Defect pixels, %d-bit\n", bpp);
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = bpp;
+        c.buf = bpp > 8 ? buf16+offset16 : buf8+offset8;
+
+        // Hot pixels stuck at the top of the range in the dark mean and in the beam frame
+        const int sz = w*h;
+        const int bytes = sz * (bpp > 8 ? 2 : 1);
+        const int top = (1 << bpp) - 1;
+        float *mean = (float*)malloc(sz * sizeof(float));
+        int32_t *idx = (int32_t*)malloc(sz * sizeof(int32_t));
+        uint8_t *frame = (uint8_t*)malloc(bytes);
+        if (!mean || !idx || !frame) {
+            perror("Unable to allocate defect frames");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(frame, c.buf, bytes);
+        for (int i = 0; i < sz; i++)
+            mean[i] = (i % w) % 7 + (rand() % 100) / 100.0;
+        int hot = 0;
+        for (int i = 0; i < DEFECTS; i++) {
+            const int k = rand() % sz;
+            if (mean[k] < top) hot++;
+            mean[k] = top;
+            if (bpp > 8) ((uint16_t*)frame)[k] = top; else frame[k] = top;
+        }
+        double tm = seconds();
+        const int found = cgn_find_hot(mean, w, h, 6, idx);
+        printf("\nfind_hot\nElapsed: %.1fms, hot=%d, found=%d\n", (seconds() - tm)*1000, hot, found);
+
+        CgnBeamResult r;
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+        b.max_iter = 0;
+
+        MEASURE("bkgnd", cgn_calc_beam_bkgnd(&c, &b, &r));
+        const CgnBeamResult ref = r;
+        CgnBeamCalc d = c;
+        d.buf = frame;
+        MEASURE("bkgnd_defects", cgn_calc_beam_bkgnd(&d, &b, &r));
+        printf("diff to clean: xc=%.1e, yc=%.1e, dx=%.1e, dy=%.1e\n",
+            r.xc - ref.xc, r.yc - ref.yc, r.dx - ref.dx, r.dy - ref.dy);
+        MEASURE("bkgnd_fixed", (cgn_fix_defects(&d, idx, found), cgn_calc_beam_bkgnd(&d, &b, &r)));
+        printf("diff to clean: xc=%.1e, yc=%.1e, dx=%.1e, dy=%.1e\n",
+            r.xc - ref.xc, r.yc - ref.yc, r.dx - ref.dx, r.dy - ref.dy);
+        tm = seconds();
+        for (int i = 0; i < FRAMES; i++)
+            cgn_fix_defects(&d, idx, found);
+        printf("\nfix_defects\nElapsed: %.3fms/frame\n", (seconds() - tm)/FRAMES*1000);
+        free(mean);
+        free(idx);
+        free(frame);
+    }
+
+    printf("\n*** Multi-beam\n");
+    {
+        CgnBeamCalc c;
+        init_calc(&c, w, h);
+        c.bpp = 16;
+        uint16_t *spots = (uint16_t*)malloc(w*h*2);
+        CgnBeamResult beams[MULTI_MAX];
+        if (!spots) {
+            perror("Unable to allocate spots frame");
+            exit(EXIT_FAILURE);
+        }
+        c.buf = (uint8_t*)spots;
+
+        CgnBeamBkgnd b;
+        init_bkgnd(&b, w, h);
+
+        CgnMultiBeam m;
+        m.beams = beams;
+        m.max_beams = MULTI_MAX;
+        m.min_pixels = 20;
+        for (int n = 1; n <= 8; n *= 2) {
+            const double d = (w < h ? w : h) / (double)n / 4;
+            make_spots(spots, w, h, n, d);
+            for (int threads = 0; threads <= MAX_THREADS; threads = threads ? threads*2 : 1) {
+                c.pool = threads ? cgn_pool_create(threads, -1) : NULL;
+                if (threads && !c.pool) {
+                    printf("Unable to start threads\n");
+                    break;
+                }
+                double tm = seconds();
+                int found = 0;
+                for (int i = 0; i < FRAMES; i++)
+                    found = cgn_calc_multi_beam(&c, &b, &m);
+                const double elapsed = seconds() - tm;
+                // Spots are ordered by power, it grows with the spot index, see make_spots()
+                double err = 0;
+                for (int i = 0; i < found && i < n*n; i++) {
+                    const int k = n*n - 1 - i;
+                    const double xc = (k % n + 0.5) * w / n + 0.3, yc = (k / n + 0.5) * h / n + 0.7;
+                    err = fmax(err, fmax(fabs(beams[i].xc - xc), fabs(beams[i].yc - yc)));
+                }
+                printf("spots=%d, d=%.0f, threads=%d, found=%d, %.1fms/frame, max center error: %.3f\n",
+                    n*n, d, threads, found, elapsed/FRAMES*1000, err);
+                cgn_pool_free(c.pool);
+            }
+        }
+        c.pool = NULL;
+
+        // Buffers for single beam calculation are ignored, `subtracted` is left here from the other image
+        CgnBeamResult ref[MULTI_MAX];
+        const int found = cgn_calc_multi_beam(&c, &b, &m);
+        memcpy(ref, beams, sizeof(ref));
+        CgnBeamBkgnd bb = b;
+        bb.subtracted = subtracted;
+        bb.sat = sat;
+        bb.warm_start = 0.1;
+        int same = cgn_calc_multi_beam(&c, &bb, &m) == found;
+        for (int i = 0; i < found && i < MULTI_MAX && same; i++)
+            same = beams[i].xc == ref[i].xc && beams[i].yc == ref[i].yc &&
+                beams[i].dx == ref[i].dx && beams[i].dy == ref[i].dy;
+        printf("with buffers of single beam: %s\n", same ? "same" : "DIFFERENT");
+
+        CgnBeamResult r;
+        MEASURE("bkgnd_single", cgn_calc_beam_bkgnd(&c, &b, &r));
+        free(spots);
+    }
+    free(sat);
     free(buf8);
     free(buf16);
     free(subtracted);
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <string.h>
+#include <immintrin.h>
 
 #define sqr(s) ((s)*(s))
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -26,25 +27,344 @@ void cgn_render_beam(CgnBeamRender *b) {
     }
 }
 
-void cgn_render_beam_tilted(CgnBeamRender *b) {
-    memset(b->buf, 0, b->w*b->h);
-    double r2 = sqr(b->dx/2.0);
-    double cos_phi = cos(b->phi * 3.14159265358979323846 / 180.0);
-    double sin_phi = sin(b->phi * 3.14159265358979323846 / 180.0);
-    double el = b->dx / (double)(b->dy);
-    int x_min = -b->dx*0.6, x_max = b->dx*0.6;
-    int y_min = -b->dy*0.6, y_max = b->dy*0.6;
-    double p = b->p;
-    for (int y = y_min; y < y_max; y++) {
-        double y2 = sqr(y*el);
-        for (int x = x_min; x < x_max; x++) {
-            int x1 = b->xc + x*cos_phi - y*sin_phi;
-            int y1 = b->yc + x*sin_phi + y*cos_phi;
-            if (y1 >= 0 && y1 < b->h && x1 >= 0 && x1 < b->w) {
-                double t = 1+ (-2*(sqr(x) + y2)/r2) /5.0;
-                b->buf[y1*b->w + x1] = p * t*t*t*t*t;
-            }
+// Rows of a band are rendered by a single task, bands are small enough
+// for a row to be zeroed and rendered while still in cache
+#define CGN_RENDER_BAND_ROWS 32
+
+// Beam parameters in the form they are used by row kernels
+typedef struct {
+    float xc, yc;
+    float p;
+    float cos_phi, sin_phi;
+    float el2;  // squared ratio of beam widths, y distances are scaled to x ones
+    float k;    // profile factor, t = 1 - k*r^2
+    float a, e; // half-sizes of the beam box along beam axes
+} CgnTiltBeam;
+
+typedef struct {
+    const CgnBeamRender *b;
+    const CgnTiltBeam *beams;
+    int n;
+    uint32_t key; // key of noise of the frame
+} CgnTiltTask;
+
+// Pixels [j1, j2) of the row of distance `dy` from the center along frame axes,
+// `u` and `v` are beam coordinates of pixel `j` and change by (cos, -sin) for each next pixel
+#define cgn_render_span(name, pix_t, store, store1)                             \
+static void cgn_render_span_##name(const CgnTiltBeam *t, float dy, int j1, int j2, pix_t *row) { \
+    const float u0 = (j1 - t->xc)*t->cos_phi + dy*t->sin_phi;                   \
+    const float v0 = -(j1 - t->xc)*t->sin_phi + dy*t->cos_phi;                  \
+    const __m128 vu0 = _mm_set1_ps(u0), vv0 = _mm_set1_ps(v0);                  \
+    const __m128 vc = _mm_set1_ps(t->cos_phi), vs = _mm_set1_ps(t->sin_phi);    \
+    const __m128 vel2 = _mm_set1_ps(t->el2), vk = _mm_set1_ps(t->k);            \
+    const __m128 one = _mm_set1_ps(1), zero = _mm_setzero_ps();                 \
+    const __m128 vp = _mm_set1_ps(t->p);                                        \
+    __m128 idx = _mm_setr_ps(0, 1, 2, 3);                                       \
+    int j = j1;                                                                 \
+    for (; j + 4 <= j2; j += 4) {                                               \
+        const __m128 u = _mm_add_ps(vu0, _mm_mul_ps(idx, vc));                  \
+        const __m128 v = _mm_sub_ps(vv0, _mm_mul_ps(idx, vs));                  \
+        const __m128 r2 = _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(_mm_mul_ps(v, v), vel2)); \
+        const __m128 q = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(r2, vk)), zero); \
+        const __m128 q2 = _mm_mul_ps(q, q);                                     \
+        const __m128 q5 = _mm_mul_ps(_mm_mul_ps(q2, q2), q);                    \
+        store(row + j, _mm_mul_ps(q5, vp));                                     \
+        idx = _mm_add_ps(idx, _mm_set1_ps(4));                                  \
+    }                                                                           \
+    for (; j < j2; j++) {                                                       \
+        const float u = u0 + (j - j1)*t->cos_phi;                               \
+        const float v = v0 - (j - j1)*t->sin_phi;                               \
+        const float q = max(1 - (u*u + v*v*t->el2)*t->k, 0);                    \
+        const float q2 = q*q;                                                   \
+        store1(row[j], (pix_t)(q2*q2*q*t->p));                                  \
+    }                                                                           \
+}
+
+#define CGN_STORE_U8(p, a) {                                                    \
+    const __m128i v_ = (a);                                                     \
+    const int px_ = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(v_, v_), v_)); \
+    memcpy(p, &px_, sizeof(px_)); }
+#define CGN_STORE_U16(p, a) {                                                   \
+    const __m128i v_ = (a);                                                     \
+    _mm_storel_epi64((__m128i*)(p), _mm_packus_epi32(v_, v_)); }
+#define CGN_TRUNC_U8(p, a) CGN_STORE_U8(p, _mm_cvttps_epi32(a))
+#define CGN_TRUNC_U16(p, a) CGN_STORE_U16(p, _mm_cvttps_epi32(a))
+
+#define CGN_ADD_F32(p, a) _mm_storeu_ps(p, _mm_add_ps(_mm_loadu_ps(p), a))
+#define CGN_SET1(d, x) (d) = (x)
+#define CGN_ADD1(d, x) (d) += (x)
+
+cgn_render_span(uint8_t, uint8_t, CGN_TRUNC_U8, CGN_SET1)
+cgn_render_span(uint16_t, uint16_t, CGN_TRUNC_U16, CGN_SET1)
+cgn_render_span(float, float, _mm_storeu_ps, CGN_SET1)
+cgn_render_span(add, float, CGN_ADD_F32, CGN_ADD1)
+
+// Summed profiles of overlapping beams are truncated into pixels and clamped to the range
+#define cgn_render_clamp(pix_t, store)                                          \
+static void cgn_render_clamp_##pix_t(const float *src, int j1, int j2, float top, pix_t *row) { \
+    const __m128 vtop = _mm_set1_ps(top);                                       \
+    int j = j1;                                                                 \
+    for (; j + 4 <= j2; j += 4)                                                 \
+        store(row + j, _mm_min_ps(_mm_loadu_ps(src + j), vtop));                \
+    for (; j < j2; j++)                                                         \
+        row[j] = (pix_t)min(src[j], top);                                       \
+}
+
+cgn_render_clamp(uint8_t, CGN_TRUNC_U8)
+cgn_render_clamp(uint16_t, CGN_TRUNC_U16)
+
+// Counter-based generator, "lowbias32" hash by Chris Wellons,
+// so noise of any pixel depends only on the seed, the frame number and the pixel index
+static inline uint32_t cgn_hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline __m128i cgn_hash32x4(__m128i x) {
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0x7feb352d));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(0x846ca68b));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    return x;
+}
+
+// Sum of four bytes of a hash is nearly normal, its mean is 4*255/2 and deviation is sqrt(4*(256^2-1)/12),
+// tails are cut at 3.45 deviations, which is fine for noise and costs a single hash per pixel
+#define CGN_NORMAL_MEAN 510.0f
+#define CGN_NORMAL_SCALE (1.0f/147.7996f)
+
+// Normal value of counter `k` under `key`, the same as noise of pixel `k` gets
+static inline float cgn_normal(uint32_t key, uint32_t k) {
+    const uint32_t h = cgn_hash32(k ^ key);
+    const uint32_t h2 = (h & 0x00FF00FF) + ((h >> 8) & 0x00FF00FF);
+    return ((float)(int)((h2 & 0xFFFF) + (h2 >> 16)) - CGN_NORMAL_MEAN) * CGN_NORMAL_SCALE;
+}
+
+// Pixels [j1, j2) of the row `i` are `src` values with noise added, rounded to nearest and clamped
+// to the range. Without `src` it is the background, where the deviation is of the read noise only.
+#define cgn_render_noisy(pix_t, store)                                          \
+static void cgn_render_noisy_##pix_t(const CgnTiltTask *t, const float *src, int i, int j1, int j2, pix_t *row) { \
+    const CgnBeamRender *b = t->b;                                              \
+    const CgnRenderNoise *n = b->noise;                                         \
+    const int16_t *pattern = n->pattern ? n->pattern + i*b->w : NULL;           \
+    const float top = (1 << b->bpp) - 1;                                        \
+    const float read2 = n->read * n->read;                                      \
+    const __m128i key = _mm_set1_epi32(t->key);                                 \
+    const __m128i lo8 = _mm_set1_epi32(0x00FF00FF);                             \
+    const __m128i lo16 = _mm_set1_epi32(0xFFFF);                                \
+    const __m128 vmean = _mm_set1_ps(CGN_NORMAL_MEAN);                          \
+    const __m128 vscale = _mm_set1_ps(CGN_NORMAL_SCALE);                        \
+    const __m128 vgain = _mm_set1_ps(n->gain), vread2 = _mm_set1_ps(read2);     \
+    const __m128 vread = _mm_set1_ps(n->read);                                  \
+    const __m128 vdark = _mm_set1_ps(n->dark);                                  \
+    const __m128 vtop = _mm_set1_ps(top), zero = _mm_setzero_ps();              \
+    __m128i ctr = _mm_add_epi32(_mm_set1_epi32(i*b->w + j1), _mm_setr_epi32(0, 1, 2, 3)); \
+    int j = j1;                                                                 \
+    for (; j + 4 <= j2; j += 4) {                                               \
+        const __m128i h = cgn_hash32x4(_mm_xor_si128(ctr, key));                \
+        const __m128i h2 = _mm_add_epi32(_mm_and_si128(h, lo8), _mm_and_si128(_mm_srli_epi32(h, 8), lo8)); \
+        const __m128i sum = _mm_add_epi32(_mm_and_si128(h2, lo16), _mm_srli_epi32(h2, 16)); \
+        const __m128 g = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(sum), vmean), vscale); \
+        const __m128 s = src ? _mm_loadu_ps(src + j) : zero;                    \
+        const __m128 sigma = src ? _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(s, vgain), vread2)) : vread; \
+        __m128 v = _mm_add_ps(_mm_add_ps(s, vdark), _mm_mul_ps(sigma, g));      \
+        if (pattern)                                                            \
+            v = _mm_add_ps(v, _mm_cvtepi32_ps(_mm_cvtepi16_epi32(               \
+                _mm_loadl_epi64((const __m128i*)(pattern + j)))));              \
+        v = _mm_min_ps(_mm_max_ps(v, zero), vtop);                              \
+        store(row + j, _mm_cvtps_epi32(v));                                     \
+        ctr = _mm_add_epi32(ctr, _mm_set1_epi32(4));                            \
+    }                                                                           \
+    for (; j < j2; j++) {                                                       \
+        const float g = cgn_normal(t->key, i*b->w + j);                         \
+        const float s = src ? src[j] : 0;                                       \
+        float v = s + n->dark + (src ? sqrtf(s*n->gain + read2) : n->read) * g; \
+        if (pattern)                                                            \
+            v += pattern[j];                                                    \
+        row[j] = (pix_t)lrintf(min(max(v, 0), top));                            \
+    }                                                                           \
+}
+
+cgn_render_noisy(uint8_t, CGN_STORE_U8)
+cgn_render_noisy(uint16_t, CGN_STORE_U16)
+
+// Range of `x` where |x*k + c| < a, all or nothing when `k` is about zero
+static void cgn_render_slab(float k, float c, float a, float *x1, float *x2) {
+    if (fabsf(k) < 1e-6f) {
+        if (fabsf(c) >= a) {
+            *x1 = 1;
+            *x2 = 0;
+        }
+        return;
+    }
+    float t1 = (-a - c)/k, t2 = (a - c)/k;
+    if (t1 > t2) {
+        const float tmp = t1; t1 = t2; t2 = tmp;
+    }
+    *x1 = max(*x1, t1);
+    *x2 = min(*x2, t2);
+}
+
+// Pixels [j1, j2) of row `i` inside the beam box are where both beam coordinates are inside of it
+static void cgn_render_beam_span(const CgnTiltBeam *t, int i, int w, int *j1, int *j2) {
+    const float dy = i - t->yc;
+    float x1 = -t->xc, x2 = w - t->xc;
+    cgn_render_slab(t->cos_phi, dy*t->sin_phi, t->a, &x1, &x2);
+    cgn_render_slab(-t->sin_phi, dy*t->cos_phi, t->e, &x1, &x2);
+    *j1 = *j2 = 0;
+    if (x1 < x2) {
+        *j1 = max((int)ceilf(x1 + t->xc), 0);
+        *j2 = max(*j1, min((int)floorf(x2 + t->xc) + 1, w));
+    }
+}
+
+// Row `i` of the frame, `tmp` is a float row when there is noise or the number of beams is not 1.
+// Profiles of several beams are summed in the float row over the union of their spans.
+#define cgn_render_row(pix_t)                                                   \
+static void cgn_render_row_##pix_t(const CgnTiltTask *t, int i, float *tmp, pix_t *row) { \
+    const CgnBeamRender *b = t->b;                                              \
+    int j1 = 0, j2 = 0;                                                         \
+    if (t->n == 1) {                                                            \
+        cgn_render_beam_span(t->beams, i, b->w, &j1, &j2);                      \
+        if (!b->noise) {                                                        \
+            memset(row, 0, j1*sizeof(pix_t));                                   \
+            cgn_render_span_##pix_t(t->beams, i - t->beams->yc, j1, j2, row);   \
+            memset(row + j2, 0, (b->w - j2)*sizeof(pix_t));                     \
+            return;                                                             \
+        }                                                                       \
+        cgn_render_span_float(t->beams, i - t->beams->yc, j1, j2, tmp);         \
+    } else {                                                                    \
+        int s1[t->n > 0 ? t->n : 1], s2[t->n > 0 ? t->n : 1];                   \
+        j1 = b->w;                                                              \
+        for (int k = 0; k < t->n; k++) {                                        \
+            cgn_render_beam_span(t->beams + k, i, b->w, s1 + k, s2 + k);        \
+            if (s1[k] < s2[k]) {                                                \
+                j1 = min(j1, s1[k]);                                            \
+                j2 = max(j2, s2[k]);                                            \
+            }                                                                   \
+        }                                                                       \
+        j1 = min(j1, j2);                                                       \
+        memset(tmp + j1, 0, (j2 - j1)*sizeof(float));                          \
+        for (int k = 0; k < t->n; k++)                                          \
+            cgn_render_span_add(t->beams + k, i - t->beams[k].yc, s1[k], s2[k], tmp); \
+    }                                                                           \
+    if (b->noise) {                                                             \
+        /* Noise is added to the background as well */                          \
+        cgn_render_noisy_##pix_t(t, NULL, i, 0, j1, row);                       \
+        cgn_render_noisy_##pix_t(t, tmp, i, j1, j2, row);                       \
+        cgn_render_noisy_##pix_t(t, NULL, i, j2, b->w, row);                    \
+        return;                                                                 \
+    }                                                                           \
+    memset(row, 0, j1*sizeof(pix_t));                                           \
+    cgn_render_clamp_##pix_t(tmp, j1, j2, (1 << b->bpp) - 1, row);              \
+    memset(row + j2, 0, (b->w - j2)*sizeof(pix_t));                             \
+}
+
+cgn_render_row(uint8_t)
+cgn_render_row(uint16_t)
+
+// Mono10g40: high 8 bits of 4 pixels, then a byte of their low 2 bits, the first pixel in the lowest ones
+static void cgn_pack_10g40(const uint16_t *p, int w, uint8_t *b) {
+    for (int j = 0; j + 4 <= w; j += 4, b += 5, p += 4) {
+        b[0] = p[0] >> 2;
+        b[1] = p[1] >> 2;
+        b[2] = p[2] >> 2;
+        b[3] = p[3] >> 2;
+        b[4] = (p[0] & 3) | (p[1] & 3) << 2 | (p[2] & 3) << 4 | (p[3] & 3) << 6;
+    }
+}
+
+// Mono12g24: high 8 bits of 2 pixels, then a byte of their low 4 bits, the first pixel in the lower nibble
+static void cgn_pack_12g24(const uint16_t *p, int w, uint8_t *b) {
+    for (int j = 0; j + 2 <= w; j += 2, b += 3, p += 2) {
+        b[0] = p[0] >> 4;
+        b[1] = p[1] >> 4;
+        b[2] = (p[0] & 15) | (p[1] & 15) << 4;
+    }
+}
+
+int cgn_render_row_bytes(const CgnBeamRender *b) {
+    switch (b->packing) {
+    case CGN_RENDER_10G40: return b->w/4*5;
+    case CGN_RENDER_12G24: return b->w/2*3;
+    default: return b->bpp > 8 ? b->w*2 : b->w;
+    }
+}
+
+static void cgn_render_band(void *ctx, int band) {
+    const CgnTiltTask *t = ctx;
+    const CgnBeamRender *b = t->b;
+    const int i1 = band * CGN_RENDER_BAND_ROWS;
+    const int i2 = min(i1 + CGN_RENDER_BAND_ROWS, b->h);
+    const int stride = cgn_render_row_bytes(b);
+    float tmp[b->noise || t->n != 1 ? b->w : 1];
+    uint16_t unpacked[b->packing ? b->w : 1];
+    for (int i = i1; i < i2; i++) {
+        uint8_t *row = b->buf + i*stride;
+        if (b->packing) {
+            // The row is rendered as 16-bit one while it is in cache and then packed into the frame
+            cgn_render_row_uint16_t(t, i, tmp, unpacked);
+            if (b->packing == CGN_RENDER_10G40)
+                cgn_pack_10g40(unpacked, b->w, row);
+            else cgn_pack_12g24(unpacked, b->w, row);
         }
+        else if (b->bpp > 8)
+            cgn_render_row_uint16_t(t, i, tmp, (uint16_t*)row);
+        else cgn_render_row_uint8_t(t, i, tmp, row);
+    }
+}
+
+static void cgn_tilt_beam(const CgnRenderBeam *r, CgnTiltBeam *t) {
+    t->xc = r->xc;
+    t->yc = r->yc;
+    t->p = r->p;
+    t->cos_phi = cos(r->phi * 3.14159265358979323846 / 180.0);
+    t->sin_phi = sin(r->phi * 3.14159265358979323846 / 180.0);
+    t->el2 = sqr(r->dx / (double)(r->dy));
+    t->k = 2.0 / sqr(r->dx/2.0) / 5.0;
+    t->a = r->dx*0.6;
+    t->e = r->dy*0.6;
+}
+
+static void cgn_render_tilted(CgnBeamRender *b, const CgnTiltBeam *beams, int n) {
+    CgnTiltTask t;
+    t.b = b;
+    t.beams = beams;
+    t.n = n;
+    t.key = b->noise ? cgn_hash32(b->noise->seed ^ cgn_hash32(b->frame)) : 0;
+    const int bands = (b->h + CGN_RENDER_BAND_ROWS - 1) / CGN_RENDER_BAND_ROWS;
+    if (b->run)
+        b->run(b->pool, cgn_render_band, &t, bands);
+    else for (int i = 0; i < bands; i++)
+        cgn_render_band(&t, i);
+}
+
+void cgn_render_beam_tilted(CgnBeamRender *b) {
+    const CgnRenderBeam r = { b->dx, b->dy, b->xc, b->yc, b->p, b->phi };
+    CgnTiltBeam t;
+    cgn_tilt_beam(&r, &t);
+    cgn_render_tilted(b, &t, 1);
+}
+
+void cgn_render_beams(CgnBeamRender *b, const CgnRenderBeam *beams, int n) {
+    CgnTiltBeam t[n > 0 ? n : 1];
+    for (int k = 0; k < n; k++)
+        cgn_tilt_beam(beams + k, t + k);
+    cgn_render_tilted(b, t, n);
+}
+
+void cgn_render_pattern(int w, int h, uint32_t seed, float pixel, float column, int16_t *pattern) {
+    const uint32_t key = cgn_hash32(seed);
+    const uint32_t col_key = cgn_hash32(~seed);
+    for (int j = 0; j < w; j++) {
+        const float col = column * cgn_normal(col_key, j);
+        for (int i = 0; i < h; i++)
+            pattern[i*w + j] = lrintf(col + pixel * cgn_normal(key, i*w + j));
     }
 }
 
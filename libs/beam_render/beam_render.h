@@ -7,6 +7,43 @@
 extern "C" {
 #endif
 
+typedef void (*CgnRenderTask)(void *ctx, int index);
+
+// Runs `task(ctx, i)` for each i in [0, count) and waits for all of them, e.g. cgn_pool_run() of beam_calc.
+typedef void (*CgnRenderRun)(void *pool, CgnRenderTask task, void *ctx, int count);
+
+// Sensor noise of rendered frames in pixel values, the same seed and frame number give the same noise.
+// Noise is normal with the variance of `gain*p + read^2`, that is Poisson shot noise of `p/gain` electrons
+// approximated by the normal one and Gaussian read noise, then the dark offset and the fixed pattern are added.
+typedef struct {
+    uint32_t seed;
+    float gain;     // pixel values per electron, 0 for no shot noise
+    float read;     // deviation of read noise
+    float dark;     // dark offset of all pixels
+    const int16_t *pattern; // optional fixed pattern of `w*h` offsets, see cgn_render_pattern()
+} CgnRenderNoise;
+
+// Packed pixel formats of IDS cameras, the same values as CGN_PACKED_* of beam_calc.
+enum {
+    CGN_RENDER_UNPACKED,
+
+    // Mono10g40: 4 pixels in 5 bytes, `bpp` is 10 and `w` is a multiple of 4.
+    CGN_RENDER_10G40,
+
+    // Mono12g24: 2 pixels in 3 bytes, `bpp` is 12 and `w` is a multiple of 2.
+    CGN_RENDER_12G24,
+};
+
+// Beam of cgn_render_beams(), the same parameters as those of CgnBeamRender
+typedef struct {
+    int dx;
+    int dy;
+    int xc;
+    int yc;
+    int p;
+    int phi;
+} CgnRenderBeam;
+
 typedef struct {
     int w;
     int h;
@@ -17,10 +54,39 @@ typedef struct {
     int p;
     int phi;
     unsigned char *buf;
+
+    // Pixels of cgn_render_beam_tilted() are bytes for 8 bits and 16-bit values for more,
+    // `p` is the peak value then and must fit into `bpp` bits.
+    int bpp;
+
+    // Optional packing of cgn_render_beam_tilted(), rows are cgn_render_row_bytes() long
+    int packing;
+
+    // Optional runner of row bands of cgn_render_beam_tilted() in parallel,
+    // bands are rendered one by one in the calling thread when it is NULL.
+    CgnRenderRun run;
+    void *pool;
+
+    // Optional noise of cgn_render_beam_tilted(), pixels are rounded and clamped to the range of `bpp` then.
+    const CgnRenderNoise *noise;
+    uint32_t frame;
 } CgnBeamRender;
 
 void cgn_render_beam(CgnBeamRender *b);
+
+// Each pixel of the frame is written once, those in the rotated box of the beam
+// are mapped back into the beam axes and take the profile value there, others are zeroed.
 void cgn_render_beam_tilted(CgnBeamRender *b);
+
+// Renders `n` beams into the frame of `b` in the same single pass, the beam of `b` itself is not used.
+// Overlapping beams are summed and clamped to the range, there is only the background when `n` is 0.
+void cgn_render_beams(CgnBeamRender *b, const CgnRenderBeam *beams, int n);
+
+// Length of frame rows of cgn_render_beam_tilted() in bytes
+int cgn_render_row_bytes(const CgnBeamRender *b);
+
+// Makes fixed pattern offsets of normal deviations `pixel` of each pixel and `column` of each column.
+void cgn_render_pattern(int w, int h, uint32_t seed, float pixel, float column, int16_t *pattern);
 void cgn_render_beam_to_doubles(CgnBeamRender *b, double *d);
 double cgn_find_max_8(const uint8_t *b, int sz);
 double cgn_find_max_16(const uint16_t *b, int sz);
@@ -4,6 +4,8 @@
 #include "tools/OriSettings.h"
 
 #include <QApplication>
+#include <QDir>
+#include <QFileInfo>
 #include <QLabel>
 
 using namespace Ori::Dlg;
@@ -46,6 +48,7 @@ bool Camera::editConfig(int page)
         ConfigPage(cfgBgnd, qApp->tr("Background"), ":/toolbar/beam").withSpacing(12),
         ConfigPage(cfgRoi, qApp->tr("ROI"), ":/toolbar/roi").withSpacing(12)
             .withLongTitle(qApp->tr("Region of Interest")),
+        ConfigPage(cfgCalc, qApp->tr("Calculation"), ":/toolbar/options").withSpacing(12),
     };
     auto hardScale = sensorScale();
     bool useSensorScale = !_config.plot.customScale.on;
@@ -84,6 +87,21 @@ bool Camera::editConfig(int page)
             ->withHint(qApp->tr("ISO 11146 recommends 2-4"), false),
         (new ConfigItemReal(cfgBgnd, qApp->tr("Mask Diameter"), &_config.bgnd.mask))
             ->withHint(qApp->tr("ISO 11146 recommends 3"), false),
+        new ConfigItemSpace(cfgBgnd, 12),
+        (new ConfigItemBool(cfgBgnd, qApp->tr("Subtract dark frame"), &_config.bgnd.dark))
+            ->withHint(qApp->tr(
+                "Use the menu command <b>Camera ► Record Dark Frame</b> "
+                "to record it with the sensor covered"), true),
+        (new ConfigItemBool(cfgBgnd, qApp->tr("Apply flat field"), &_config.bgnd.flat))
+            ->withHint(qApp->tr(
+                "Use the menu command <b>Camera ► Record Flat Field</b> "
+                "to record it under uniform illumination"), true),
+        (new ConfigItemInt(cfgBgnd, qApp->tr("Frames to average"), &_config.bgnd.darkFrames))
+            ->withMinMax(1, 1000),
+        (new ConfigItemBool(cfgBgnd, qApp->tr("Replace defect pixels"), &_config.bgnd.defects))
+            ->withHint(qApp->tr(
+                "Hot pixels are found when recording dark frame, dead ones when recording flat field. "
+                "They are replaced by their neighbours before calculation"), true),
 
         (new ConfigItemBool(cfgRoi, qApp->tr("Use region"), &_config.roi.on))
             ->withHint(qApp->tr(
@@ -97,7 +115,38 @@ bool Camera::editConfig(int page)
         (new ConfigItemInt(cfgRoi, qApp->tr("Right"), &_config.roi.x2))
             ->withMinMax(0, width()),
         (new ConfigItemInt(cfgRoi, qApp->tr("Bottom"), &_config.roi.y2))
-            ->withMinMax(0, height())
+            ->withMinMax(0, height()),
+
+        (new ConfigItemInt(cfgCalc, qApp->tr("Worker threads"), &_config.calc.threads))
+            ->withMinMax(0, 64)
+            ->withHint(qApp->tr("Zero means calculation in the camera thread"), false),
+        (new ConfigItemInt(cfgCalc, qApp->tr("First CPU core"), &_config.calc.firstCpu))
+            ->withMinMax(-1, 255)
+            ->withHint(qApp->tr(
+                "Threads are pinned to consecutive cores starting from this one, "
+                "-1 means not to pin them. Give different cores to cameras "
+                "working simultaneously so they don't compete for them"), true),
+        new ConfigItemSpace(cfgCalc, 12),
+        (new ConfigItemBool(cfgCalc, qApp->tr("Fast background iterations"), &_config.calc.sat))
+            ->withHint(qApp->tr(
+                "Use summed-area tables, so each iteration costs much less than a pass over the frame. "
+                "Useful for large number of iterations"), true),
+        (new ConfigItemBool(cfgCalc, qApp->tr("Start from previous frame"), &_config.calc.warmStart))
+            ->withHint(qApp->tr(
+                "Iterations start from the beam found in the previous frame instead of the whole aperture. "
+                "It falls back to the whole aperture when the beam jumps or changes its size notably"), true),
+        (new ConfigItemInt(cfgCalc, qApp->tr("Coarse estimate downsampling"), &_config.calc.pyramid))
+            ->withMinMax(0, 8)
+            ->withHint(qApp->tr(
+                "Iterations start from the beam found in the frame downsampled 2, 4 or 8 times, zero means off. "
+                "Useful for large sensors when the beam takes a small part of the frame. "
+                "Beams too small for the downsampled frame are calculated from the whole aperture"), true),
+        (new ConfigItemReal(cfgCalc, qApp->tr("Min coarse beam, px"), &_config.calc.pyramidMin))
+            ->withHint(qApp->tr("Beam diameter in downsampled pixels below that the coarse estimate is not used"), false),
+        (new ConfigItemBool(cfgCalc, qApp->tr("Reproducible results"), &_config.calc.deterministic))
+            ->withHint(qApp->tr(
+                "Moments are summed in exact integers, so results are bit-exact between computers "
+                "whatever their processors and number of threads. Fast background iterations are not used then"), true),
     };
     initConfigMore(opts);
     if (ConfigDlg::edit(opts))
@@ -137,6 +186,12 @@ bool Camera::isRoiValid() const
     return _config.roi.isValid(width(), height());
 }
 
+QString Camera::darkFileName() const
+{
+    Ori::Settings s;
+    return QFileInfo(s.settings()->fileName()).dir().filePath(_configGroup + ".dark");
+}
+
 PixelScale Camera::pixelScale() const
 {
     if (!_config.plot.rescale)
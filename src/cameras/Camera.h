@@ -43,18 +43,23 @@ public:
     virtual void requestRawImg(QObject *sender) {}
     virtual void setRawView(bool on, bool reconfig) {}
 
+    /// Averages next frames into the dark frame or flat field and posts DarkEvent to the sender when done.
+    virtual void recordDark(QObject *sender, bool flat) {}
+
     virtual QString customId() const { return {}; }
 
     virtual QList<QPair<int, QString>> dataRows() const { return {}; }
 
     const CameraConfig& config() const { return _config; }
-    enum ConfigPages { cfgPlot, cfgBgnd, cfgRoi, cfgMax };
+    enum ConfigPages { cfgPlot, cfgBgnd, cfgRoi, cfgCalc, cfgMax };
     bool editConfig(int page = -1);
     
     void setAperture(const RoiRect&);
     void toggleAperture(bool on);
     bool isRoiValid() const;
 
+    QString darkFileName() const;
+
     PixelScale pixelScale() const;
     QString resolutionStr() const;
 
@@ -1,7 +1,12 @@
 #include "CameraTypes.h"
 
+#include <QDataStream>
+#include <QFile>
 #include <QSettings>
 
+#include <algorithm>
+#include <iterator>
+
 QString formatSecs(int secs) {
     int h = secs / 3600;
     int m = (secs - h * 3600) / 60;
@@ -35,12 +40,24 @@ void CameraConfig::load(QSettings *s)
     LOAD(bgnd.corner, Double, 0.035);
     LOAD(bgnd.noise, Double, 3);
     LOAD(bgnd.mask, Double, 3);
+    LOAD(bgnd.dark, Bool, false);
+    LOAD(bgnd.flat, Bool, false);
+    LOAD(bgnd.darkFrames, Int, 16);
+    LOAD(bgnd.defects, Bool, false);
 
     LOAD(roi.on, Bool, false);
     LOAD(roi.x1, Int, 0);
     LOAD(roi.y1, Int, 0);
     LOAD(roi.x2, Int, 0);
     LOAD(roi.y2, Int, 0);
+
+    LOAD(calc.threads, Int, 0);
+    LOAD(calc.firstCpu, Int, -1);
+    LOAD(calc.sat, Bool, false);
+    LOAD(calc.warmStart, Bool, false);
+    LOAD(calc.pyramid, Int, 0);
+    LOAD(calc.pyramidMin, Double, 16);
+    LOAD(calc.deterministic, Bool, false);
 }
 
 void CameraConfig::save(QSettings *s, bool min) const
@@ -62,6 +79,12 @@ void CameraConfig::save(QSettings *s, bool min) const
         SAVE(bgnd.noise);
         SAVE(bgnd.mask);
     }
+    SAVE(bgnd.dark);
+    if (!min or bgnd.dark) {
+        SAVE(bgnd.flat);
+        SAVE(bgnd.darkFrames);
+    }
+    SAVE(bgnd.defects);
 
     SAVE(roi.on);
     if (!min or roi.on) {
@@ -70,6 +93,16 @@ void CameraConfig::save(QSettings *s, bool min) const
         SAVE(roi.x2);
         SAVE(roi.y2);
     }
+
+    SAVE(calc.threads);
+    if (!min or calc.threads > 0) {
+        SAVE(calc.firstCpu);
+    }
+    SAVE(calc.sat);
+    SAVE(calc.warmStart);
+    SAVE(calc.pyramid);
+    SAVE(calc.pyramidMin);
+    SAVE(calc.deterministic);
 }
 
 //------------------------------------------------------------------------------
@@ -133,3 +166,71 @@ void RoiRect::fix(int w, int h)
         else y2 = h;
     }
 }
+
+//------------------------------------------------------------------------------
+//                               DarkFrame
+//------------------------------------------------------------------------------
+
+#define DARK_FILE_MAGIC 0x4B524144 // DARK
+#define DARK_FILE_VERSION 2
+
+bool DarkFrame::isValid(int w, int h, int bpp) const
+{
+    return this->w == w && this->h == h && this->bpp == bpp && dark.size() == w*h;
+}
+
+QVector<int32_t> DarkFrame::defects() const
+{
+    QVector<int32_t> v;
+    v.reserve(hot.size() + dead.size());
+    std::set_union(hot.cbegin(), hot.cend(), dead.cbegin(), dead.cend(), std::back_inserter(v));
+    return v;
+}
+
+QString DarkFrame::load(const QString &fileName)
+{
+    QFile f(fileName);
+    if (!f.exists())
+        return QString("Dark frame is not recorded yet");
+    if (!f.open(QIODevice::ReadOnly))
+        return QString("Unable to open dark frame file %1: %2").arg(fileName, f.errorString());
+    QDataStream s(&f);
+    s.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 magic, version;
+    s >> magic >> version;
+    if (magic != DARK_FILE_MAGIC || version < 1 || version > DARK_FILE_VERSION)
+        return QString("Invalid dark frame file %1").arg(fileName);
+    s >> w >> h >> bpp >> level >> dark >> gain;
+    hot.clear();
+    dead.clear();
+    // Defect pixels are stored since version 2
+    if (version >= 2)
+        s >> hot >> dead;
+    auto badIndex = [this](const QVector<int32_t> &v){
+        return std::any_of(v.cbegin(), v.cend(), [this](int32_t k){ return k < 0 || k >= w*h; }) ||
+            !std::is_sorted(v.cbegin(), v.cend());
+    };
+    if (s.status() != QDataStream::Ok || dark.size() != w*h || (!gain.isEmpty() && gain.size() != w*h) ||
+        badIndex(hot) || badIndex(dead)) {
+        dark.clear();
+        gain.clear();
+        hot.clear();
+        dead.clear();
+        return QString("Dark frame file %1 is corrupted").arg(fileName);
+    }
+    return {};
+}
+
+QString DarkFrame::save(const QString &fileName) const
+{
+    QFile f(fileName);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return QString("Unable to create dark frame file %1: %2").arg(fileName, f.errorString());
+    QDataStream s(&f);
+    s.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    s << quint32(DARK_FILE_MAGIC) << quint32(DARK_FILE_VERSION);
+    s << w << h << bpp << level << dark << gain << hot << dead;
+    if (s.status() != QDataStream::Ok)
+        return QString("Unable to write dark frame file %1").arg(fileName);
+    return {};
+}
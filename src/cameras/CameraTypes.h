@@ -3,6 +3,7 @@
 
 #include <QEvent>
 #include <QVariant>
+#include <QVector>
 
 class QSettings;
 
@@ -60,6 +61,67 @@ struct Background
     double corner = 0.035;
     double noise = 3;
     double mask = 3;
+
+    /// Subtract the dark frame recorded for the camera from raw pixels.
+    bool dark = false;
+
+    /// Scale dark-subtracted pixels by flat-field gains recorded for the camera.
+    bool flat = false;
+
+    /// How many frames are averaged when recording dark frame or flat field.
+    int darkFrames = 16;
+
+    /// Replace hot and dead pixels found when recording dark frame and flat field by their neighbours.
+    bool defects = false;
+};
+
+/// Dark frame and flat-field gains of a camera, stored in a file next to the settings.
+struct DarkFrame
+{
+    int w = 0;
+    int h = 0;
+    int bpp = 0;
+    int level = 0;
+    QVector<uint16_t> dark;
+    QVector<float> gain;
+
+    /// Sorted indices of hot pixels found in the dark frame and of dead ones found in the flat field.
+    QVector<int32_t> hot;
+    QVector<int32_t> dead;
+
+    bool isValid(int w, int h, int bpp) const;
+    bool hasGain() const { return gain.size() == dark.size() && !gain.isEmpty(); }
+    QVector<int32_t> defects() const;
+    QString load(const QString &fileName);
+    QString save(const QString &fileName) const;
+};
+
+struct CalcOptions
+{
+    /// Zero means calculation in the camera thread.
+    int threads = 0;
+
+    /// Worker threads are pinned to consecutive cores starting from this one.
+    /// Negative value means not to pin them.
+    int firstCpu = -1;
+
+    /// Take moments of mask iterations from summed-area tables.
+    bool sat = false;
+
+    /// Start mask iterations from the result of the previous frame.
+    bool warmStart = false;
+
+    /// Downsampling factor of the coarse beam estimate on cold starts, 2, 4 or 8.
+    /// Zero means to start from the whole aperture at full resolution.
+    int pyramid = 0;
+
+    /// Min beam diameter in downsampled pixels for that the coarse estimate is used,
+    /// smaller beams are calculated from the whole aperture.
+    double pyramidMin = 16;
+
+    /// Accumulate moments in exact integer sums, so results are bit-exact
+    /// between machines whatever their SIMD level and number of threads.
+    bool deterministic = false;
 };
 
 struct PlotOptions
@@ -75,6 +137,7 @@ struct CameraConfig
     PlotOptions plot;
     Background bgnd;
     RoiRect roi;
+    CalcOptions calc;
 
     void load(QSettings *s);
     void save(QSettings *s, bool min=false) const;
@@ -90,7 +153,7 @@ struct CameraStats
 struct CamTableData
 {
     QVariant value;
-    enum { NONE, MS, COUNT } type = MS;
+    enum { NONE, MS, COUNT, PERCENT } type = MS;
     bool warn = false;
 };
 
@@ -100,6 +163,17 @@ public:
     BrightEvent() : QEvent(QEvent::User) {}
 
     double level;
+    double saturated;
+    bool clipped;
+};
+
+class DarkEvent : public QEvent
+{
+public:
+    DarkEvent() : QEvent(QEvent::User) {}
+
+    bool flat;
+    QString error;
 };
 
 #endif // CAMERA_TYPES_H
@@ -20,6 +20,14 @@
 #define MEASURE_BUF_SIZE 1000
 #define MEASURE_BUF_COUNT 2
 
+// Beam changes relative to its diameter when the previous frame is not good for a warm start
+#define WARM_START_JUMP 0.1
+
+// Hot pixels are brighter than the median of dark frame by this number of noise deviations
+#define DEFECT_NOISE 6
+// Dead pixels respond to flat illumination less than this fraction of the median response
+#define DEFECT_RESPONSE 0.3
+
 class CameraWorker
 {
 public:
@@ -52,7 +60,34 @@ public:
     bool reconfig = false;
 
     double *graph;
-    QVector<double> subtracted;
+    QVector<double> sat;
+    QVector<int32_t> pyramid;
+
+    // Packed frames are only unpacked when raw pixels are needed
+    CgnBeamCalc unpacked;
+    QVector<uint16_t> unpackedBuf;
+    bool unpackedValid = false;
+
+    // Histogram of the current frame serves all statistics of raw pixels in a single pass
+    CgnBeamHist hist;
+    QVector<uint32_t> histBins;
+    bool histValid = false;
+
+    // Exposure level of the ROI taken from every frame
+    CgnBeamBright bright;
+
+    // Dark frame and flat field of the camera, frames being recorded are averaged into `darkMean`
+    DarkFrame dark;
+    QString darkFile;
+    QVector<float> darkMean;
+    int darkCount = 0;
+    int darkTarget = 0;
+    bool darkFlat = false;
+    QVector<int32_t> defects;
+
+    CgnBeamPool *pool = nullptr;
+    int poolThreads = 0;
+    int poolCpu = -1;
 
     MeasureSaver *saver = nullptr;
     QMutex saverMutex;
@@ -66,6 +101,7 @@ public:
     qint64 saveImgInterval = 0;
     QObject *rawImgRequest = nullptr;
     QObject *brightRequest = nullptr;
+    QObject *darkRequest = nullptr;
 
     QMap<QString, QVariant> stats;
     std::function<QMap<int, CamTableData>()> tableData;
@@ -80,6 +116,12 @@ public:
         resultBufs[0] = resultBuf1.data();
         resultBufs[1] = resultBuf2.data();
         results = resultBufs[0];
+        memset(&c, 0, sizeof(CgnBeamCalc));
+    }
+
+    ~CameraWorker()
+    {
+        cgn_pool_free(pool);
     }
 
     void configure()
@@ -110,13 +152,64 @@ public:
             r.x2 = c.w;
             r.y2 = c.h;
         }
+        bright.x1 = r.x1;
+        bright.y1 = r.y1;
+        bright.x2 = r.x2;
+        bright.y2 = r.y2;
         subtract = cfg.bgnd.on;
+        // The background is subtracted on the fly while calculating moments,
+        // and the subtracted image is only made in showResults()
         if (subtract) {
-            subtracted = QVector<double>(c.w*c.h);
-            g.subtracted = subtracted.data();
+            if (cfg.calc.sat) {
+                sat = QVector<double>(cgn_sat_size(c.w, c.h));
+                g.sat = sat.data();
+            }
+            // `r` keeps the result of the previous frame between calls
+            if (cfg.calc.warmStart)
+                g.warm_start = WARM_START_JUMP;
+            if (cfg.calc.pyramid > 1) {
+                pyramid = QVector<int32_t>(cgn_pyramid_size(c.w, c.h, cfg.calc.pyramid));
+                g.pyramid = cfg.calc.pyramid;
+                g.pyramid_buf = pyramid.data();
+                g.pyramid_min = cfg.calc.pyramidMin;
+            }
         }
         normalize = cfg.plot.normalize;
         fullRange = cfg.plot.fullRange;
+
+        // Threads are only restarted when their number or cores change
+        if (cfg.calc.threads != poolThreads || cfg.calc.firstCpu != poolCpu) {
+            cgn_pool_free(pool);
+            pool = nullptr;
+            if (cfg.calc.threads > 0) {
+                pool = cgn_pool_create(cfg.calc.threads, cfg.calc.firstCpu);
+                if (!pool)
+                    qWarning() << logId << "Unable to start calculation threads";
+            }
+            poolThreads = cfg.calc.threads;
+            poolCpu = cfg.calc.firstCpu;
+        }
+        c.pool = pool;
+        c.deterministic = cfg.calc.deterministic;
+
+        // Correction is made in the same passes that read pixels, there is no corrected frame
+        darkFile = camera->darkFileName();
+        if ((cfg.bgnd.dark || cfg.bgnd.defects) && !dark.isValid(c.w, c.h, c.bpp)) {
+            if (auto err = dark.load(darkFile); !err.isEmpty())
+                qWarning() << logId << err;
+        }
+        if (cfg.bgnd.dark && dark.isValid(c.w, c.h, c.bpp)) {
+            c.dark = dark.dark.constData();
+            c.dark_level = dark.level;
+            c.gain = cfg.bgnd.flat && dark.hasGain() ? dark.gain.constData() : nullptr;
+        } else {
+            c.dark = nullptr;
+            c.gain = nullptr;
+        }
+        if (cfg.bgnd.defects && dark.isValid(c.w, c.h, c.bpp))
+            defects = dark.defects();
+        else defects.clear();
+        darkTarget = cfg.bgnd.darkFrames;
     }
 
     void reconfigure()
@@ -146,37 +239,85 @@ public:
         avgCalcTime = avgCalcTime*0.9 + (timer.elapsed() - tm)*0.1;
     }
 
+    const CgnBeamCalc& rawFrame()
+    {
+        if (!c.packing)
+            return c;
+        if (!unpackedValid) {
+            unpackedBuf.resize(c.w*c.h);
+            cgn_unpack_u16(&c, unpackedBuf.data());
+            unpacked = c;
+            unpacked.buf = (uint8_t*)unpackedBuf.data();
+            unpacked.packing = CGN_UNPACKED;
+            unpackedValid = true;
+        }
+        return unpacked;
+    }
+
+    const CgnBeamHist& frameHist()
+    {
+        if (!histValid) {
+            histBins.resize(cgn_hist_size(c.bpp));
+            hist.bins = histBins.data();
+            hist.x1 = 0;
+            hist.y1 = 0;
+            hist.x2 = c.w;
+            hist.y2 = c.h;
+            cgn_calc_hist(&c, &hist);
+            histValid = true;
+        }
+        return hist;
+    }
+
     inline void calcResult()
     {
+        unpackedValid = false;
+        histValid = false;
         if (!rawView) {
+            // Only listed pixels are replaced right in the frame, passes over it don't check for defects.
+            // Frames being recorded into dark frame or flat field keep their defects to be found there
+            if (!defects.isEmpty() && !darkRequest)
+                cgn_fix_defects(&c, defects.constData(), defects.size());
             if (subtract) {
                 cgn_calc_beam_bkgnd(&c, &g, &r);
             } else {
                 cgn_calc_beam_naive(&c, &r);
             }
         }
+        cgn_calc_bright(&c, &bright);
 
         saverMutex.lock();
         if (rawImgRequest) {
             auto e = new ImageEvent;
             e->time = 0;
-            e->buf = QByteArray((const char*)c.buf, c.w*c.h*(c.bpp > 8 ? 2 : 1));
+            auto &u = rawFrame();
+            e->buf = QByteArray((const char*)u.buf, u.w*u.h*(u.bpp > 8 ? 2 : 1));
             QCoreApplication::postEvent(rawImgRequest, e);
             rawImgRequest = nullptr;
         }
         if (brightRequest) {
             auto e = new BrightEvent;
-            e->level = cgn_calc_brightness(&c);
+            e->level = bright.brightness;
+            e->saturated = bright.saturated;
+            e->clipped = bright.clipped;
             QCoreApplication::postEvent(brightRequest, e);
             brightRequest = nullptr;
         }
+        if (darkRequest) {
+            if (darkCount == 0)
+                darkMean.resize(c.w*c.h);
+            cgn_mean_add(&c, darkMean.data(), darkCount);
+            if (++darkCount >= darkTarget)
+                finishDark();
+        }
         if (!rawView && saver) {
             qint64 time = timer.elapsed();
             if (saveImgInterval > 0 and (prevSaveImg == 0 or time - prevSaveImg >= saveImgInterval)) {
                 prevSaveImg = time;
                 auto e = new ImageEvent;
                 e->time = time;
-                e->buf = QByteArray((const char*)c.buf, c.w*c.h*(c.bpp > 8 ? 2 : 1));
+                auto &u = rawFrame();
+                e->buf = QByteArray((const char*)u.buf, u.w*u.h*(u.bpp > 8 ? 2 : 1));
                 QCoreApplication::postEvent(saver, e);
             }
             results->time = time;
@@ -211,7 +352,8 @@ public:
 
         if (rawView)
         {
-            cgn_copy_to_f64(&c, graph, &g.max);
+            cgn_copy_to_f64(&rawFrame(), graph, nullptr);
+            g.max = frameHist().max;
             plot->invalidateGraph();
             r.nan = true;
             plot->setResult(r, 0, rangeTop);
@@ -221,25 +363,26 @@ public:
 
         if (subtract)
         {
-            if (normalize) {
-                cgn_copy_normalized_f64(g.subtracted, graph, c.w*c.h, g.min,
-                    fullRange ? rangeTop-g.min : g.max);
-            } else
-                memcpy(graph, g.subtracted, sizeof(double)*c.w*c.h);
+            cgn_copy_subtracted_f64(&c, &g, graph);
+            if (normalize)
+                cgn_normalize_f64(graph, c.w*c.h, g.min, fullRange ? rangeTop-g.min : g.max);
         }
         else
         {
+            auto &u = rawFrame();
             if (normalize) {
-                if (c.bpp > 8) {
-                    auto buf = (const uint16_t*)c.buf;
-                    cgn_render_beam_to_doubles_norm_16(buf, c.w*c.h, graph,
-                        fullRange ? rangeTop : cgn_find_max_16(buf, c.w*c.h));
+                if (u.bpp > 8) {
+                    auto buf = (const uint16_t*)u.buf;
+                    cgn_render_beam_to_doubles_norm_16(buf, u.w*u.h, graph,
+                        fullRange ? rangeTop : frameHist().max);
                 } else {
-                    cgn_render_beam_to_doubles_norm_8(c.buf, c.w*c.h, graph,
-                        fullRange ? rangeTop : cgn_find_max_8(c.buf, c.w*c.h));
+                    cgn_render_beam_to_doubles_norm_8(u.buf, u.w*u.h, graph,
+                        fullRange ? rangeTop : frameHist().max);
                 }
-            } else
-                cgn_copy_to_f64(&c, graph, &g.max);
+            } else {
+                cgn_copy_to_f64(&u, graph, nullptr);
+                g.max = frameHist().max;
+            }
         }
         plot->invalidateGraph();
         if (normalize)
@@ -253,6 +396,52 @@ public:
         return true;
     }
 
+    void finishDark()
+    {
+        const int sz = c.w*c.h;
+        auto e = new DarkEvent;
+        e->flat = darkFlat;
+        if (darkFlat) {
+            if (!dark.isValid(c.w, c.h, c.bpp))
+                dark.load(darkFile);
+            if (dark.isValid(c.w, c.h, c.bpp)) {
+                // Dead pixels are replaced in the mean before making gains of it
+                dark.dead.resize(sz);
+                dark.dead.resize(qMax(0, cgn_find_dead(darkMean.data(), dark.dark.constData(),
+                    c.w, c.h, DEFECT_RESPONSE, dark.dead.data())));
+                dark.dead.squeeze();
+                dark.gain.resize(sz);
+                cgn_flat_gain(darkMean.constData(), dark.dark.constData(), sz, dark.gain.data());
+            } else e->error = qApp->tr("Dark frame must be recorded before flat field");
+        } else {
+            // Gains of the previous flat field are still good for the new dark frame
+            if (!dark.isValid(c.w, c.h, c.bpp)) {
+                dark.gain.clear();
+                dark.dead.clear();
+            }
+            // Hot pixels are replaced in the mean, so the reference there matches neighbours replacing them in frames
+            dark.hot.resize(sz);
+            dark.hot.resize(qMax(0, cgn_find_hot(darkMean.data(), c.w, c.h, DEFECT_NOISE, dark.hot.data())));
+            dark.hot.squeeze();
+            dark.w = c.w;
+            dark.h = c.h;
+            dark.bpp = c.bpp;
+            dark.dark.resize(sz);
+            dark.level = cgn_dark_finish(darkMean.constData(), sz, dark.dark.data());
+        }
+        if (e->error.isEmpty())
+            e->error = dark.save(darkFile);
+        QCoreApplication::postEvent(darkRequest, e);
+        darkRequest = nullptr;
+        darkMean.clear();
+        darkMean.squeeze();
+        // Pointers to the reference and defects are taken again
+        c.dark = nullptr;
+        c.gain = nullptr;
+        defects.clear();
+        reconfig = true;
+    }
+
     void startMeasure(MeasureSaver *s)
     {
         saverMutex.lock();
@@ -288,6 +477,15 @@ public:
         saverMutex.unlock();
     }
 
+    void requestDark(QObject *sender, bool flat)
+    {
+        saverMutex.lock();
+        darkRequest = sender;
+        darkFlat = flat;
+        darkCount = 0;
+        saverMutex.unlock();
+    }
+
     void setRawView(bool on, bool reconfig)
     {
         saverMutex.lock();
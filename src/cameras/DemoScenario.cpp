@@ -0,0 +1,127 @@
+#include "DemoScenario.h"
+
+#include <QFile>
+#include <QSettings>
+
+#include <cmath>
+
+// Coordinate moving by `v` from `lo` toward `hi` and bouncing back from them
+static double bounce(double v, double lo, double hi)
+{
+    const double period = 2*(hi - lo);
+    double m = std::fmod(v - lo, period);
+    if (m < 0) m += period;
+    return lo + (m <= hi - lo ? m : period - m);
+}
+
+static DemoScenario::Event loadEvent(QSettings &s, const QString &name)
+{
+    DemoScenario::Event e;
+    e.every = qMax(0, s.value(name + "_every", 0).toInt());
+    e.frames = qMax(0, s.value(name + "_frames", 0).toInt());
+    e.at = qMax(0, s.value(name + "_at", e.every).toInt());
+    return e;
+}
+
+QString DemoScenario::load(const QString &fileName)
+{
+    if (!QFile::exists(fileName))
+        return QString("Scenario file %1 does not exist").arg(fileName);
+    QSettings s(fileName, QSettings::IniFormat);
+    if (s.status() != QSettings::NoError)
+        return QString("Unable to read scenario file %1").arg(fileName);
+
+    s.beginGroup("scenario");
+    seed = s.value("seed", 1).toUInt();
+    frames = qMax(0, s.value("frames", 0).toInt());
+    s.endGroup();
+
+    beams.clear();
+    const auto groups = s.childGroups();
+    for (const auto &group : groups) {
+        if (!group.startsWith("beam"))
+            continue;
+        s.beginGroup(group);
+        Beam b;
+        bool okX, okY;
+        b.xc = s.value("xc").toDouble(&okX);
+        b.yc = s.value("yc").toDouble(&okY);
+        b.dx = s.value("dx", 400).toDouble();
+        b.dy = s.value("dy", b.dx).toDouble();
+        b.phi = s.value("phi", 0).toDouble();
+        b.p = s.value("p", 200).toDouble();
+        b.driftX = s.value("drift_x", 0).toDouble();
+        b.driftY = s.value("drift_y", 0).toDouble();
+        b.jitter = qMax(0.0, s.value("jitter", 0).toDouble());
+        b.step = loadEvent(s, "step");
+        b.stepX = s.value("step_x", 0).toDouble();
+        b.stepY = s.value("step_y", 0).toDouble();
+        b.hop = loadEvent(s, "hop");
+        b.hopScale = s.value("hop_scale", 1).toDouble();
+        b.hopPhi = s.value("hop_phi", 0).toDouble();
+        b.drop = loadEvent(s, "drop");
+        b.burst = loadEvent(s, "burst");
+        b.burstScale = qMax(0.0, s.value("burst_scale", 1).toDouble());
+        s.endGroup();
+        if (!okX || !okY)
+            return QString("Beam %1 of scenario %2 has no position").arg(group, fileName);
+        if (b.dx < 1 || b.dy < 1 || b.dx*b.hopScale < 1 || b.dy*b.hopScale < 1)
+            return QString("Beam %1 of scenario %2 has invalid width").arg(group, fileName);
+        beams << b;
+    }
+    if (beams.isEmpty())
+        return QString("There are no beams in scenario %1").arg(fileName);
+    restart();
+    return {};
+}
+
+void DemoScenario::restart()
+{
+    _frame = 0;
+    _rnd.seed(seed);
+    _jitter.fill(QPointF(), beams.size());
+}
+
+void DemoScenario::next(int w, int h, int scale, QVector<CgnRenderBeam> &out)
+{
+    if (frames > 0 && _frame >= frames)
+        restart();
+    const int f = _frame++;
+    out.clear();
+    for (int i = 0; i < beams.size(); i++) {
+        const Beam &b = beams.at(i);
+
+        // Walk of all beams is taken from the same generator in the same order, even of dropped ones
+        QPointF &j = _jitter[i];
+        if (b.jitter > 0) {
+            const double d = b.jitter / 4.0;
+            j.setX(qBound(-b.jitter, j.x() + (_rnd.generateDouble() - 0.5)*d, b.jitter));
+            j.setY(qBound(-b.jitter, j.y() + (_rnd.generateDouble() - 0.5)*d, b.jitter));
+        }
+        if (b.drop.on(f))
+            continue;
+
+        double xc = bounce(b.xc + b.driftX*f, 0, w - 1) + j.x();
+        double yc = bounce(b.yc + b.driftY*f, 0, h - 1) + j.y();
+        double dx = b.dx, dy = b.dy, phi = b.phi, p = b.p;
+        if (b.step.on(f)) {
+            xc += b.stepX;
+            yc += b.stepY;
+        }
+        if (b.hop.on(f)) {
+            dx *= b.hopScale;
+            dy *= b.hopScale;
+            phi += b.hopPhi;
+        }
+        if (b.burst.on(f))
+            p *= b.burstScale;
+        out << CgnRenderBeam {
+            .dx = qRound(dx),
+            .dy = qRound(dy),
+            .xc = qRound(xc),
+            .yc = qRound(yc),
+            .p = qRound(p*scale),
+            .phi = qRound(phi),
+        };
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef DEMO_SCENARIO_H
+#define DEMO_SCENARIO_H
+
+#include "beam_render.h"
+
+#include <QPointF>
+#include <QRandomGenerator>
+#include <QString>
+#include <QVector>
+
+/// Scripted beams of the demo camera loaded from an INI file.
+///
+/// The [scenario] section has `seed` of jitter and sensor noise and `frames`, the length of the loop,
+/// zero means no loop. Each section whose name starts with "beam" is a beam:
+/// `xc`, `yc`, `dx`, `dy` and `phi` of its start in pixels and degrees, `p` peak in 8-bit pixel values,
+/// `drift_x` and `drift_y` in pixels per frame, the beam bounces off frame edges,
+/// `jitter` is the max deviation of a random walk around the trajectory.
+///
+/// Periodic events are given by `<event>_every` frames of period, `<event>_frames` of duration
+/// and `<event>_at` of the first one, which is one period by default:
+/// `step` shifts the beam by `step_x` and `step_y`,
+/// `hop` is a mode hop scaling widths by `hop_scale` and turning the beam by `hop_phi`,
+/// `drop` removes the beam from frames,
+/// `burst` scales the peak by `burst_scale`, pixels are clamped, so bursts over 1 saturate.
+///
+/// Beams only depend on the frame number and the seed, so runs are the same every time.
+class DemoScenario
+{
+public:
+    struct Event
+    {
+        int every = 0;
+        int frames = 0;
+        int at = 0;
+
+        bool on(int frame) const { return every > 0 && frame >= at && (frame - at) % every < frames; }
+    };
+
+    struct Beam
+    {
+        double xc, yc, dx, dy, phi, p;
+        double driftX = 0, driftY = 0;
+        double jitter = 0;
+        Event step, hop, drop, burst;
+        double stepX = 0, stepY = 0;
+        double hopScale = 1, hopPhi = 0;
+        double burstScale = 1;
+    };
+
+    uint32_t seed = 1;
+    int frames = 0;
+    QVector<Beam> beams;
+
+    QString load(const QString &fileName);
+
+    /// Beams of the next frame of size `w` by `h`, peaks are multiplied by `scale`.
+    void next(int w, int h, int scale, QVector<CgnRenderBeam> &out);
+
+private:
+    int _frame = 0;
+    QRandomGenerator _rnd;
+    QVector<QPointF> _jitter;
+
+    void restart();
+};
+
+#endif // DEMO_SCENARIO_H
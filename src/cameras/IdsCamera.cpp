@@ -16,7 +16,7 @@
 //#define LOG_FRAME_TIME
 
 enum CamDataRow { ROW_RENDER_TIME, ROW_CALC_TIME,
-    ROW_FRAME_ERR, ROW_FRAME_UNDERRUN, ROW_FRAME_DROPPED, ROW_FRAME_INCOMPLETE };
+    ROW_FRAME_ERR, ROW_FRAME_UNDERRUN, ROW_FRAME_DROPPED, ROW_FRAME_INCOMPLETE, ROW_SATURATED };
 
 static QString makeDisplayName(const peak_camera_descriptor &cam)
 {
@@ -52,7 +52,6 @@ public:
     peak_status res;
     peak_buffer buf;
     peak_frame_handle frame;
-    QByteArray hdrBuf;
 
     int framesErr = 0;
     int framesDropped = 0;
@@ -69,7 +68,8 @@ public:
                 { ROW_FRAME_ERR, {framesErr, CamTableData::COUNT, framesErr > 0} },
                 { ROW_FRAME_DROPPED, {framesDropped, CamTableData::COUNT, framesDropped > 0} },
                 { ROW_FRAME_UNDERRUN, {framesUnderrun, CamTableData::COUNT, framesUnderrun > 0} },
-                { ROW_FRAME_INCOMPLETE, {framesIncomplete, CamTableData::COUNT, framesIncomplete > 0} }
+                { ROW_FRAME_INCOMPLETE, {framesIncomplete, CamTableData::COUNT, framesIncomplete > 0} },
+                { ROW_SATURATED, {bright.saturated, CamTableData::PERCENT, bright.clipped != 0} }
             };
         };
     }
@@ -267,10 +267,8 @@ public:
         res = IDS.peak_PixelFormat_Set(hCam, targetFormat);
         CHECK_ERR("Unable to set pixel format");
         cam->_cfg->bpp = c.bpp;
-        if (c.bpp > 8) {
-            hdrBuf = QByteArray(c.w*c.h*2, 0);
-            c.buf = (uint8_t*)hdrBuf.data();
-        }
+        // Packed frames are measured as is, without converting them to 16-bit
+        c.packing = c.bpp == 12 ? CGN_PACKED_12G24 : c.bpp == 10 ? CGN_PACKED_10G40 : CGN_UNPACKED;
         return {};
     }
 
@@ -376,12 +374,7 @@ public:
 
             if (res == PEAK_STATUS_SUCCESS) {
                 tm = timer.elapsed();
-                if (c.bpp == 12)
-                    cgn_convert_12g24_to_u16(c.buf, buf.memoryAddress, buf.memorySize);
-                else if (c.bpp == 10)
-                    cgn_convert_10g40_to_u16(c.buf, buf.memoryAddress, buf.memorySize);
-                else
-                    c.buf = buf.memoryAddress;
+                c.buf = buf.memoryAddress;
                 calcResult();
                 markCalcTime();
 
@@ -536,6 +529,7 @@ QList<QPair<int, QString>> IdsCamera::dataRows() const
         { ROW_FRAME_DROPPED,    qApp->tr("Dropped") },
         { ROW_FRAME_UNDERRUN,   qApp->tr("Underrun") },
         { ROW_FRAME_INCOMPLETE, qApp->tr("Incomplete") },
+        { ROW_SATURATED,        qApp->tr("Saturated") },
     };
 }
 
@@ -601,6 +595,12 @@ void IdsCamera::setRawView(bool on, bool reconfig)
         _peak->setRawView(on, reconfig);
 }
 
+void IdsCamera::recordDark(QObject *sender, bool flat)
+{
+    if (_peak)
+        _peak->requestDark(sender, flat);
+}
+
 void IdsCamera::initConfigMore(Ori::Dlg::ConfigDlgOpts &opts)
 {
     if (_peak)
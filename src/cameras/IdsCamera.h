@@ -41,6 +41,7 @@ public:
 
     void requestRawImg(QObject *sender) override;
     void setRawView(bool on, bool reconfig) override;
+    void recordDark(QObject *sender, bool flat) override;
 
     QString customId() const override { return _customId; }
 
@@ -109,10 +109,12 @@ void StillImageCamera::startCapture()
     const uchar* buf = _image.bits();
 
     CgnBeamCalc c;
+    memset(&c, 0, sizeof(CgnBeamCalc));
     c.w = _image.width();
     c.h = _image.height();
     c.bpp = fmt == QImage::Format_Grayscale16 ? 16 : 8;
     c.buf = (uint8_t*)buf;
+    c.deterministic = _config.calc.deterministic;
 
     int sz = c.w*c.h;
 
@@ -144,10 +146,19 @@ void StillImageCamera::startCapture()
         r.x2 = c.w;
         r.y2 = c.h;
     }
-    QVector<double> subtracted;
+    QVector<double> sat;
+    QVector<int32_t> pyramid;
     if (!_rawView && _config.bgnd.on) {
-        subtracted = QVector<double>(sz);
-        g.subtracted = subtracted.data();
+        if (_config.calc.sat) {
+            sat = QVector<double>(cgn_sat_size(c.w, c.h));
+            g.sat = sat.data();
+        }
+        if (_config.calc.pyramid > 1) {
+            pyramid = QVector<int32_t>(cgn_pyramid_size(c.w, c.h, _config.calc.pyramid));
+            g.pyramid = _config.calc.pyramid;
+            g.pyramid_buf = pyramid.data();
+            g.pyramid_min = _config.calc.pyramidMin;
+        }
     }
 
     timer.restart();
@@ -164,9 +175,23 @@ void StillImageCamera::startCapture()
     timer.restart();
     const double rangeTop = (1 << c.bpp) - 1;
 
+    // Raw pixels statistics are only needed when the background is not subtracted
+    CgnBeamHist hist;
+    QVector<uint32_t> histBins;
+    if (_rawView || !_config.bgnd.on) {
+        histBins.resize(cgn_hist_size(c.bpp));
+        hist.bins = histBins.data();
+        hist.x1 = 0;
+        hist.y1 = 0;
+        hist.x2 = c.w;
+        hist.y2 = c.h;
+        cgn_calc_hist(&c, &hist);
+    }
+
     if (_rawView)
     {
-        cgn_copy_to_f64(&c, graph, &g.max);
+        cgn_copy_to_f64(&c, graph, nullptr);
+        g.max = hist.max;
         _plot->invalidateGraph();
         r.nan = true;
         _plot->setResult(r, 0, rangeTop);
@@ -178,24 +203,24 @@ void StillImageCamera::startCapture()
     }
 
     if (_config.bgnd.on) {
+        cgn_copy_subtracted_f64(&c, &g, graph);
         if (_config.plot.normalize) {
-            cgn_copy_normalized_f64(g.subtracted, graph, sz, g.min,
+            cgn_normalize_f64(graph, sz, g.min,
                 _config.plot.fullRange ? rangeTop-g.min : g.max);
-        } else {
-            memcpy(graph, g.subtracted, sizeof(double)*sz);
         }
     } else {
         if (_config.plot.normalize) {
             if (c.bpp > 8) {
                 auto buf = (const uint16_t*)c.buf;
                 cgn_render_beam_to_doubles_norm_16(buf, sz, graph,
-                    _config.plot.fullRange ? rangeTop : cgn_find_max_16(buf, c.w*c.h));
+                    _config.plot.fullRange ? rangeTop : hist.max);
             } else {
                 cgn_render_beam_to_doubles_norm_8(c.buf, sz, graph,
-                    _config.plot.fullRange ? rangeTop : cgn_find_max_8(c.buf, c.w*c.h));
+                    _config.plot.fullRange ? rangeTop : hist.max);
             }
         } else {
-            cgn_copy_to_f64(&c, graph, &g.max);
+            cgn_copy_to_f64(&c, graph, nullptr);
+            g.max = hist.max;
         }
     }
     auto copyTime = timer.elapsed();
@@ -1,8 +1,14 @@
 #include "VirtualDemoCamera.h"
 
 #include "cameras/CameraWorker.h"
+#include "cameras/DemoScenario.h"
+
+#include "dialogs/OriConfigDlg.h"
 
 #include <QRandomGenerator>
+#include <QSettings>
+
+#include <atomic>
 
 #define LOG_ID "VirtualDemoCamera:"
 #define CAMERA_WIDTH 2592
@@ -10,9 +16,22 @@
 #define CAMERA_LOOP_TICK_MS 5
 #define CAMERA_FRAME_DELAY_MS 30
 #define CAMERA_HARD_FPS 30
+
+// Frames pre-rendered for the max throughput mode, they are served in a loop
+#define CAMERA_RING_FRAMES 8
+
+// Sensor noise in 8-bit pixel values, the beam peak is lowered by the dark offset and some noise margin.
+// Deeper pixels have them scaled to their range, so frames look the same at any bit depth
+#define NOISE_SEED 1
+#define NOISE_GAIN 0.1
+#define NOISE_READ 1.5
+#define NOISE_DARK 8
+#define NOISE_PATTERN_PIXEL 1.0
+#define NOISE_PATTERN_COLUMN 0.5
+#define NOISE_PEAK 230
 //#define LOG_FRAME_TIME
 
-enum CamDataRow { ROW_RENDER_TIME, ROW_CALC_TIME };
+enum CamDataRow { ROW_RENDER_TIME, ROW_CALC_TIME, ROW_SHOW_TIME, ROW_PLOT_TIME, ROW_DISPLAY_DROPPED };
 
 struct RandomOffset
 {
@@ -45,6 +64,30 @@ public:
 
     CgnBeamRender b;
     QVector<uint8_t> d;
+    CgnRenderNoise noise;
+    QVector<int16_t> pattern;
+    int scale;
+
+    // Scripted beams replace the jittering one when the scenario is loaded
+    DemoScenario scenario;
+    QVector<CgnRenderBeam> beams;
+
+    // Max throughput mode takes frames from the ring without waiting,
+    // so FPS is what calculation sustains and rendering is out of it
+    bool freeRun;
+    QVector<uint8_t> ring;
+    int ringIdx = 0;
+
+    // Results are drawn in the GUI thread, in max throughput mode the next one is only prepared
+    // when the previous is drawn, otherwise the due result is counted as dropped once per show slot
+    int readyCount = 0;
+    int plotCounted = 0;
+    std::atomic<int> shownCount = 0;
+    std::atomic<qint64> shownTime = 0;
+    qint64 readyTime = 0;
+    double avgShowTime = 0;
+    double avgPlotTime = 0;
+    int displayDropped = 0;
 
     RandomOffset dx_offset;
     RandomOffset dy_offset;
@@ -61,15 +104,51 @@ public:
         b.dy = b.dx*0.75;
         b.xc = b.w/2;
         b.yc = b.h/2;
-        b.p = 255;
+        // Frames of 10 and 12 bits are packed as IDS cameras give them, 16-bit ones are plain
+        freeRun = cam->maxThroughput();
+        scale = 1 << (cam->bpp() - 8);
+        b.p = (cam->sensorNoise() ? NOISE_PEAK : 255) * scale;
         b.phi = 12;
-        d = QVector<uint8_t>(b.w * b.h);
+        b.bpp = cam->bpp();
+        b.packing = b.bpp == 12 ? CGN_RENDER_12G24 : b.bpp == 10 ? CGN_RENDER_10G40 : CGN_RENDER_UNPACKED;
+        d = QVector<uint8_t>(cgn_render_row_bytes(&b) * b.h);
         b.buf = d.data();
+        // Rows are rendered by the same workers that calculate the frame afterwards
+        b.run = [](void *pool, CgnRenderTask task, void *ctx, int count) {
+            cgn_pool_run((CgnBeamPool*)pool, task, ctx, count);
+        };
+
+        if (!cam->scenarioFile().isEmpty()) {
+            QString err = scenario.load(cam->scenarioFile());
+            if (!err.isEmpty()) {
+                qWarning() << LOG_ID << err;
+                scenario.beams.clear();
+            } else {
+                qDebug() << LOG_ID << "Scenario" << cam->scenarioFile() << "beams:" << scenario.beams.size();
+            }
+        }
+
+        // Frames are reproducible from the seed, noise only depends on the frame number.
+        // Noise takes several times longer to render than the clean beam, so it's off by default
+        b.noise = nullptr;
+        if (cam->sensorNoise()) {
+            const uint32_t seed = scenario.beams.isEmpty() ? NOISE_SEED : scenario.seed;
+            pattern = QVector<int16_t>(b.w * b.h);
+            cgn_render_pattern(b.w, b.h, seed, NOISE_PATTERN_PIXEL * scale, NOISE_PATTERN_COLUMN * scale, pattern.data());
+            noise.seed = seed;
+            noise.gain = NOISE_GAIN * scale;
+            noise.read = NOISE_READ * scale;
+            noise.dark = NOISE_DARK * scale;
+            noise.pattern = pattern.constData();
+            b.noise = &noise;
+        }
+        b.frame = 0;
 
         c.w = b.w;
         c.h = b.h;
         c.buf = b.buf;
-        c.bpp = 8;
+        c.bpp = b.bpp;
+        c.packing = b.bpp == 12 ? CGN_PACKED_12G24 : b.bpp == 10 ? CGN_PACKED_10G40 : CGN_UNPACKED;
 
         dx_offset = RandomOffset(b.dx, b.dx-20, b.dx+20);
         dy_offset = RandomOffset(b.dy, b.dy-20, b.dy+20);
@@ -81,10 +160,16 @@ public:
         graph = plot->rawGraph();
 
         tableData = [this]{
-            return QMap<int, CamTableData>{
+            QMap<int, CamTableData> data {
                 { ROW_RENDER_TIME, {avgAcqTime} },
                 { ROW_CALC_TIME, {avgCalcTime} },
             };
+            if (freeRun) {
+                data[ROW_SHOW_TIME] = {avgShowTime};
+                data[ROW_PLOT_TIME] = {avgPlotTime};
+                data[ROW_DISPLAY_DROPPED] = {displayDropped, CamTableData::COUNT, displayDropped > 0};
+            }
+            return data;
         };
 
         configure();
@@ -101,35 +186,100 @@ public:
             thread->msleep(CAMERA_LOOP_TICK_MS);
             return true;
         }
+        markFrame();
+        return false;
+    }
+
+    inline void markFrame()
+    {
         avgFrameCount++;
         avgFrameTime += tm - prevFrame;
         prevFrame = tm;
-        return false;
+    }
+
+    void render()
+    {
+        b.pool = pool;
+        if (scenario.beams.isEmpty()) {
+            cgn_render_beam_tilted(&b);
+
+            b.dx = dx_offset.next();
+            b.dy = dy_offset.next();
+            b.xc = xc_offset.next();
+            b.yc = yc_offset.next();
+            b.phi = phi_offset.next();
+        } else {
+            scenario.next(b.w, b.h, scale, beams);
+            cgn_render_beams(&b, beams.constData(), beams.size());
+        }
+        b.frame++;
+    }
+
+    void renderRing()
+    {
+        const int sz = d.size();
+        ring = QVector<uint8_t>(sz * CAMERA_RING_FRAMES);
+        for (int i = 0; i < CAMERA_RING_FRAMES; i++) {
+            b.buf = ring.data() + i*sz;
+            render();
+        }
+        b.buf = d.data();
+        qDebug() << LOG_ID << "Pre-rendered frames:" << CAMERA_RING_FRAMES;
+    }
+
+    // Called in the GUI thread after the plot has been drawn
+    void resultShown()
+    {
+        shownTime = timer.elapsed();
+        shownCount++;
+    }
+
+    void show()
+    {
+        if (freeRun && shownCount != readyCount) {
+            if (tm - prevReady >= PLOT_FRAME_DELAY_MS) {
+                prevReady += PLOT_FRAME_DELAY_MS;
+                displayDropped++;
+            }
+            return;
+        }
+        if (plotCounted != readyCount) {
+            plotCounted = readyCount;
+            avgPlotTime = avgPlotTime*0.9 + (shownTime - readyTime)*0.1;
+        }
+        const qint64 t = timer.elapsed();
+        if (showResults()) {
+            readyTime = timer.elapsed();
+            avgShowTime = avgShowTime*0.9 + (readyTime - t)*0.1;
+            readyCount++;
+            emit cam->ready();
+        }
     }
 
     void run() {
         qDebug() << LOG_ID << "Started" << QThread::currentThreadId();
+        if (freeRun)
+            renderRing();
         start = QDateTime::currentDateTime();
         timer.start();
         while (true) {
-            if (waitFrame()) continue;
+            if (freeRun) {
+                tm = timer.elapsed();
+                markFrame();
+            } else if (waitFrame()) continue;
 
             tm = timer.elapsed();
-            cgn_render_beam_tilted(&b);
+            if (freeRun) {
+                c.buf = ring.data() + ringIdx*d.size();
+                ringIdx = (ringIdx + 1) % CAMERA_RING_FRAMES;
+            } else render();
             markAcqTime();
 
-            b.dx = dx_offset.next();
-            b.dy = dy_offset.next();
-            b.xc = xc_offset.next();
-            b.yc = yc_offset.next();
-            b.phi = phi_offset.next();
-
             tm = timer.elapsed();
             calcResult();
             markCalcTime();
 
-            if (showResults())
-                emit cam->ready();
+            show();
 
             if (tm - prevStat >= STAT_DELAY_MS) {
                 prevStat = tm;
@@ -139,7 +289,7 @@ public:
                 avgFrameCount = 0;
                 CameraStats st {
                     .fps = 1000.0/ft,
-                    .hardFps = CAMERA_HARD_FPS,
+                    .hardFps = freeRun ? 0 : CAMERA_HARD_FPS,
                     .measureTime = measureStart > 0 ? timer.elapsed() - measureStart : -1,
                 };
                 emit cam->stats(st);
@@ -148,7 +298,10 @@ public:
                     << "FPS:" << st.fps
                     << "avgFrameTime:" << qRound(ft)
                     << "avgRenderTime:" << qRound(avgAcqTime)
-                    << "avgCalcTime:" << qRound(avgCalcTime);
+                    << "avgCalcTime:" << qRound(avgCalcTime)
+                    << "avgShowTime:" << qRound(avgShowTime)
+                    << "avgPlotTime:" << qRound(avgPlotTime)
+                    << "displayDropped:" << displayDropped;
             #endif
                 if (cam->isInterruptionRequested()) {
                     qDebug() << LOG_ID << "Interrupted by user";
@@ -164,6 +317,9 @@ VirtualDemoCamera::VirtualDemoCamera(PlotIntf *plot, TableIntf *table, QObject *
     Camera(plot, table, "VirtualDemoCamera"), QThread(parent)
 {
     loadConfig();
+    _startScenarioFile = _scenarioFile;
+    _startMaxThroughput = _maxThroughput;
+    _startSensorNoise = _sensorNoise;
 
     _render.reset(new BeamRenderer(plot, table, this, this));
 
@@ -182,6 +338,14 @@ int VirtualDemoCamera::height() const
 
 QList<QPair<int, QString> > VirtualDemoCamera::dataRows() const
 {
+    if (_maxThroughput)
+        return {
+            { ROW_RENDER_TIME, qApp->tr("Acq. time") },
+            { ROW_CALC_TIME, qApp->tr("Calc time") },
+            { ROW_SHOW_TIME, qApp->tr("Show time") },
+            { ROW_PLOT_TIME, qApp->tr("Plot time") },
+            { ROW_DISPLAY_DROPPED, qApp->tr("Not shown") },
+        };
     return {
         { ROW_RENDER_TIME, qApp->tr("Render time") },
         { ROW_CALC_TIME, qApp->tr("Calc time") },
@@ -190,6 +354,8 @@ QList<QPair<int, QString> > VirtualDemoCamera::dataRows() const
 
 void VirtualDemoCamera::startCapture()
 {
+    // Connected after the plot window has connected to ready(), so the result is marked shown when it's drawn
+    connect(this, &VirtualDemoCamera::ready, this, [this]{ _render->resultShown(); });
     start();
 }
 
@@ -208,11 +374,74 @@ void VirtualDemoCamera::run()
     _render->run();
 }
 
+bool VirtualDemoCamera::needsRestart() const
+{
+    // `_bpp` is only changed by loadConfig(), the dialog edits the radio flags
+    return selectedBpp() != _bpp ||
+        _scenarioFile != _startScenarioFile ||
+        _maxThroughput != _startMaxThroughput ||
+        _sensorNoise != _startSensorNoise;
+}
+
 void VirtualDemoCamera::camConfigChanged()
 {
     _render->reconfigure();
 }
 
+void VirtualDemoCamera::initConfigMore(Ori::Dlg::ConfigDlgOpts &opts)
+{
+    using namespace Ori::Dlg;
+    int pageHard = cfgMax + 1;
+    _bpp8 = _bpp == 8;
+    _bpp10 = _bpp == 10;
+    _bpp12 = _bpp == 12;
+    _bpp16 = _bpp == 16;
+    opts.pages << ConfigPage(pageHard, qApp->tr("Hardware"), ":/toolbar/hardware");
+    opts.items
+        << (new ConfigItemSection(pageHard, qApp->tr("Pixel format")))
+            ->withHint(qApp->tr("Camera restarts to apply"))
+        << (new ConfigItemBool(pageHard, qApp->tr("8 bit"), &_bpp8))->withRadioGroup("pixel_format")
+        << (new ConfigItemBool(pageHard, qApp->tr("10 bit (Mono10g40)"), &_bpp10))->withRadioGroup("pixel_format")
+        << (new ConfigItemBool(pageHard, qApp->tr("12 bit (Mono12g24)"), &_bpp12))->withRadioGroup("pixel_format")
+        << (new ConfigItemBool(pageHard, qApp->tr("16 bit"), &_bpp16))->withRadioGroup("pixel_format")
+        << new ConfigItemSpace(pageHard, 12)
+        << (new ConfigItemSection(pageHard, qApp->tr("Frames")))
+            ->withHint(qApp->tr("Camera restarts to apply"))
+        << (new ConfigItemBool(pageHard, qApp->tr("Max throughput"), &_maxThroughput))
+            ->withHint(qApp->tr(
+                "Frames are taken without waiting from a ring of pre-rendered ones, "
+                "so FPS is what calculation sustains. Results due to show while the plot "
+                "is still drawing the previous one are counted as not shown"), true)
+        << (new ConfigItemBool(pageHard, qApp->tr("Sensor noise"), &_sensorNoise))
+            ->withHint(qApp->tr(
+                "Shot and read noise, dark offset and fixed pattern are added to frames. "
+                "Rendering takes several times longer then, that lowers FPS of the normal mode"), true)
+        << new ConfigItemSpace(pageHard, 12)
+        << (new ConfigItemSection(pageHard, qApp->tr("Scenario")))
+            ->withHint(qApp->tr("Camera restarts to apply"))
+        << (new ConfigItemStr(pageHard, qApp->tr("File"), &_scenarioFile))
+            ->withHint(qApp->tr("INI file of scripted beams, e.g. beams/demo_scenario.ini. Empty for a single jittering beam"))
+    ;
+}
+
+void VirtualDemoCamera::saveConfigMore(QSettings *s)
+{
+    s->setValue("hard.bpp", selectedBpp());
+    s->setValue("hard.scenario", _scenarioFile);
+    s->setValue("hard.maxThroughput", _maxThroughput);
+    s->setValue("hard.sensorNoise", _sensorNoise);
+}
+
+void VirtualDemoCamera::loadConfigMore(QSettings *s)
+{
+    _bpp = s->value("hard.bpp", 8).toInt();
+    if (_bpp != 10 && _bpp != 12 && _bpp != 16)
+        _bpp = 8;
+    _scenarioFile = s->value("hard.scenario").toString();
+    _maxThroughput = s->value("hard.maxThroughput", false).toBool();
+    _sensorNoise = s->value("hard.sensorNoise", false).toBool();
+}
+
 void VirtualDemoCamera::requestRawImg(QObject *sender)
 {
     _render->requestRawImg(sender);
@@ -222,3 +451,8 @@ void VirtualDemoCamera::setRawView(bool on, bool reconfig)
 {
     _render->setRawView(on, reconfig);
 }
+
+void VirtualDemoCamera::recordDark(QObject *sender, bool flat)
+{
+    _render->requestDark(sender, flat);
+}
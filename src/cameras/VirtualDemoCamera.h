@@ -18,7 +18,14 @@ public:
     QString name() const override { return "Demo"; }
     int width() const override;
     int height() const override;
-    int bpp() const override { return 8; }
+    int bpp() const override { return _bpp; }
+    QString scenarioFile() const { return _scenarioFile; }
+    bool maxThroughput() const { return _maxThroughput; }
+    bool sensorNoise() const { return _sensorNoise; }
+
+    // Frame format and source are taken by the renderer when the camera is created,
+    // so it has to be recreated after they have been changed in the config dialog
+    bool needsRestart() const;
     PixelScale sensorScale() const override { return { .on=true, .factor=2.5, .unit="um" }; }
     QList<QPair<int, QString>> dataRows() const override;
 
@@ -30,6 +37,7 @@ public:
 
     void requestRawImg(QObject *sender) override;
     void setRawView(bool on, bool reconfig) override;
+    void recordDark(QObject *sender, bool flat) override;
 
 signals:
     void ready();
@@ -37,12 +45,25 @@ signals:
 
 protected:
     void run() override;
+    void initConfigMore(Ori::Dlg::ConfigDlgOpts &opts) override;
+    void loadConfigMore(QSettings *s) override;
+    void saveConfigMore(QSettings *s) override;
 
 private slots:
     void camConfigChanged();
 
 private:
     QSharedPointer<BeamRenderer> _render;
+    int _bpp = 8;
+    QString _scenarioFile;
+    bool _maxThroughput = false;
+    bool _sensorNoise = false;
+    bool _bpp8 = true, _bpp10 = false, _bpp12 = false, _bpp16 = false;
+    QString _startScenarioFile;
+    bool _startMaxThroughput = false;
+    bool _startSensorNoise = false;
+
+    int selectedBpp() const { return _bpp16 ? 16 : _bpp12 ? 12 : _bpp10 ? 10 : 8; }
 };
 
 #endif // VIRTUAL_DEMO_CAMERA_H
@@ -110,6 +110,9 @@ void TableIntf::showResult()
             case CamTableData::COUNT:
                 item->setText(QStringLiteral(" %1 ").arg(data.value.toInt()));
                 break;
+            case CamTableData::PERCENT:
+                item->setText(QStringLiteral(" %1 % ").arg(data.value.toDouble()*100, 0, 'f', 2));
+                break;
         }
         item->setBackground(data.warn ? QColor(_warnColor) : Qt::transparent);
     }
@@ -257,9 +257,12 @@ void PlotWindow::createMenuBar()
     _actionUseRoi->setCheckable(true);
     _actionSetCamCustomName = A_(tr("Set Custom Name..."), this, &PlotWindow::setCamCustomName);
     _actionCamConfig = A_(tr("Settings..."), this, [this]{ PlotWindow::editCamConfig(-1); }, ":/toolbar/settings");
+    _actionRecordDark = A_(tr("Record Dark Frame..."), this, [this]{ recordDark(false); });
+    _actionRecordFlat = A_(tr("Record Flat Field..."), this, [this]{ recordDark(true); });
     menuBar()->addMenu(M_(tr("Camera"), {
         _actionMeasure, 0,
         _actionEditRoi, _actionUseRoi, 0,
+        _actionRecordDark, _actionRecordFlat, 0,
         _actionSetCamCustomName, _actionCamConfig,
     }));
 
@@ -447,9 +450,26 @@ bool PlotWindow::event(QEvent *event)
         exportImageDlg(e->buf, _camera->width(), _camera->height(), _camera->bpp() > 8);
         return true;
     }
+    if (auto e = dynamic_cast<DarkEvent*>(event); e) {
+        if (!e->error.isEmpty())
+            Ori::Gui::PopupMessage::error(e->error);
+        else Ori::Gui::PopupMessage::affirm(e->flat ? tr("Flat field recorded") : tr("Dark frame recorded"));
+        return true;
+    }
     return QMainWindow::event(event);
 }
 
+void PlotWindow::recordDark(bool flat)
+{
+    if (!_camera) return;
+    int frames = _camera->config().bgnd.darkFrames;
+    if (!Ori::Dlg::yes(flat
+        ? tr("Illuminate the sensor uniformly.\n\n%1 frames will be averaged into the flat field. Continue?").arg(frames)
+        : tr("Cover the sensor from any light.\n\n%1 frames will be averaged into the dark frame. Continue?").arg(frames)))
+        return;
+    _camera->recordDark(this, flat);
+}
+
 void PlotWindow::newWindow()
 {
     if (!QProcess::startDetached(qApp->applicationFilePath(), {}))
@@ -544,6 +564,8 @@ void PlotWindow::updateControls()
     _mru->setDisabled(started);
     _buttonSelectCam->setDisabled(started);
     _actionCamConfig->setDisabled(started || !opened);
+    _actionRecordDark->setDisabled(started || !opened);
+    _actionRecordFlat->setDisabled(started || !opened);
     _actionEditRoi->setDisabled(started || !opened);
     _actionUseRoi->setDisabled(started || !opened);
     _actionOpenImg->setDisabled(started);
@@ -698,6 +720,11 @@ void PlotWindow::editCamConfig(int pageId)
     const PixelScale prevScale = _camera->pixelScale();
     if (!_camera->editConfig(pageId))
         return;
+    auto demo = dynamic_cast<VirtualDemoCamera*>(_camera.get());
+    if (demo && demo->needsRestart()) {
+        restartCamDemo();
+        return;
+    }
     configChanged();
     if (_camera->pixelScale() != prevScale) {
         if (dynamic_cast<VirtualDemoCamera*>(_camera.get())) {
@@ -789,6 +816,13 @@ void PlotWindow::activateCamDemo()
     updateControls();
 }
 
+void PlotWindow::restartCamDemo()
+{
+    stopCapture();
+    _camera.reset(nullptr);
+    activateCamDemo();
+}
+
 #ifdef WITH_IDS
 void PlotWindow::activateCamIds()
 {
@@ -48,7 +48,8 @@ private:
         *_actionEditRoi, *_actionUseRoi, *_actionZoomFull, *_actionZoomRoi,
         *_actionCamWelcome, *_actionCamImage, *_actionCamDemo, *_actionRefreshCams,
         *_actionResultsPanel, *_actionHardConfig, *_actionSaveRaw, *_actionRawView,
-        *_actionCrosshairsShow, *_actionCrosshairsEdit, *_actionSetCamCustomName;
+        *_actionCrosshairsShow, *_actionCrosshairsEdit, *_actionSetCamCustomName,
+        *_actionRecordDark, *_actionRecordFlat;
     QAction *_buttonMeasure, *_buttonOpenImg;
     QActionGroup *_colorMapActions;
     QTableWidget *_table;
@@ -77,12 +78,14 @@ private:
     void activateCamWelcome();
     void activateCamImage();
     void activateCamDemo();
+    void restartCamDemo();
 #ifdef WITH_IDS
     void activateCamIds();
 #endif
     void editCamConfig(int pageId = -1);
     void newWindow();
     void openImageDlg();
+    void recordDark(bool flat);
     void selectColorMapFile();
     void setCamCustomName();
     void toggleCrosshairsEditing();